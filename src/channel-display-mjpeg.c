@@ -23,13 +23,15 @@
 
 #include "channel-display-priv.h"
 
+/* queued to the decoder threads to make them exit */
+static display_frame mjpeg_thread_exit;
+
 static void mjpeg_src_init(struct jpeg_decompress_struct *cinfo)
 {
-    display_stream *st = SPICE_CONTAINEROF(cinfo->src, display_stream, mjpeg_src);
-    uint8_t *data;
+    mjpeg_decoder *dec = SPICE_CONTAINEROF(cinfo->src, mjpeg_decoder, src);
 
-    cinfo->src->bytes_in_buffer = stream_get_current_frame(st, &data);
-    cinfo->src->next_input_byte = data;
+    cinfo->src->bytes_in_buffer = dec->data_size;
+    cinfo->src->next_input_byte = dec->data;
 }
 
 static boolean mjpeg_src_fill(struct jpeg_decompress_struct *cinfo)
@@ -49,9 +51,187 @@ static void mjpeg_src_term(struct jpeg_decompress_struct *cinfo)
     /* nothing */
 }
 
+G_GNUC_INTERNAL
+void mjpeg_decoder_init(mjpeg_decoder *dec)
+{
+    dec->cinfo.err = jpeg_std_error(&dec->jerr);
+    jpeg_create_decompress(&dec->cinfo);
+
+    dec->src.init_source         = mjpeg_src_init;
+    dec->src.fill_input_buffer   = mjpeg_src_fill;
+    dec->src.skip_input_data     = mjpeg_src_skip;
+    dec->src.resync_to_restart   = jpeg_resync_to_restart;
+    dec->src.term_source         = mjpeg_src_term;
+    dec->cinfo.src               = &dec->src;
+}
+
+G_GNUC_INTERNAL
+void mjpeg_decoder_cleanup(mjpeg_decoder *dec)
+{
+    jpeg_destroy_decompress(&dec->cinfo);
+}
+
+/* any thread, the decoder must not be shared */
+static void mjpeg_decode_start(mjpeg_decoder *dec, display_frame *frame,
+                               gboolean back_compat)
+{
+    dec->data = frame->data;
+    dec->data_size = frame->data_size;
+
+    jpeg_read_header(&dec->cinfo, 1);
+#ifdef JCS_EXTENSIONS
+    // requires jpeg-turbo
+    if (back_compat)
+        dec->cinfo.out_color_space = JCS_EXT_RGBX;
+    else
+        dec->cinfo.out_color_space = JCS_EXT_BGRX;
+#else
+#warning "You should consider building with libjpeg-turbo"
+    dec->cinfo.out_color_space = JCS_RGB;
+#endif
+
+#ifndef SPICE_QUALITY
+    dec->cinfo.dct_method = JDCT_IFAST;
+    dec->cinfo.do_fancy_upsampling = FALSE;
+    dec->cinfo.do_block_smoothing = FALSE;
+    dec->cinfo.dither_mode = JDITHER_ORDERED;
+#endif
+    jpeg_start_decompress(&dec->cinfo);
+}
+
+/* any thread, the decoder must not be shared */
+G_GNUC_INTERNAL
+void mjpeg_decode(mjpeg_decoder *dec, display_frame *frame,
+                         gboolean back_compat)
+{
+    int width = frame->width;
+    uint8_t *dest = frame->out_frame;
+    uint8_t *lines[4];
+
+    // TODO: in theory should check cinfo.output_height match with our height
+    mjpeg_decode_start(dec, frame, back_compat);
+    /* rec_outbuf_height is the recommended size of the output buffer we
+     * pass to libjpeg for optimum performance
+     */
+    if (dec->cinfo.rec_outbuf_height > G_N_ELEMENTS(lines)) {
+        jpeg_abort_decompress(&dec->cinfo);
+        g_return_if_reached();
+    }
+
+    while (dec->cinfo.output_scanline < dec->cinfo.output_height) {
+        /* only used when JCS_EXTENSIONS is undefined */
+        G_GNUC_UNUSED unsigned int lines_read;
+
+        for (unsigned int j = 0; j < dec->cinfo.rec_outbuf_height; j++) {
+            lines[j] = dest;
+#ifdef JCS_EXTENSIONS
+            dest += 4 * width;
+#else
+            dest += 3 * width;
+#endif
+        }
+        lines_read = jpeg_read_scanlines(&dec->cinfo, lines,
+                                dec->cinfo.rec_outbuf_height);
+#ifndef JCS_EXTENSIONS
+        {
+            uint8_t *s = lines[0];
+            uint32_t *d = (uint32_t *)s;
+
+            if (back_compat) {
+                for (unsigned int j = lines_read * width; j > 0; ) {
+                    j -= 1; // reverse order, bad for cache?
+                    d[j] = s[j * 3 + 0] |
+                        s[j * 3 + 1] << 8 |
+                        s[j * 3 + 2] << 16;
+                }
+            } else {
+                for (unsigned int j = lines_read * width; j > 0; ) {
+                    j -= 1; // reverse order, bad for cache?
+                    d[j] = s[j * 3 + 0] << 16 |
+                        s[j * 3 + 1] << 8 |
+                        s[j * 3 + 2];
+                }
+            }
+        }
+#endif
+        dest = &frame->out_frame[dec->cinfo.output_scanline * width * 4];
+    }
+    jpeg_finish_decompress(&dec->cinfo);
+}
+
+/* decoder thread */
+static gpointer mjpeg_decode_thread(gpointer data)
+{
+    display_stream *st = data;
+    display_frame *frame;
+    mjpeg_decoder dec;
+
+    mjpeg_decoder_init(&dec);
+    while ((frame = g_async_queue_pop(st->decode_queue)) != &mjpeg_thread_exit) {
+        if (!g_atomic_int_get(&frame->dropped)) {
+            guint64 start = g_get_monotonic_time();
+
+            frame->out_frame = stream_frame_buffer_get(st, frame->width * frame->height * 4);
+            mjpeg_decode(&dec, frame, st->back_compat);
+            frame->decode_time = g_get_monotonic_time() - start;
+        }
+        /* the frame belongs to the main context again */
+        g_idle_add_full(G_PRIORITY_DEFAULT, display_frame_decoded, frame, NULL);
+    }
+    mjpeg_decoder_cleanup(&dec);
+
+    return NULL;
+}
+
+static void mjpeg_start_decode_threads(display_stream *st)
+{
+    guint i;
+
+    if (st->ndecode_threads == 0)
+        return;
+
+    st->decode_queue = g_async_queue_new();
+    st->decode_threads = g_new0(GThread *, st->ndecode_threads);
+    for (i = 0; i < st->ndecode_threads; i++) {
+#if GLIB_CHECK_VERSION(2,32,0)
+        st->decode_threads[i] = g_thread_new("mjpeg-decode", mjpeg_decode_thread, st);
+#else
+        st->decode_threads[i] = g_thread_create(mjpeg_decode_thread, st, TRUE, NULL);
+#endif
+    }
+    SPICE_DEBUG("MJPEG stream decoding with %u threads", st->ndecode_threads);
+}
+
+static void mjpeg_stop_decode_threads(display_stream *st)
+{
+    GList *l;
+    guint i;
+
+    if (st->decode_queue == NULL)
+        return;
+
+    /* don't bother decoding what is still queued */
+    for (l = g_queue_peek_head_link(st->inflight); l != NULL; l = l->next) {
+        display_frame *frame = l->data;
+        g_atomic_int_set(&frame->dropped, TRUE);
+    }
+
+    for (i = 0; i < st->ndecode_threads; i++)
+        g_async_queue_push(st->decode_queue, &mjpeg_thread_exit);
+    for (i = 0; i < st->ndecode_threads; i++)
+        g_thread_join(st->decode_threads[i]);
+
+    g_free(st->decode_threads);
+    st->decode_threads = NULL;
+    g_async_queue_unref(st->decode_queue);
+    st->decode_queue = NULL;
+}
+
 G_GNUC_INTERNAL
 void stream_mjpeg_init(display_stream *st)
 {
+    st->back_compat = st->channel->priv->peer_hdr.major_version == 1;
+
 #ifdef USE_VA
     // Try hardware acceleration first, fallback to soft decode if it fails
     tinyjpeg_session *session;
@@ -69,18 +249,51 @@ void stream_mjpeg_init(display_stream *st)
         SPICE_DEBUG("New accelerated MJPEG stream of size %dx%d, pos %d,%d",
                     session->dst_rect.width, session->dst_rect.height,
                     session->dst_rect.x, session->dst_rect.y);
-        return;
     }
 #endif
-    st->mjpeg_cinfo.err = jpeg_std_error(&st->mjpeg_jerr);
-    jpeg_create_decompress(&st->mjpeg_cinfo);
+    mjpeg_decoder_init(&st->mjpeg);
+    if (!st->hw_accel)
+        mjpeg_start_decode_threads(st);
+}
+
+#ifdef JCS_EXTENSIONS
+/* whether stream_mjpeg_data_direct() can decode @frame in the surface */
+static gboolean mjpeg_can_decode_direct(display_stream *st, display_frame *frame)
+{
+    display_surface *surface = st->surface;
+    SpiceRect *dest = &frame->dest;
 
-    st->mjpeg_src.init_source         = mjpeg_src_init;
-    st->mjpeg_src.fill_input_buffer   = mjpeg_src_fill;
-    st->mjpeg_src.skip_input_data     = mjpeg_src_skip;
-    st->mjpeg_src.resync_to_restart   = jpeg_resync_to_restart;
-    st->mjpeg_src.term_source         = mjpeg_src_term;
-    st->mjpeg_cinfo.src               = &st->mjpeg_src;
+    return !st->hw_accel && !st->back_compat &&
+        surface->format == SPICE_SURFACE_FMT_32_xRGB &&
+        dest->right - dest->left == frame->width &&
+        dest->bottom - dest->top == frame->height &&
+        dest->left >= 0 && dest->top >= 0 &&
+        dest->right <= surface->width && dest->bottom <= surface->height;
+}
+#endif
+
+/*
+ * Frames which can be decoded straight into the surface are left to
+ * display_stream_render(): the decoder threads can't write to the surface
+ * while the main context draws on it, and going through them would cost
+ * a copy of the frame.
+ */
+/* main context */
+G_GNUC_INTERNAL
+gboolean stream_mjpeg_queue_frame(display_stream *st, display_frame *frame)
+{
+    if (st->decode_queue == NULL || st->hw_accel)
+        return FALSE;
+#ifdef JCS_EXTENSIONS
+    if (mjpeg_can_decode_direct(st, frame))
+        return FALSE;
+#endif
+
+    frame->inflight = TRUE;
+    g_queue_push_tail(st->inflight, frame);
+    g_async_queue_push(st->decode_queue, frame);
+
+    return TRUE;
 }
 
 #ifdef USE_VA
@@ -112,110 +325,141 @@ static int stream_mjpeg_data_va(display_stream *st)
         st->hw_accel = 0;
         return 0;
     }
-    g_free(st->out_frame);
-    st->out_frame = NULL;
     return 1;
 }
 #endif
 
+/* main context, for frames not decoded by the decoder threads */
 G_GNUC_INTERNAL
-void stream_mjpeg_data(display_stream *st)
+void stream_mjpeg_data(display_stream *st, display_frame *frame)
 {
-    gboolean back_compat = st->channel->priv->peer_hdr.major_version == 1;
-    int width;
-    int height;
-    uint8_t *dest;
-    uint8_t *lines[4];
-
 #ifdef USE_VA
     if (st->hw_accel && stream_mjpeg_data_va(st)) return;
 #endif
 
-    stream_get_dimensions(st, &width, &height);
-    dest = g_malloc0(width * height * 4);
-
-    g_free(st->out_frame);
-    st->out_frame = dest;
+    frame->out_frame = stream_frame_buffer_get(st, frame->width * frame->height * 4);
+    mjpeg_decode(&st->mjpeg, frame, st->back_compat);
+}
 
-    jpeg_read_header(&st->mjpeg_cinfo, 1);
 #ifdef JCS_EXTENSIONS
-    // requires jpeg-turbo
-    if (back_compat)
-        st->mjpeg_cinfo.out_color_space = JCS_EXT_RGBX;
-    else
-        st->mjpeg_cinfo.out_color_space = JCS_EXT_BGRX;
-#else
-#warning "You should consider building with libjpeg-turbo"
-    st->mjpeg_cinfo.out_color_space = JCS_RGB;
-#endif
+/* main context */
+static void mjpeg_copy_clipped_line(display_surface *surface, uint8_t *line,
+                                    int x, int y,
+                                    pixman_box32_t *rects, int nrects)
+{
+    int i;
 
-#ifndef SPICE_QUALITY
-    st->mjpeg_cinfo.dct_method = JDCT_IFAST;
-    st->mjpeg_cinfo.do_fancy_upsampling = FALSE;
-    st->mjpeg_cinfo.do_block_smoothing = FALSE;
-    st->mjpeg_cinfo.dither_mode = JDITHER_ORDERED;
-#endif
-    // TODO: in theory should check cinfo.output_height match with our height
-    jpeg_start_decompress(&st->mjpeg_cinfo);
-    /* rec_outbuf_height is the recommended size of the output buffer we
-     * pass to libjpeg for optimum performance
-     */
-    if (st->mjpeg_cinfo.rec_outbuf_height > G_N_ELEMENTS(lines)) {
-        jpeg_abort_decompress(&st->mjpeg_cinfo);
-        g_return_if_reached();
+    for (i = 0; i < nrects; i++) {
+        if (y < rects[i].y1 || y >= rects[i].y2)
+            continue;
+        memcpy(surface->data + y * surface->stride + rects[i].x1 * 4,
+               line + (rects[i].x1 - x) * 4,
+               (rects[i].x2 - rects[i].x1) * 4);
     }
+}
 
-    while (st->mjpeg_cinfo.output_scanline < st->mjpeg_cinfo.output_height) {
-        /* only used when JCS_EXTENSIONS is undefined */
-        G_GNUC_UNUSED unsigned int lines_read;
+/*
+ * Decode the frame straight into the destination surface, saving the
+ * copy done by put_image(). Only possible when the frame is not scaled
+ * and has the surface pixel format. If the clip is not the whole
+ * destination, scanlines are decoded in a small buffer and only the
+ * visible spans are copied.
+ *
+ * Returns: %FALSE if the frame must be decoded with stream_mjpeg_data()
+ */
+/* main context */
+G_GNUC_INTERNAL
+gboolean stream_mjpeg_data_direct(display_stream *st, display_frame *frame,
+                                  gboolean top_down)
+{
+    display_surface *surface = st->surface;
+    struct jpeg_decompress_struct *cinfo = &st->mjpeg.cinfo;
+    SpiceRect *dest = &frame->dest;
+    pixman_region32_t clip;
+    pixman_box32_t *rects = NULL;
+    int nrects = 0;
+    uint8_t *scratch = NULL;
+    uint8_t *first_line;
+    uint8_t *lines[4];
+    int stride;
 
-        for (unsigned int j = 0; j < st->mjpeg_cinfo.rec_outbuf_height; j++) {
-            lines[j] = dest;
-#ifdef JCS_EXTENSIONS
-            dest += 4 * width;
-#else
-            dest += 3 * width;
-#endif
+    if (!mjpeg_can_decode_direct(st, frame))
+        return FALSE;
+
+    pixman_region32_init_rect(&clip, dest->left, dest->top,
+                              frame->width, frame->height);
+    if (st->have_region) {
+        pixman_region32_intersect(&clip, &clip, &st->region);
+        if (!pixman_region32_not_empty(&clip)) {
+            /* nothing visible */
+            pixman_region32_fini(&clip);
+            return TRUE;
         }
-        lines_read = jpeg_read_scanlines(&st->mjpeg_cinfo, lines,
-                                st->mjpeg_cinfo.rec_outbuf_height);
-#ifndef JCS_EXTENSIONS
-        {
-            uint8_t *s = lines[0];
-            uint32_t *d = (uint32_t *)s;
+        if (pixman_region32_n_rects(&clip) != 1 ||
+            pixman_region32_extents(&clip)->x1 != dest->left ||
+            pixman_region32_extents(&clip)->y1 != dest->top ||
+            pixman_region32_extents(&clip)->x2 != dest->right ||
+            pixman_region32_extents(&clip)->y2 != dest->bottom)
+            rects = pixman_region32_rectangles(&clip, &nrects);
+    }
 
-            if (back_compat) {
-                for (unsigned int j = lines_read * width; j > 0; ) {
-                    j -= 1; // reverse order, bad for cache?
-                    d[j] = s[j * 3 + 0] |
-                        s[j * 3 + 1] << 8 |
-                        s[j * 3 + 2] << 16;
-                }
-            } else {
-                for (unsigned int j = lines_read * width; j > 0; ) {
-                    j -= 1; // reverse order, bad for cache?
-                    d[j] = s[j * 3 + 0] << 16 |
-                        s[j * 3 + 1] << 8 |
-                        s[j * 3 + 2];
-                }
-            }
+    mjpeg_decode_start(&st->mjpeg, frame, FALSE);
+    if (cinfo->output_width != frame->width ||
+        cinfo->output_height != frame->height ||
+        cinfo->rec_outbuf_height > G_N_ELEMENTS(lines)) {
+        jpeg_abort_decompress(cinfo);
+        pixman_region32_fini(&clip);
+        return FALSE;
+    }
+
+    stride = surface->stride;
+    first_line = surface->data + dest->top * stride + dest->left * 4;
+    if (!top_down) {
+        first_line += (frame->height - 1) * stride;
+        stride = -stride;
+    }
+    if (rects != NULL)
+        scratch = g_malloc(cinfo->rec_outbuf_height * frame->width * 4);
+
+    while (cinfo->output_scanline < cinfo->output_height) {
+        unsigned int row = cinfo->output_scanline;
+        unsigned int nlines = MIN(cinfo->rec_outbuf_height, cinfo->output_height - row);
+        unsigned int j, lines_read;
+
+        for (j = 0; j < nlines; j++) {
+            if (rects != NULL)
+                lines[j] = scratch + j * frame->width * 4;
+            else
+                lines[j] = first_line + (int)(row + j) * stride;
+        }
+        lines_read = jpeg_read_scanlines(cinfo, lines, nlines);
+        if (rects == NULL)
+            continue;
+
+        for (j = 0; j < lines_read; j++) {
+            int y = top_down ? dest->top + row + j : dest->bottom - 1 - (row + j);
+
+            mjpeg_copy_clipped_line(surface, lines[j], dest->left, y, rects, nrects);
         }
-#endif
-        dest = &st->out_frame[st->mjpeg_cinfo.output_scanline * width * 4];
     }
-    jpeg_finish_decompress(&st->mjpeg_cinfo);
+    jpeg_finish_decompress(cinfo);
+
+    g_free(scratch);
+    pixman_region32_fini(&clip);
+
+    return TRUE;
 }
+#endif
 
 G_GNUC_INTERNAL
 void stream_mjpeg_cleanup(display_stream *st)
 {
+    mjpeg_stop_decode_threads(st);
 #ifdef USE_VA
-    if (st->hw_accel) {
+    if (st->vaapi_session) {
         tinyjpeg_close_display(st->vaapi_session);
-        return;
+        st->vaapi_session = NULL;
     }
 #endif
-    jpeg_destroy_decompress(&st->mjpeg_cinfo);
-    g_free(st->out_frame);
-    st->out_frame = NULL;
+    mjpeg_decoder_cleanup(&st->mjpeg);
 }
@@ -30,6 +30,7 @@
 #include "common/ring.h"
 #include "common/quic.h"
 #include "common/rop3.h"
+#include "spice-util-priv.h"
 
 #ifdef USE_VA
 #include "tinyjpeg.h"
@@ -66,7 +67,46 @@ typedef struct vaapi_source {
     int st_count_miss;
 } vaapi_source;
 
-typedef struct display_stream {
+typedef struct display_stream display_stream;
+
+typedef struct mjpeg_decoder {
+    struct jpeg_source_mgr         src;
+    struct jpeg_decompress_struct  cinfo;
+    struct jpeg_error_mgr          jerr;
+    uint8_t                        *data;
+    uint32_t                       data_size;
+} mjpeg_decoder;
+
+typedef struct display_frame {
+    display_stream              *stream;
+    SpiceMsgIn                  *msg;
+    uint32_t                    mm_time;
+    int                         width;
+    int                         height;
+    SpiceRect                   dest;
+    uint8_t                     *data;
+    uint32_t                    data_size;
+
+    /* decoded BGRX pixels, NULL until decoded */
+    uint8_t                     *out_frame;
+    guint64                     decode_time;
+
+    /* main context only: handed to a decoder thread, and not back yet */
+    gboolean                    inflight;
+    /* set by the main context, read by the decoder threads */
+    volatile gint               dropped;
+} display_frame;
+
+/* recycled output buffers, all of the same size, shared with the
+ * decoder threads */
+typedef struct display_frame_pool {
+    STATIC_MUTEX                lock;
+    gsize                       size;
+    gpointer                    free_list;
+    guint                       nfree;
+} display_frame_pool;
+
+struct display_stream {
     SpiceMsgIn                  *msg_create;
     SpiceMsgIn                  *msg_clip;
     SpiceMsgIn                  *msg_data;
@@ -81,14 +121,20 @@ typedef struct display_stream {
 
     /* mjpeg decoder */
     int                            hw_accel;
-    struct jpeg_source_mgr         mjpeg_src;
-    struct jpeg_decompress_struct  mjpeg_cinfo;
-    struct jpeg_error_mgr          mjpeg_jerr;
+    gboolean                       back_compat;
+    mjpeg_decoder                  mjpeg;
     tinyjpeg_session               *vaapi_session;
 
-    uint8_t                     *out_frame;
-    GQueue                      *msgq;
-    guint                       timeout;
+    /* mjpeg decoder threads */
+    guint                       ndecode_threads;
+    GThread                     **decode_threads;
+    GAsyncQueue                 *decode_queue;
+    GQueue                      *inflight;
+    gboolean                    render_pending;
+
+    display_frame_pool          pool;
+    GQueue                      *frameq;
+    GSource                     *render_source;
     SpiceChannel                *channel;
 
     /* stats */
@@ -102,6 +148,10 @@ typedef struct display_stream {
     uint32_t             num_drops_seqs;
     guint64              acum_decode_time;
     uint32_t             decoded_frames;
+    uint32_t             num_late_on_playback;
+    uint32_t             jitter; /* in 1/16 ms */
+    uint32_t             last_arrival_mm_time;
+    uint32_t             last_frame_mm_time;
 
     uint32_t             playback_sync_drops_seq_len;
 
@@ -116,18 +166,32 @@ typedef struct display_stream {
     uint32_t report_num_drops;
     uint32_t report_drops_seq_len;
 
-    /* frame skipping */
+    /* frame skipping, see display_stream_skip_frame() */
+    guint64  avg_decode_time;
+    uint8_t  fskip_history;
     uint8_t  fskip_level;
     uint8_t  fskip_frame;
-} display_stream;
+};
 
 void stream_get_dimensions(display_stream *st, int *width, int *height);
 uint32_t stream_get_current_frame(display_stream *st, uint8_t **data);
+gboolean display_frame_decoded(gpointer data);
+uint8_t *stream_frame_buffer_get(display_stream *st, gsize size);
+void stream_frame_buffer_release(display_stream *st, uint8_t *buffer, gsize size);
 
 /* channel-display-mjpeg.c */
 void stream_mjpeg_init(display_stream *st);
-void stream_mjpeg_data(display_stream *st);
+void stream_mjpeg_data(display_stream *st, display_frame *frame);
+#ifdef JCS_EXTENSIONS
+gboolean stream_mjpeg_data_direct(display_stream *st, display_frame *frame,
+                                  gboolean top_down);
+#endif
+gboolean stream_mjpeg_queue_frame(display_stream *st, display_frame *frame);
 void stream_mjpeg_cleanup(display_stream *st);
+/* decoding a frame outside of a stream, used by the benchmarks */
+void mjpeg_decoder_init(mjpeg_decoder *dec);
+void mjpeg_decoder_cleanup(mjpeg_decoder *dec);
+void mjpeg_decode(mjpeg_decoder *dec, display_frame *frame, gboolean back_compat);
 
 G_END_DECLS
 
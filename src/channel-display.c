@@ -63,6 +63,11 @@
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), SPICE_TYPE_DISPLAY_CHANNEL, SpiceDisplayChannelPrivate))
 
 #define MONITORS_MAX 256
+#define MJPEG_DECODE_THREADS_MAX 8
+#define FRAME_POOL_MAX 8
+#define FSKIP_LEVEL_MAX 3
+/* above this, the bounding box of the damage is emitted instead */
+#define INVALIDATE_RECTS_MAX 32
 
 struct _SpiceDisplayChannelPrivate {
     GHashTable                  *surfaces;
@@ -80,6 +85,14 @@ struct _SpiceDisplayChannelPrivate {
     GArray                      *monitors;
     guint                       monitors_max;
     gboolean                    enable_adaptive_streaming;
+    guint                       mjpeg_decode_threads;
+    guint                       frames_skipped;
+    guint                       frames_late;
+    guint                       frames_dropped;
+    pixman_region32_t           invalidate_region;
+    guint                       invalidate_id;
+    guint                       invalidate_rate;
+    gint64                      invalidate_time;
 #ifdef G_OS_WIN32
     HDC dc;
 #endif
@@ -97,6 +110,14 @@ enum {
     PROP_MONITORS_MAX,
     PROP_REPORT,
     PROP_VA_SESSIONS,
+    PROP_FRAME_SKIP_LEVEL,
+    PROP_AVG_DECODE_TIME,
+    PROP_FRAMES_SKIPPED,
+    PROP_STREAM_JITTER,
+    PROP_FRAMES_LATE,
+    PROP_FRAMES_DROPPED,
+    PROP_MAX_INVALIDATE_RATE,
+    PROP_SURFACES_BYTES,
 };
 
 enum {
@@ -120,8 +141,9 @@ static gboolean display_stream_render(display_stream *st);
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating);
 static void spice_display_channel_reset_capabilities(SpiceChannel *channel);
 static void destroy_canvas(display_surface *surface);
-static void _msg_in_unref_func(gpointer data, gpointer user_data);
+static void display_frame_drop(display_frame *frame);
 static void display_session_mm_time_reset_cb(SpiceSession *session, gpointer data);
+static void invalidate_cancel(SpiceChannel *channel);
 
 /* ------------------------------------------------------------------ */
 
@@ -133,6 +155,7 @@ static void spice_display_channel_dispose(GObject *object)
         g_source_remove(c->mark_false_event_id);
         c->mark_false_event_id = 0;
     }
+    invalidate_cancel(SPICE_CHANNEL(object));
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose(object);
@@ -147,6 +170,9 @@ static void spice_display_channel_finalize(GObject *object)
     g_hash_table_unref(c->surfaces);
     clear_streams(SPICE_CHANNEL(object));
     g_clear_pointer(&c->palettes, cache_unref);
+    /* destroying the streams may have queued some damage */
+    invalidate_cancel(SPICE_CHANNEL(object));
+    pixman_region32_fini(&c->invalidate_region);
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize(object);
@@ -214,6 +240,63 @@ static void spice_display_get_property(GObject    *object,
         g_value_set_pointer(value, va_sessions);
         break;
     }
+    case PROP_FRAME_SKIP_LEVEL: {
+        guint level = 0;
+        int i;
+        for (i = 0; i < c->nstreams; ++i) {
+            if (c->streams[i])
+                level = MAX(level, c->streams[i]->fskip_level);
+        }
+        g_value_set_uint(value, level);
+        break;
+    }
+    case PROP_AVG_DECODE_TIME: {
+        guint64 decode_time = 0;
+        int i;
+        for (i = 0; i < c->nstreams; ++i) {
+            if (c->streams[i])
+                decode_time = MAX(decode_time, c->streams[i]->avg_decode_time);
+        }
+        g_value_set_uint64(value, decode_time);
+        break;
+    }
+    case PROP_FRAMES_SKIPPED: {
+        g_value_set_uint(value, c->frames_skipped);
+        break;
+    }
+    case PROP_STREAM_JITTER: {
+        guint jitter = 0;
+        int i;
+        for (i = 0; i < c->nstreams; ++i) {
+            if (c->streams[i])
+                jitter = MAX(jitter, c->streams[i]->jitter >> 4);
+        }
+        g_value_set_uint(value, jitter);
+        break;
+    }
+    case PROP_FRAMES_LATE: {
+        g_value_set_uint(value, c->frames_late);
+        break;
+    }
+    case PROP_FRAMES_DROPPED: {
+        g_value_set_uint(value, c->frames_dropped);
+        break;
+    }
+    case PROP_MAX_INVALIDATE_RATE: {
+        g_value_set_uint(value, c->invalidate_rate);
+        break;
+    }
+    case PROP_SURFACES_BYTES: {
+        GHashTableIter iter;
+        display_surface *surface;
+        guint64 bytes = 0;
+
+        g_hash_table_iter_init(&iter, c->surfaces);
+        while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&surface))
+            bytes += surface->size;
+        g_value_set_uint64(value, bytes);
+        break;
+    }
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -225,7 +308,12 @@ static void spice_display_set_property(GObject      *object,
                                        const GValue *value,
                                        GParamSpec   *pspec)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
+
     switch (prop_id) {
+    case PROP_MAX_INVALIDATE_RATE:
+        c->invalidate_rate = g_value_get_uint(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -326,6 +414,146 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                               G_PARAM_READABLE |
                               G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceDisplayChannel:frame-skip-level:
+     *
+     * How many of the last stream frames were skipped before being
+     * decoded because they could not be displayed in time, highest
+     * value of all the active streams.
+     *
+     * Since: 0.30
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_FRAME_SKIP_LEVEL,
+         g_param_spec_uint("frame-skip-level",
+                           "Frame skip level",
+                           "Current stream frame skip level",
+                           0, FSKIP_LEVEL_MAX, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:avg-decode-time:
+     *
+     * Moving average of the time needed to decode and draw a stream
+     * frame, in microseconds, highest value of all the active streams.
+     *
+     * Since: 0.30
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_AVG_DECODE_TIME,
+         g_param_spec_uint64("avg-decode-time",
+                             "Average decode time",
+                             "Average stream frame decode time (us)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:frames-skipped:
+     *
+     * Number of stream frames skipped before decoding since the
+     * channel was created.
+     *
+     * Since: 0.30
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_FRAMES_SKIPPED,
+         g_param_spec_uint("frames-skipped",
+                           "Frames skipped",
+                           "Number of stream frames skipped",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:stream-jitter:
+     *
+     * Estimated variation of the stream frames arrival time relative
+     * to their timestamps, in milliseconds, highest value of all the
+     * active streams. Useful to tune #SpiceSession:stream-latency.
+     *
+     * Since: 0.30
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_STREAM_JITTER,
+         g_param_spec_uint("stream-jitter",
+                           "Stream jitter",
+                           "Stream frames arrival jitter (ms)",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:frames-late:
+     *
+     * Number of stream frames displayed late, within
+     * #SpiceSession:stream-late-tolerance.
+     *
+     * Since: 0.30
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_FRAMES_LATE,
+         g_param_spec_uint("frames-late",
+                           "Frames late",
+                           "Number of stream frames displayed late",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:frames-dropped:
+     *
+     * Number of stream frames dropped because they were received or
+     * about to be displayed too late.
+     *
+     * Since: 0.30
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_FRAMES_DROPPED,
+         g_param_spec_uint("frames-dropped",
+                           "Frames dropped",
+                           "Number of late stream frames dropped",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:max-invalidate-rate:
+     *
+     * The damage of the primary surface is merged and
+     * #SpiceDisplayChannel::display-invalidate emitted at most this
+     * many times per second. 0 emits the damage once per main loop
+     * iteration.
+     *
+     * Since: 0.30
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_MAX_INVALIDATE_RATE,
+         g_param_spec_uint("max-invalidate-rate",
+                           "Max invalidate rate",
+                           "Maximum rate of invalidate signals, in Hz",
+                           0, 1000, 0,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:surfaces-bytes:
+     *
+     * Memory used by the pixels of the primary and off-screen surfaces
+     * of the channel.
+     *
+     * Since: 0.30
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_SURFACES_BYTES,
+         g_param_spec_uint64("surfaces-bytes",
+                             "Surfaces bytes",
+                             "Memory used by the surfaces",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceDisplayChannel::display-primary-create:
      * @display: the #SpiceDisplayChannel that emitted the signal
@@ -382,7 +610,8 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
      *
      * The #SpiceDisplayChannel::display-invalidate signal is emitted
      * when the rectangular region x/y/w/h of the primary buffer is
-     * updated.
+     * updated. The updates are merged, see
+     * #SpiceDisplayChannel:max-invalidate-rate.
      **/
     signals[SPICE_DISPLAY_INVALIDATE] =
         g_signal_new("display-invalidate",
@@ -478,6 +707,7 @@ typedef struct _WaitImageData
     SpiceImageCache *cache;
     uint64_t id;
     pixman_image_t *image;
+    guint tries;
 } WaitImageData;
 
 static gboolean wait_image(gpointer data)
@@ -488,6 +718,13 @@ static gboolean wait_image(gpointer data)
         SPICE_CONTAINEROF(wait->cache, SpiceDisplayChannelPrivate, image_cache);
     pixman_image_t *image = cache_find_lossy(c->images, wait->id, &lossy);
 
+    wait->tries++;
+    if (!image && cache_is_evicted(c->images, wait->id)) {
+        /* the server will not send it again, don't wait forever */
+        g_warning("image %" G_GUINT64_FORMAT " was evicted from the cache", wait->id);
+        return TRUE;
+    }
+
     if (!image || (lossy && !wait->lossy))
         return FALSE;
 
@@ -504,8 +741,13 @@ static pixman_image_t *image_get(SpiceImageCache *cache, uint64_t id)
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+
+    if (!g_coroutine_wait_queue_wait(c->images->waiters, id, g_coroutine_self(),
+                                     wait_image, &wait))
         SPICE_DEBUG("wait image got cancelled");
+    cache_account_lookup(c->images, wait.image != NULL && wait.tries == 1);
 
     return wait.image;
 }
@@ -571,8 +813,13 @@ static pixman_image_t* image_get_lossless(SpiceImageCache *cache, uint64_t id)
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
+
+    if (!g_coroutine_wait_queue_wait(c->images->waiters, id, g_coroutine_self(),
+                                     wait_image, &wait))
         SPICE_DEBUG("wait lossless got cancelled");
+    cache_account_lookup(c->images, wait.image != NULL && wait.tries == 1);
 
     return wait.image;
 }
@@ -655,6 +902,7 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
     c->dc = create_compatible_dc();
 #endif
     c->monitors_max = 1;
+    pixman_region32_init(&c->invalidate_region);
 
     if (g_getenv("SPICE_DISABLE_ADAPTIVE_STREAMING")) {
         SPICE_DEBUG("adaptive video disabled");
@@ -662,6 +910,14 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
     } else {
         c->enable_adaptive_streaming = TRUE;
     }
+
+    /* 0 decodes MJPEG streams synchronously in the main context */
+    c->mjpeg_decode_threads = 1;
+    if (g_getenv("SPICE_MJPEG_DECODE_THREADS")) {
+        c->mjpeg_decode_threads = CLAMP(atoi(g_getenv("SPICE_MJPEG_DECODE_THREADS")),
+                                        0, MJPEG_DECODE_THREADS_MAX);
+        SPICE_DEBUG("MJPEG decode threads: %u", c->mjpeg_decode_threads);
+    }
     spice_display_channel_reset_capabilities(SPICE_CHANNEL(channel));
 }
 
@@ -679,6 +935,7 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                 return 0;
             }
 
+            invalidate_cancel(channel);
             g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
 
             g_hash_table_remove(c->surfaces, GINT_TO_POINTER(c->primary->surface_id));
@@ -713,6 +970,7 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
 
     surface->glz_decoder = glz_decoder_new(c->glz_window);
     surface->zlib_decoder = zlib_decoder_new();
+    glz_decoder_set_zlib(surface->glz_decoder, surface->zlib_decoder);
     surface->jpeg_decoder = jpeg_decoder_new();
 
     surface->canvas = canvas_create_for_data(surface->width,
@@ -792,6 +1050,7 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
 
     if (!keep_primary) {
         c->primary = NULL;
+        invalidate_cancel(channel);
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
     }
 
@@ -807,13 +1066,86 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
     }
 }
 
+/* main context */
+static gboolean invalidate_flush(gpointer data)
+{
+    SpiceChannel *channel = data;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    pixman_region32_t region;
+    pixman_box32_t *rects;
+    int i, n;
+
+    c->invalidate_id = 0;
+    c->invalidate_time = g_get_monotonic_time();
+
+    /* take over the pending damage, handlers may queue more */
+    region = c->invalidate_region;
+    pixman_region32_init(&c->invalidate_region);
+
+    rects = pixman_region32_rectangles(&region, &n);
+    if (n > INVALIDATE_RECTS_MAX) {
+        rects = pixman_region32_extents(&region);
+        n = 1;
+    }
+
+    g_object_ref(channel);
+    for (i = 0; i < n; i++)
+        g_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                      rects[i].x1, rects[i].y1,
+                      rects[i].x2 - rects[i].x1,
+                      rects[i].y2 - rects[i].y1);
+    g_object_unref(channel);
+
+    pixman_region32_fini(&region);
+    return FALSE;
+}
+
+/* main or coroutine context */
+static void invalidate_cancel(SpiceChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    if (c->invalidate_id != 0) {
+        g_source_remove(c->invalidate_id);
+        c->invalidate_id = 0;
+    }
+    pixman_region32_fini(&c->invalidate_region);
+    pixman_region32_init(&c->invalidate_region);
+}
+
+/* main or coroutine context */
+static void queue_invalidate(SpiceChannel *channel,
+                             int x, int y, int width, int height)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    gint64 delay = 0;
+
+    if (width <= 0 || height <= 0)
+        return;
+
+    pixman_region32_union_rect(&c->invalidate_region, &c->invalidate_region,
+                               x, y, width, height);
+    if (c->invalidate_id != 0)
+        return;
+
+    if (c->invalidate_rate != 0)
+        delay = c->invalidate_time + G_USEC_PER_SEC / c->invalidate_rate -
+            g_get_monotonic_time();
+
+    if (delay > 0)
+        c->invalidate_id = g_timeout_add_full(G_PRIORITY_DEFAULT, delay / 1000,
+                                              invalidate_flush, channel, NULL);
+    else
+        c->invalidate_id = g_idle_add_full(G_PRIORITY_DEFAULT,
+                                           invalidate_flush, channel, NULL);
+}
+
 /* coroutine context */
 static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox)
 {
-    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                            bbox->left, bbox->top,
-                            bbox->right - bbox->left,
-                            bbox->bottom - bbox->top);
+    queue_invalidate(channel, bbox->left, bbox->top,
+                     bbox->right - bbox->left,
+                     bbox->bottom - bbox->top);
 }
 
 /* ------------------------------------------------------------------ */
@@ -1033,8 +1365,12 @@ static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
     st->clip = &op->clip;
     st->codec = op->codec_type;
     st->surface = find_surface(c, op->surface_id);
-    st->msgq = g_queue_new();
+    STATIC_MUTEX_INIT(st->pool.lock);
+    st->frameq = g_queue_new();
+    st->inflight = g_queue_new();
+    st->ndecode_threads = c->mjpeg_decode_threads;
     st->channel = channel;
+    st->render_source = display_stream_source_new(st);
     st->drops_seqs_stats_arr = g_array_new(FALSE, FALSE, sizeof(drops_sequence_stats));
 
     region_init(&st->region);
@@ -1054,62 +1390,158 @@ static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
     g_coroutine_object_notify(G_OBJECT(channel), "stream-report");
 }
 
+/*
+ * A single source per stream is used to render the frames, it is
+ * rearmed for each frame instead of adding a new timeout every time.
+ */
+typedef struct display_stream_source {
+    GSource                     source;
+    /* monotonic time, -1 when not scheduled */
+    gint64                      ready_time;
+} display_stream_source;
+
+static gboolean display_stream_source_prepare(GSource *source, gint *timeout)
+{
+    display_stream_source *s = (display_stream_source *)source;
+    gint64 now;
+
+    if (s->ready_time < 0) {
+        *timeout = -1;
+        return FALSE;
+    }
+
+    now = g_source_get_time(source);
+    if (now >= s->ready_time) {
+        *timeout = 0;
+        return TRUE;
+    }
+
+    *timeout = (s->ready_time - now + 999) / 1000;
+    return FALSE;
+}
+
+static gboolean display_stream_source_check(GSource *source)
+{
+    display_stream_source *s = (display_stream_source *)source;
+
+    return s->ready_time >= 0 && g_source_get_time(source) >= s->ready_time;
+}
+
+static gboolean display_stream_source_dispatch(GSource *source,
+                                               GSourceFunc callback,
+                                               gpointer user_data)
+{
+    display_stream_source *s = (display_stream_source *)source;
+
+    s->ready_time = -1;
+    if (callback)
+        callback(user_data);
+
+    return TRUE;
+}
+
+static GSourceFuncs display_stream_source_funcs = {
+    .prepare = display_stream_source_prepare,
+    .check = display_stream_source_check,
+    .dispatch = display_stream_source_dispatch,
+};
+
+static GSource *display_stream_source_new(display_stream *st)
+{
+    GSource *source = g_source_new(&display_stream_source_funcs,
+                                   sizeof(display_stream_source));
+
+    ((display_stream_source *)source)->ready_time = -1;
+    g_source_set_callback(source, (GSourceFunc)display_stream_render, st, NULL);
+    g_source_attach(source, NULL);
+
+    return source;
+}
+
+static gboolean display_stream_render_scheduled(display_stream *st)
+{
+    return ((display_stream_source *)st->render_source)->ready_time >= 0;
+}
+
+static void display_stream_render_at(display_stream *st, guint32 delay)
+{
+    SPICE_DEBUG("scheduling next stream render in %u ms", delay);
+    ((display_stream_source *)st->render_source)->ready_time =
+        g_get_monotonic_time() + (gint64)delay * 1000;
+}
+
+static void display_stream_render_cancel(display_stream *st)
+{
+    ((display_stream_source *)st->render_source)->ready_time = -1;
+}
+
 /* coroutine or main context */
 static gboolean display_stream_schedule(display_stream *st)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
     SpiceSession *session = spice_channel_get_session(st->channel);
-    guint32 time, d;
-    SpiceStreamDataHeader *op;
-    SpiceMsgIn *in;
+    guint32 time, pts;
+    guint latency, late_tolerance;
+    display_frame *frame;
     gboolean invalid_mm_time;
 
     SPICE_DEBUG("%s", __FUNCTION__);
-    if (st->timeout || !session)
+    if (display_stream_render_scheduled(st) || !session)
         return TRUE;
 
     time = spice_session_get_mm_time(session, &invalid_mm_time);
-    in = g_queue_peek_head(st->msgq);
+    frame = g_queue_peek_head(st->frameq);
 
-    if (in == NULL) {
+    if (frame == NULL) {
         return TRUE;
     }
 
-    op = spice_msg_in_parsed(in);
+    st->render_pending = FALSE;
     if (invalid_mm_time) {
-        SPICE_DEBUG("scheduling next stream render in %u ms", 0);
-        st->timeout = g_timeout_add(0, (GSourceFunc)display_stream_render, st);
+        display_stream_render_at(st, 0);
         return TRUE;
     }
-    if (time < op->multi_media_time) {
-        d = op->multi_media_time - time;
-        SPICE_DEBUG("scheduling next stream render in %u ms", d);
-        st->timeout = g_timeout_add(d, (GSourceFunc)display_stream_render, st);
+
+    spice_session_get_stream_latency(session, &latency, &late_tolerance);
+    pts = frame->mm_time + latency;
+    if (time < pts) {
+        display_stream_render_at(st, pts - time);
+        return TRUE;
+    } else if (time - pts <= late_tolerance) {
+        if (time > pts) {
+            SPICE_DEBUG("%s: rendering late by %u ms (ts: %u, mmtime: %u)",
+                        __FUNCTION__, time - pts, frame->mm_time, time);
+            st->num_late_on_playback++;
+            c->frames_late++;
+        }
+        display_stream_render_at(st, 0);
         return TRUE;
     } else {
         SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
-                    __FUNCTION__, time - op->multi_media_time,
-                    op->multi_media_time, time);
-        in = g_queue_pop_head(st->msgq);
-        spice_msg_in_unref(in);
+                    __FUNCTION__, time - pts,
+                    frame->mm_time, time);
+        frame = g_queue_pop_head(st->frameq);
+        display_frame_drop(frame);
         st->num_drops_on_playback++;
-        if (g_queue_get_length(st->msgq) == 0)
+        c->frames_dropped++;
+        if (g_queue_get_length(st->frameq) == 0)
             return TRUE;
     }
 
     return FALSE;
 }
 
-static void stream_get_dest(display_stream *st)
+static void stream_msg_get_dest(display_stream *st, SpiceMsgIn *msg, SpiceRect *dest)
 {
-    if (st->msg_data == NULL ||
-        spice_msg_in_type(st->msg_data) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
+    if (msg == NULL ||
+        spice_msg_in_type(msg) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
         SpiceMsgDisplayStreamCreate *info = spice_msg_in_parsed(st->msg_create);
 
-        memcpy(&st->dst_rect, &info->dest, sizeof(SpiceRect));
+        memcpy(dest, &info->dest, sizeof(SpiceRect));
     } else {
-        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(msg);
 
-        memcpy(&st->dst_rect, &op->dest, sizeof(SpiceRect));
+        memcpy(dest, &op->dest, sizeof(SpiceRect));
    }
 
 }
@@ -1121,23 +1553,22 @@ static uint32_t stream_get_flags(display_stream *st)
     return info->flags;
 }
 
-G_GNUC_INTERNAL
-uint32_t stream_get_current_frame(display_stream *st, uint8_t **data)
+static uint32_t stream_msg_get_frame(SpiceMsgIn *msg, uint8_t **data)
 {
-    if (st->msg_data == NULL) {
+    if (msg == NULL) {
         *data = NULL;
         return 0;
     }
 
-    if (spice_msg_in_type(st->msg_data) == SPICE_MSG_DISPLAY_STREAM_DATA) {
-        SpiceMsgDisplayStreamData *op = spice_msg_in_parsed(st->msg_data);
+    if (spice_msg_in_type(msg) == SPICE_MSG_DISPLAY_STREAM_DATA) {
+        SpiceMsgDisplayStreamData *op = spice_msg_in_parsed(msg);
 
         *data = op->data;
         return op->data_size;
     } else {
-        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(msg);
 
-        g_return_val_if_fail(spice_msg_in_type(st->msg_data) ==
+        g_return_val_if_fail(spice_msg_in_type(msg) ==
                              SPICE_MSG_DISPLAY_STREAM_DATA_SIZED, 0);
         *data = op->data;
         return op->data_size;
@@ -1146,113 +1577,295 @@ uint32_t stream_get_current_frame(display_stream *st, uint8_t **data)
 }
 
 G_GNUC_INTERNAL
-void stream_get_dimensions(display_stream *st, int *width, int *height)
+uint32_t stream_get_current_frame(display_stream *st, uint8_t **data)
 {
-    g_return_if_fail(width != NULL);
-    g_return_if_fail(height != NULL);
+    return stream_msg_get_frame(st->msg_data, data);
+}
 
-    if (st->msg_data == NULL ||
-        spice_msg_in_type(st->msg_data) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
+static void stream_msg_get_dimensions(display_stream *st, SpiceMsgIn *msg,
+                                      int *width, int *height)
+{
+    if (msg == NULL ||
+        spice_msg_in_type(msg) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
         SpiceMsgDisplayStreamCreate *info = spice_msg_in_parsed(st->msg_create);
 
         *width = info->stream_width;
         *height = info->stream_height;
     } else {
-        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(msg);
 
         *width = op->width;
         *height = op->height;
    }
 }
 
+G_GNUC_INTERNAL
+void stream_get_dimensions(display_stream *st, int *width, int *height)
+{
+    g_return_if_fail(width != NULL);
+    g_return_if_fail(height != NULL);
+
+    stream_msg_get_dimensions(st, st->msg_data, width, height);
+}
+
+/* any thread: the buffer is not cleared, decoders overwrite all of it */
+G_GNUC_INTERNAL
+uint8_t *stream_frame_buffer_get(display_stream *st, gsize size)
+{
+    display_frame_pool *pool = &st->pool;
+    uint8_t *buffer = NULL;
+
+    STATIC_MUTEX_LOCK(pool->lock);
+    if (pool->size == size && pool->free_list != NULL) {
+        buffer = pool->free_list;
+        pool->free_list = *(gpointer *)buffer;
+        pool->nfree--;
+    }
+    STATIC_MUTEX_UNLOCK(pool->lock);
+
+    if (buffer == NULL)
+        buffer = g_malloc(MAX(size, sizeof(gpointer)));
+
+    return buffer;
+}
+
+/* any thread */
+G_GNUC_INTERNAL
+void stream_frame_buffer_release(display_stream *st, uint8_t *buffer, gsize size)
+{
+    display_frame_pool *pool = &st->pool;
+    gpointer stale = NULL;
+
+    if (buffer == NULL)
+        return;
+
+    STATIC_MUTEX_LOCK(pool->lock);
+    if (pool->size != size) {
+        /* stream was resized, the old buffers are useless */
+        stale = pool->free_list;
+        pool->free_list = NULL;
+        pool->nfree = 0;
+        pool->size = size;
+    }
+    if (pool->nfree < FRAME_POOL_MAX) {
+        *(gpointer *)buffer = pool->free_list;
+        pool->free_list = buffer;
+        pool->nfree++;
+        buffer = NULL;
+    }
+    STATIC_MUTEX_UNLOCK(pool->lock);
+
+    g_free(buffer);
+    while (stale != NULL) {
+        gpointer next = *(gpointer *)stale;
+        g_free(stale);
+        stale = next;
+    }
+}
+
+static void stream_frame_pool_clear(display_stream *st)
+{
+    display_frame_pool *pool = &st->pool;
+
+    while (pool->free_list != NULL) {
+        gpointer next = *(gpointer *)pool->free_list;
+        g_free(pool->free_list);
+        pool->free_list = next;
+    }
+    pool->nfree = 0;
+    STATIC_MUTEX_CLEAR(pool->lock);
+}
+
+/* coroutine context */
+static display_frame *display_frame_new(display_stream *st, SpiceMsgIn *in)
+{
+    SpiceStreamDataHeader *op = spice_msg_in_parsed(in);
+    display_frame *frame = g_slice_new0(display_frame);
+
+    frame->stream = st;
+    frame->msg = in;
+    spice_msg_in_ref(in);
+    frame->mm_time = op->multi_media_time;
+    stream_msg_get_dimensions(st, in, &frame->width, &frame->height);
+    stream_msg_get_dest(st, in, &frame->dest);
+    frame->data_size = stream_msg_get_frame(in, &frame->data);
+
+    return frame;
+}
+
+static void display_frame_free(display_frame *frame)
+{
+    g_return_if_fail(!frame->inflight);
+
+    spice_msg_in_unref(frame->msg);
+    stream_frame_buffer_release(frame->stream, frame->out_frame,
+                                frame->width * frame->height * 4);
+    g_slice_free(display_frame, frame);
+}
+
+/* main context */
+static void display_frame_drop(display_frame *frame)
+{
+    if (frame->inflight) {
+        /* freed once a decoder thread gives it back */
+        g_atomic_int_set(&frame->dropped, TRUE);
+        return;
+    }
+
+    display_frame_free(frame);
+}
+
+/* coroutine context */
+static void display_stream_queue_frame(display_stream *st, display_frame *frame)
+{
+    g_queue_push_tail(st->frameq, frame);
+
+    switch (st->codec) {
+    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
+        stream_mjpeg_queue_frame(st, frame);
+        break;
+    }
+}
+
+/*
+ * Decide whether a frame must be skipped before it is decoded: when
+ * the frames already queued and this one can't be decoded before its
+ * presentation time given the average decode time, decoding it would
+ * only delay the next frames. At most FSKIP_LEVEL_MAX frames are
+ * skipped in a row so that the display is still refreshed.
+ */
+/* coroutine context */
+static gboolean display_stream_skip_frame(display_stream *st, display_frame *frame,
+                                          guint32 mmtime)
+{
+    SpiceDisplayChannel *channel = SPICE_DISPLAY_CHANNEL(st->channel);
+    guint parallel = st->decode_threads != NULL ? st->ndecode_threads : 1;
+    guint latency, late_tolerance;
+    guint64 ready_time, deadline;
+    gboolean skip;
+    uint8_t level, history;
+
+    if (st->avg_decode_time == 0)
+        return FALSE;
+
+    /* in ms, like mm_time */
+    ready_time = mmtime + (g_queue_get_length(st->frameq) + 1) *
+        st->avg_decode_time / parallel / 1000;
+    spice_session_get_stream_latency(spice_channel_get_session(st->channel),
+                                     &latency, &late_tolerance);
+    deadline = (guint64)frame->mm_time + latency + late_tolerance;
+    skip = ready_time > deadline && st->fskip_frame < FSKIP_LEVEL_MAX;
+
+    st->fskip_history = (st->fskip_history << 1) | (skip ? 1 : 0);
+    if (skip) {
+        st->fskip_frame++;
+        channel->priv->frames_skipped++;
+        SPICE_DEBUG("skipping frame, late by %u ms (avg decode time: %" G_GUINT64_FORMAT " us)",
+                    (guint32)(ready_time - deadline), st->avg_decode_time);
+    } else {
+        st->fskip_frame = 0;
+    }
+
+    /* number of frames skipped out of the last 4 */
+    for (level = 0, history = st->fskip_history & 0xf; history; history >>= 1)
+        level += history & 1;
+    level = MIN(level, FSKIP_LEVEL_MAX);
+    if (st->fskip_level != level) {
+        SPICE_DEBUG("FSkip level: %u - average process time: %" G_GUINT64_FORMAT " us",
+                    level, st->avg_decode_time);
+        st->fskip_level = level;
+        g_coroutine_object_notify(G_OBJECT(channel), "frame-skip-level");
+    }
+
+    return skip;
+}
+
 /* main context */
 static gboolean display_stream_render(display_stream *st)
 {
-    SpiceMsgIn *in;
+    display_frame *frame;
     guint64 time1, time2;
     guint64 delta;
 
-    st->timeout = 0;
     do {
-        in = g_queue_pop_head(st->msgq);
-        g_return_val_if_fail(in != NULL, FALSE);
+        frame = g_queue_peek_head(st->frameq);
+        g_return_val_if_fail(frame != NULL, FALSE);
 
-        if (st->fskip_frame == 0) {
-            time1 = g_get_monotonic_time();
+        if (frame->inflight) {
+            /* display_frame_decoded() resumes rendering */
+            SPICE_DEBUG("%s: frame not decoded yet", __FUNCTION__);
+            st->render_pending = TRUE;
+            return FALSE;
+        }
+        g_queue_pop_head(st->frameq);
 
-            SpiceRect last_frame_dest;
-            memcpy(&last_frame_dest, &st->dst_rect, sizeof(SpiceRect));
-            st->msg_data = in;
-            stream_get_dest(st);
-            rect_union(&last_frame_dest, &st->dst_rect);
+        time1 = g_get_monotonic_time();
 
+        SpiceRect last_frame_dest;
+        memcpy(&last_frame_dest, &st->dst_rect, sizeof(SpiceRect));
+        st->msg_data = frame->msg;
+        memcpy(&st->dst_rect, &frame->dest, sizeof(SpiceRect));
+        rect_union(&last_frame_dest, &st->dst_rect);
+
+        gboolean top_down = stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN;
+        gboolean direct = FALSE;
+        if (frame->out_frame == NULL) {
             switch (st->codec) {
             case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-                stream_mjpeg_data(st);
+#ifdef JCS_EXTENSIONS
+                direct = stream_mjpeg_data_direct(st, frame, top_down);
+#endif
+                if (!direct)
+                    stream_mjpeg_data(st, frame);
                 break;
             }
+        }
 
-            SpiceRect *dest = &st->dst_rect;
-            if (st->out_frame) {
-                int width;
-                int height;
-                uint8_t *data;
-                int stride;
-
-                stream_get_dimensions(st, &width, &height);
+        SpiceRect *dest = &st->dst_rect;
+        if (frame->out_frame && !direct) {
+            uint8_t *data;
+            int stride;
 
-                data = st->out_frame;
-                stride = width * sizeof(uint32_t);
-                if (!(stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN)) {
-                    data += stride * (height - 1);
-                    stride = -stride;
-                }
+            data = frame->out_frame;
+            stride = frame->width * sizeof(uint32_t);
+            if (!top_down) {
+                data += stride * (frame->height - 1);
+                stride = -stride;
+            }
 
-                st->surface->canvas->ops->put_image(
-                    st->surface->canvas,
+            st->surface->canvas->ops->put_image(
+                st->surface->canvas,
 #ifdef G_OS_WIN32
-                SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
+            SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
 #endif
-                    dest, data,
-                    width, height, stride,
-                    st->have_region ? &st->region : NULL);
-            }
-
-            if (st->hw_accel)
-                dest = &last_frame_dest;
-            if (st->surface->primary)
-                g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                    dest->left, dest->top,
-                    dest->right - dest->left,
-                    dest->bottom - dest->top);
-
-            time2 = g_get_monotonic_time();
-            delta = (time2 - time1) / 1000;
-            st->acum_decode_time += delta;
-            st->decoded_frames++;
-            uint8_t new_fskip_level = 0;
-            if (delta > 120) {
-                new_fskip_level = 3;
-            } else if (delta > 80) {
-                new_fskip_level = 2;
-            } else if (delta > 40) {
-                new_fskip_level = 1;
-            }
-            if (st->fskip_level != new_fskip_level) {
-                SPICE_DEBUG("FSkip level: %u - MJPEG process time: %u ms\n", new_fskip_level,
-                            (unsigned int) delta);
-                st->fskip_level = new_fskip_level;
-            }
-            st->fskip_frame = st->fskip_level;
-        } else {
-            --st->fskip_frame;
+                dest, data,
+                frame->width, frame->height, stride,
+                st->have_region ? &st->region : NULL);
         }
 
+        if (st->hw_accel)
+            dest = &last_frame_dest;
+        if (st->surface->primary)
+            queue_invalidate(st->channel,
+                dest->left, dest->top,
+                dest->right - dest->left,
+                dest->bottom - dest->top);
+
+        time2 = g_get_monotonic_time();
+        /* account for the time spent in the decoder threads too */
+        delta = time2 - time1 + frame->decode_time;
+        st->acum_decode_time += delta / 1000;
+        st->decoded_frames++;
+        if (st->avg_decode_time == 0)
+            st->avg_decode_time = delta;
+        else
+            st->avg_decode_time = (st->avg_decode_time * 7 + delta) / 8;
+
         st->msg_data = NULL;
-        spice_msg_in_unref(in);
+        display_frame_free(frame);
 
-        in = g_queue_peek_head(st->msgq);
-        if (in == NULL)
+        frame = g_queue_peek_head(st->frameq);
+        if (frame == NULL)
             break;
 
         if (display_stream_schedule(st))
@@ -1261,12 +1874,37 @@ static gboolean display_stream_render(display_stream *st)
 
     return FALSE;
 }
+
+/* main context, idle callback queued by the decoder threads */
+G_GNUC_INTERNAL
+gboolean display_frame_decoded(gpointer data)
+{
+    display_frame *frame = data;
+    display_stream *st = frame->stream;
+
+    g_queue_remove(st->inflight, frame);
+    frame->inflight = FALSE;
+
+    if (g_atomic_int_get(&frame->dropped)) {
+        display_frame_free(frame);
+        return FALSE;
+    }
+
+    if (st->render_pending && !display_stream_render_scheduled(st) &&
+        g_queue_peek_head(st->frameq) == frame) {
+        st->render_pending = FALSE;
+        display_stream_render(st);
+    }
+
+    return FALSE;
+}
+
 /* after a sequence of 3 drops, push a report to the server, even
  * if the report window is bigger */
 #define STREAM_REPORT_DROP_SEQ_LEN_LIMIT 3
 
 static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t stream_id,
-                                         uint32_t frame_time, int32_t latency, gboolean invalid_mm_time)
+                                         uint32_t frame_time, int32_t latency, gboolean dropped)
 {
     display_stream *st = channel->priv->streams[stream_id];
     guint64 now;
@@ -1282,7 +1920,7 @@ static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t
     }
     st->report_num_frames++;
 
-    if (latency < 0 && !invalid_mm_time) { // drop
+    if (dropped) {
         st->report_num_drops++;
         st->report_drops_seq_len++;
     } else {
@@ -1342,10 +1980,7 @@ static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t
 static void display_stream_reset_rendering_timer(display_stream *st)
 {
     SPICE_DEBUG("%s", __FUNCTION__);
-    if (st->timeout != 0) {
-        g_source_remove(st->timeout);
-        st->timeout = 0;
-    }
+    display_stream_render_cancel(st);
     while (!display_stream_schedule(st)) {
     }
 }
@@ -1406,51 +2041,69 @@ static void display_session_mm_time_reset_cb(SpiceSession *session, gpointer dat
 
 /* coroutine context */
 static void display_stream_test_frames_mm_time_reset(display_stream *st,
-                                                     SpiceMsgIn *new_frame_msg,
+                                                     display_frame *new_frame,
                                                      guint32 mm_time)
 {
-    SpiceStreamDataHeader *tail_op, *new_op;
-    SpiceMsgIn *tail_msg;
+    display_frame *tail_frame;
+    display_frame *frame;
 
     SPICE_DEBUG("%s", __FUNCTION__);
-    g_return_if_fail(new_frame_msg != NULL);
-    tail_msg = g_queue_peek_tail(st->msgq);
-    if (!tail_msg) {
+    g_return_if_fail(new_frame != NULL);
+    tail_frame = g_queue_peek_tail(st->frameq);
+    if (!tail_frame) {
         return;
     }
-    tail_op = spice_msg_in_parsed(tail_msg);
-    new_op = spice_msg_in_parsed(new_frame_msg);
 
-    if (new_op->multi_media_time < tail_op->multi_media_time) {
+    if (new_frame->mm_time < tail_frame->mm_time) {
+        SpiceStreamDataHeader *new_op = spice_msg_in_parsed(new_frame->msg);
+
         SPICE_DEBUG("new-frame-time < tail-frame-time (%u < %u):"
                     " reseting stream, id %d",
-                    new_op->multi_media_time,
-                    tail_op->multi_media_time,
+                    new_frame->mm_time,
+                    tail_frame->mm_time,
                     new_op->id);
-        g_queue_foreach(st->msgq, _msg_in_unref_func, NULL);
-        g_queue_clear(st->msgq);
+        while ((frame = g_queue_pop_head(st->frameq)) != NULL)
+            display_frame_drop(frame);
         display_stream_reset_rendering_timer(st);
     }
 }
 
 #define STREAM_PLAYBACK_SYNC_DROP_SEQ_LEN_LIMIT 5
 
+/* interarrival jitter estimation, as in RFC 3550 */
+/* coroutine context */
+static void display_stream_update_jitter(display_stream *st, guint32 frame_time,
+                                         guint32 arrival_time)
+{
+    if (st->last_arrival_mm_time != 0) {
+        int32_t d = (int32_t)(arrival_time - st->last_arrival_mm_time) -
+                    (int32_t)(frame_time - st->last_frame_mm_time);
+
+        st->jitter += ABS(d) - ((st->jitter + 8) >> 4);
+    }
+    st->last_arrival_mm_time = arrival_time;
+    st->last_frame_mm_time = frame_time;
+}
+
 /* coroutine context */
 static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
     SpiceStreamDataHeader *op = spice_msg_in_parsed(in);
+    SpiceSession *session = spice_channel_get_session(channel);
     display_stream *st;
     guint32 mmtime;
     int32_t latency;
-    gboolean invalid_mm_time;
+    guint stream_latency, late_tolerance;
+    gboolean invalid_mm_time, drop;
 
     g_return_if_fail(c != NULL);
     g_return_if_fail(c->streams != NULL);
     g_return_if_fail(c->nstreams > op->id);
 
     st =  c->streams[op->id];
-    mmtime = spice_session_get_mm_time(spice_channel_get_session(channel), &invalid_mm_time);
+    mmtime = spice_session_get_mm_time(session, &invalid_mm_time);
+    spice_session_get_stream_latency(session, &stream_latency, &late_tolerance);
 
     if (spice_msg_in_type(in) == SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
         CHANNEL_DEBUG(channel, "stream %d contains sized data", op->id);
@@ -1467,11 +2120,18 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
     st->num_input_frames++;
 
     latency = op->multi_media_time - mmtime;
-    if (!invalid_mm_time && latency < 0) {
+    if (!invalid_mm_time)
+        display_stream_update_jitter(st, op->multi_media_time, mmtime);
+
+    /* frames are buffered for stream_latency before being displayed */
+    drop = !invalid_mm_time &&
+        latency + (int32_t)(stream_latency + late_tolerance) < 0;
+    if (drop) {
         CHANNEL_DEBUG(channel, "stream data too late by %u ms (ts: %u, mmtime: %u), dropping",
                       mmtime - op->multi_media_time, op->multi_media_time, mmtime);
         st->arrive_late_time += mmtime - op->multi_media_time;
         st->num_drops_on_receive++;
+        c->frames_dropped++;
 
         if (!st->cur_drops_seq_stats.len) {
             st->cur_drops_seq_stats.start_mm_time = op->multi_media_time;
@@ -1484,10 +2144,15 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
         } else {
             CHANNEL_DEBUG(channel, "video latency: %d", latency );
         }
-        spice_msg_in_ref(in);
-        display_stream_test_frames_mm_time_reset(st, in, mmtime);
-        g_queue_push_tail(st->msgq, in);
-        while (!display_stream_schedule(st)) {
+        display_frame *frame = display_frame_new(st, in);
+
+        display_stream_test_frames_mm_time_reset(st, frame, mmtime);
+        if (!invalid_mm_time && display_stream_skip_frame(st, frame, mmtime)) {
+            display_frame_free(frame);
+        } else {
+            display_stream_queue_frame(st, frame);
+            while (!display_stream_schedule(st)) {
+            }
         }
         if (st->cur_drops_seq_stats.len) {
             st->cur_drops_seq_stats.duration = op->multi_media_time -
@@ -1500,7 +2165,7 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
     }
     if (c->enable_adaptive_streaming) {
         display_update_stream_report(SPICE_DISPLAY_CHANNEL(channel), op->id,
-                                     op->multi_media_time, latency, invalid_mm_time);
+                                     op->multi_media_time, latency, drop);
         if (st->playback_sync_drops_seq_len >= STREAM_PLAYBACK_SYNC_DROP_SEQ_LEN_LIMIT) {
             spice_session_sync_playback_latency(spice_channel_get_session(channel));
             st->playback_sync_drops_seq_len = 0;
@@ -1530,17 +2195,14 @@ static void display_handle_stream_clip(SpiceChannel *channel, SpiceMsgIn *in)
     display_update_stream_region(st);
 }
 
-static void _msg_in_unref_func(gpointer data, gpointer user_data)
-{
-    spice_msg_in_unref(data);
-}
-
 static void destroy_stream(SpiceChannel *channel, int id)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
     display_stream *st;
+    display_frame *frame;
     guint64 drops_duration_total = 0;
     guint32 num_out_frames;
+    GList *l;
     int i;
 
     g_return_if_fail(c != NULL);
@@ -1554,13 +2216,15 @@ static void destroy_stream(SpiceChannel *channel, int id)
     num_out_frames = st->num_input_frames - st->num_drops_on_receive - st->num_drops_on_playback;
     CHANNEL_DEBUG(channel, "%s: id=%d #in-frames=%d out/in=%.2f "
         "#drops-on-receive=%d avg-late-time(ms)=%.2f "
-        "#drops-on-playback=%d", __FUNCTION__,
+        "#drops-on-playback=%d #late-on-playback=%d jitter(ms)=%u", __FUNCTION__,
         id,
         st->num_input_frames,
         num_out_frames / (double)st->num_input_frames,
         st->num_drops_on_receive,
         st->num_drops_on_receive ? st->arrive_late_time / ((double)st->num_drops_on_receive): 0,
-        st->num_drops_on_playback);
+        st->num_drops_on_playback,
+        st->num_late_on_playback,
+        st->jitter >> 4);
     if (st->num_drops_seqs) {
         CHANNEL_DEBUG(channel, "%s: #drops-sequences=%u ==>", __FUNCTION__, st->num_drops_seqs);
     }
@@ -1588,7 +2252,7 @@ static void destroy_stream(SpiceChannel *channel, int id)
 
     // If HW decode, force repaint of last frame's area
     if (st->hw_accel && st->surface->primary)
-        g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+        queue_invalidate(st->channel,
             st->dst_rect.left, st->dst_rect.top,
             st->dst_rect.right - st->dst_rect.left,
             st->dst_rect.bottom - st->dst_rect.top);
@@ -1597,10 +2261,24 @@ static void destroy_stream(SpiceChannel *channel, int id)
         spice_msg_in_unref(st->msg_clip);
     spice_msg_in_unref(st->msg_create);
 
-    g_queue_foreach(st->msgq, _msg_in_unref_func, NULL);
-    g_queue_free(st->msgq);
-    if (st->timeout != 0)
-        g_source_remove(st->timeout);
+    /* the decoder threads are gone, cancel the pending completions */
+    for (l = g_queue_peek_head_link(st->inflight); l != NULL; l = l->next) {
+        frame = l->data;
+        g_idle_remove_by_data(frame);
+        frame->inflight = FALSE;
+    }
+    while ((frame = g_queue_pop_head(st->frameq)) != NULL) {
+        g_queue_remove(st->inflight, frame);
+        display_frame_free(frame);
+    }
+    g_queue_free(st->frameq);
+    /* what is left was dropped while being decoded */
+    while ((frame = g_queue_pop_head(st->inflight)) != NULL)
+        display_frame_free(frame);
+    g_queue_free(st->inflight);
+    stream_frame_pool_clear(st);
+    g_source_destroy(st->render_source);
+    g_source_unref(st->render_source);
     g_free(st);
     c->streams[id] = NULL;
 
@@ -1818,6 +2496,7 @@ static void display_handle_surface_destroy(SpiceChannel *channel, SpiceMsgIn *in
             c->mark_false_event_id = g_timeout_add_seconds(1, display_mark_false, channel);
         }
         c->primary = NULL;
+        invalidate_cancel(channel);
         g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_PRIMARY_DESTROY], 0);
     }
 
@@ -134,6 +134,11 @@
     out->pad = 0;                                                          \
     out++;                                                                 \
 }
+#define COPY_COMP_RUN(in, out, n) {                         \
+    pixel_rgb555_be_to_rgb32((uint32_t *)(out), (in), (n)); \
+    in += (n) * 2;                                          \
+    out += (n);                                             \
+}
 #endif
 #endif
 
@@ -158,6 +163,11 @@
     out->pad = 0;                   \
     out++;                          \
 }
+#define COPY_COMP_RUN(in, out, n) {                         \
+    pixel_rgb24_to_rgb32((uint32_t *)(out), (in), (n));     \
+    in += (n) * 3;                                          \
+    out += (n);                                             \
+}
 #endif
 
 #ifdef LZ_RGB_ALPHA
@@ -168,23 +178,34 @@
 #define COPY_COMP_PIXEL(in, out) {out->pad = *(in++); out++;}
 #endif
 
+/* all the channels of the 32 bits output pixels are copied as a whole */
+#if defined(TO_RGB32) || defined(LZ_RGB32)
+#define COPY_REF_RUN(ref, out, n) {                                 \
+    pixel_copy32((uint32_t *)(out), (const uint32_t *)(ref), (n));  \
+    out += (n);                                                     \
+}
+#endif
+
 // TODO: separate into routines that decode to dist,len. and to a routine that
 // actually copies the data.
 
-/* returns num of bytes read from in buf.
+/* reads from decoder->in_now, and moves it past the decoded data.
    size should be in PIXEL */
-static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
-                            uint8_t* in_buf, uint8_t *out_buf, int size,
-                            uint64_t image_id, SpicePalette *plt)
+static void FNAME(decode)(GlibGlzDecoder *decoder,
+                          uint8_t *out_buf, int size,
+                          uint64_t image_id, SpicePalette *plt)
 {
-    uint8_t      *ip = in_buf;
+    uint8_t      *ip = decoder->in_now;
     OUT_PIXEL    *out_pix_buf = (OUT_PIXEL *)out_buf;
     OUT_PIXEL    *op = out_pix_buf;
     OUT_PIXEL    *op_limit = out_pix_buf + size;
 
-    uint32_t ctrl = *(ip++);
+    uint32_t ctrl;
     int loop = true;
 
+    ENSURE_INPUT(decoder, ip);
+    ctrl = *(ip++);
+
     do {
         if (ctrl >= MAX_COPY) { // reference (dictionary/RLE)
             OUT_PIXEL *ref = op;
@@ -202,6 +223,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 
             if (len == 7) { // match length is bigger than 7
                 do {
+                    ENSURE_INPUT(decoder, ip);
                     code = *(ip++);
                     len += code;
                 } while (code == 255); // remaining of len
@@ -253,68 +275,77 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 
             if (!image_dist) { // reference is inside the same image
                 ref -= pixel_ofs;
-                g_return_val_if_fail(ref + len <= op_limit, 0);
-                g_return_val_if_fail(ref >= out_pix_buf, 0);
+                g_return_if_fail(ref + len <= op_limit);
+                g_return_if_fail(ref >= out_pix_buf);
             } else {
-                ref = glz_decoder_window_bits(window, image_id,
+                ref = glz_decoder_window_bits(decoder, image_id,
                                               image_dist, pixel_ofs);
             }
 
-            g_return_val_if_fail(ref != NULL, 0);
-            g_return_val_if_fail(op + len <= op_limit, 0);
+            g_return_if_fail(ref != NULL);
+            g_return_if_fail(op + len <= op_limit);
 
             /* copying the match*/
 
+#ifdef COPY_REF_RUN
+            COPY_REF_RUN(ref, op, len);
+#else
             if (ref == (op - 1)) { // run (this will never be called in PLT4/1_TO_RGB because the
                                   // number of pixel copied is larger then one...
                 /* optimize copy for a run */
                 OUT_PIXEL b = *ref;
                 for (; len; --len) {
                     COPY_PIXEL(b, op);
-                    g_return_val_if_fail(op <= op_limit, 0);
+                    g_return_if_fail(op <= op_limit);
                 }
             } else {
                 for (; len; --len) {
                     COPY_REF_PIXEL(ref, op);
-                    g_return_val_if_fail(op <= op_limit, 0);
+                    g_return_if_fail(op <= op_limit);
                 }
             }
+#endif
         } else { // copy
             ctrl++; // copy count is biased by 1
 #if defined(TO_RGB32) && (defined(PLT4_BE) || defined(PLT4_LE) || defined(PLT1_BE) || \
                                                                                    defined(PLT1_LE))
-            g_return_val_if_fail(op + CAST_PLT_DISTANCE(ctrl) <= op_limit, 0);
+            g_return_if_fail(op + CAST_PLT_DISTANCE(ctrl) <= op_limit);
 #else
-            g_return_val_if_fail(op + ctrl <= op_limit, 0);
+            g_return_if_fail(op + ctrl <= op_limit);
 #endif
 
-#if defined(TO_RGB32) && defined(LZ_PLT)
-            g_return_val_if_fail(plt, 0);
+#if defined(COPY_COMP_RUN)
+            COPY_COMP_RUN(ip, op, ctrl);
+#elif defined(TO_RGB32) && defined(LZ_PLT)
+            g_return_if_fail(plt);
             COPY_COMP_PIXEL(ip, op, plt);
 #else
             COPY_COMP_PIXEL(ip, op);
 #endif
-            g_return_val_if_fail(op <= op_limit, 0);
+            g_return_if_fail(op <= op_limit);
 
+#ifndef COPY_COMP_RUN
             for (--ctrl; ctrl; ctrl--) {
 #if defined(TO_RGB32) && defined(LZ_PLT)
-                g_return_val_if_fail(plt, 0);
+                g_return_if_fail(plt);
                 COPY_COMP_PIXEL(ip, op, plt);
 #else
                 COPY_COMP_PIXEL(ip, op);
 #endif
-                g_return_val_if_fail(op <= op_limit, 0);
+                g_return_if_fail(op <= op_limit);
             }
+#endif
         } // END REF/COPY
 
         if (LZ_EXPECT_CONDITIONAL(op < op_limit)) {
+            ENSURE_INPUT(decoder, ip);
             ctrl = *(ip++);
         } else {
             loop = false;
         }
     } while (LZ_EXPECT_CONDITIONAL(loop));
 
-    return (ip - in_buf);
+    decoder->in_now = ip;
 }
 #undef LZ_PLT
 #undef PLT8
@@ -332,5 +363,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 #undef COPY_PIXEL
 #undef COPY_REF_PIXEL
 #undef COPY_COMP_PIXEL
+#undef COPY_COMP_RUN
+#undef COPY_REF_RUN
 #undef COPY_PLT_ENTRY
 #undef CAST_PLT_DISTANCE
@@ -20,12 +20,14 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <inttypes.h>
+#include <string.h>
 
 #include <glib.h>
 
 #include "gio-coroutine.h"
 #include "spice-util.h"
 #include "decode.h"
+#include "pixel-simd.h"
 
 #include "common/canvas_utils.h"
 
@@ -39,96 +41,333 @@ struct glz_image_hdr {
     uint32_t                win_head_dist;
 };
 
+/* an image of the window, its pixels are stored in the window buffer */
 struct glz_image {
     struct glz_image_hdr    hdr;
-    pixman_image_t          *surface;
     uint8_t                 *data;
 };
 
-static struct glz_image *glz_image_new(struct glz_image_hdr *hdr,
-                                       int type, void *opaque)
-{
-    struct glz_image *img;
-
-    g_return_val_if_fail(type == LZ_IMAGE_TYPE_RGB32 || type == LZ_IMAGE_TYPE_RGBA, NULL);
-
-    img = g_new0(struct glz_image, 1);
-    img->hdr = *hdr;
-    img->surface = alloc_lz_image_surface
-        (opaque, type == LZ_IMAGE_TYPE_RGBA ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
-         img->hdr.width, img->hdr.height, img->hdr.gross_pixels, img->hdr.top_down);
-    pixman_image_ref(img->surface);
-    img->data = (uint8_t *)pixman_image_get_data(img->surface);
-    if (!img->hdr.top_down) {
-        img->data = img->data - img->hdr.width * (img->hdr.height - 1) * 4;
-    }
-    return img;
-}
-
-static void glz_image_destroy(struct glz_image *img)
-{
-    if (img == NULL)
-        return;
-
-    pixman_image_unref(img->surface);
-    free(img);
-}
+/* space taken by an image in the window buffer, in arrival order */
+struct glz_window_chunk {
+    uint64_t                id;
+    gsize                   size;
+};
 
 /* ------------------------------------------------------------------ */
 
-#define INIT_IMAGES_CAPACITY 100
+#define INIT_IMAGES_CAPACITY 128
+#define INIT_CHUNKS_CAPACITY 128
+/* smaller images are not worth a thread round-trip */
+#define GLZ_THREAD_MIN_PIXELS (64 * 64)
+/* input buffer of the inflated images, and the bytes always readable
+ * past the input pointer, enough for any single literal or match */
+#define GLZ_IN_BUF_SIZE (64 * 1024)
+#define GLZ_IN_MARGIN 128
+/* the images in flight and received out of order come on top of the
+ * server window */
 #define WIN_OVERFLOW_FACTOR 1.5
 #define WIN_REALLOC_FACTOR 1.5
+#define WIN_ALIGN 16
 
+/*
+ * The pixels of the images are copied in a single ring buffer, sized
+ * after the server window, so that the memory used by the window is
+ * bounded and back-references stay close to each other. The images are
+ * indexed by id modulo nimages, which is always larger than the range
+ * of ids in the window, so that slots never collide.
+ */
 struct SpiceGlzDecoderWindow {
-    struct glz_image        **images;
+    struct glz_image        *images;
     uint32_t                nimages;
+    uint32_t                n_live;
     uint64_t                oldest;
     uint64_t                tail_gap;
+
+    uint8_t                 *buf;
+    gsize                   buf_size;
+    gsize                   buf_head;
+    gsize                   buf_used;
+    gsize                   max_size;
+    /* buffers replaced while threads may still read them */
+    GSList                  *retired;
+
+    struct glz_window_chunk *chunks;
+    uint32_t                nchunks;
+    uint32_t                chunks_first;
+    uint32_t                chunks_len;
+
+    /* decoders waiting for a referenced image, keyed by image id */
+    GCoroutineWaitQueue     *waiters;
+
+    /* decodes running in threads read the images concurrently, the
+     * window itself is only modified from the main context */
+    GMutex                  *lock;
+    GCond                   *cond;
+    GThreadPool             *pool;
+    /* bumped on clear, so that threads waiting for images give up */
+    guint                   generation;
+    guint                   n_decoding;
 };
 
-static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w)
+typedef struct GlibGlzDecoder {
+    SpiceGlzDecoder         base;
+    uint8_t                 *in_start;
+    uint8_t                 *in_now;
+    SpiceGlzDecoderWindow   *window;
+
+    /* ZLIB_GLZ images are inflated in the input buffer while being
+     * decoded, in_end is NULL for the other images */
+    SpiceZlibDecoder        *zlib;
+    uint8_t                 *in_buf;
+    uint8_t                 *in_end;
+    struct glz_image_hdr    image;
+
+    /* state of the decode running in the window thread pool */
+    uint8_t                 *out;
+    SpicePalette            *palette;
+    guint                   generation;
+    gboolean                threaded;
+    gboolean                cancelled;
+    gint                    done;
+    /* the idle waking the coroutine once the thread is done */
+    guint                   done_id;
+    GCoroutineWaitQueue     *done_waiters;
+} GlibGlzDecoder;
+
+static GMutex *glz_mutex_new(void)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    GMutex *mutex = g_new0(GMutex, 1);
+    g_mutex_init(mutex);
+    return mutex;
+#else
+    return g_mutex_new();
+#endif
+}
+
+static void glz_mutex_free(GMutex *mutex)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    g_mutex_clear(mutex);
+    g_free(mutex);
+#else
+    g_mutex_free(mutex);
+#endif
+}
+
+static GCond *glz_cond_new(void)
 {
-    struct glz_image  **new_images;
-    int i, new_slot;
+#if GLIB_CHECK_VERSION(2,32,0)
+    GCond *cond = g_new0(GCond, 1);
+    g_cond_init(cond);
+    return cond;
+#else
+    return g_cond_new();
+#endif
+}
 
-    SPICE_DEBUG("%s: array resize %d -> %d", __FUNCTION__,
-                w->nimages, w->nimages * 2);
-    new_images = g_new0(struct glz_image*, w->nimages * 2);
+static void glz_cond_free(GCond *cond)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    g_cond_clear(cond);
+    g_free(cond);
+#else
+    g_cond_free(cond);
+#endif
+}
+
+/* called with the window lock held */
+static struct glz_image *glz_decoder_window_lookup(SpiceGlzDecoderWindow *w,
+                                                   uint64_t id)
+{
+    struct glz_image *image = &w->images[id & (w->nimages - 1)];
+
+    return image->data != NULL && image->hdr.id == id ? image : NULL;
+}
+
+static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w, uint64_t span)
+{
+    struct glz_image *new_images;
+    uint32_t i, new_nimages = w->nimages;
+
+    while (new_nimages <= span)
+        new_nimages *= 2;
+
+    SPICE_DEBUG("%s: array resize %u -> %u", __FUNCTION__,
+                w->nimages, new_nimages);
+    new_images = g_new0(struct glz_image, new_nimages);
     for (i = 0; i < w->nimages; i++) {
-        if (w->images[i] == NULL) {
-            /*
-             * We can have empty slots when images come in out of order, this
-             * can happen when a vm has multiple displays, since each display
-             * uses its own socket there is no guarantee that images
-             * originating from different displays are received in id order.
-             */
+        if (w->images[i].data == NULL)
             continue;
-        }
-        new_slot = w->images[i]->hdr.id % (w->nimages * 2);
-        new_images[new_slot] = w->images[i];
+        new_images[w->images[i].hdr.id & (new_nimages - 1)] = w->images[i];
     }
-    free(w->images);
+    g_free(w->images);
     w->images = new_images;
-    w->nimages *= 2;
+    w->nimages = new_nimages;
 }
 
-static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
-                                   struct glz_image *img)
+static void glz_decoder_window_free_retired(SpiceGlzDecoderWindow *w)
+{
+    if (w->n_decoding > 0)
+        return;
+
+    g_slist_free_full(w->retired, g_free);
+    w->retired = NULL;
+}
+
+/* reclaim the space of the released images, in arrival order */
+static void glz_decoder_window_reclaim(SpiceGlzDecoderWindow *w)
+{
+    while (w->chunks_len > 0 && w->chunks[w->chunks_first].id < w->oldest) {
+        w->buf_used -= w->chunks[w->chunks_first].size;
+        w->chunks_first = (w->chunks_first + 1) % w->nchunks;
+        w->chunks_len--;
+    }
+    if (w->chunks_len == 0) {
+        g_warn_if_fail(w->buf_used == 0);
+        w->buf_used = 0;
+        w->buf_head = 0;
+    }
+}
+
+/* the offset of the oldest image still in the buffer */
+static gsize glz_decoder_window_buf_tail(SpiceGlzDecoderWindow *w)
+{
+    gsize used = w->buf_used;
+
+    if (used <= w->buf_head)
+        return w->buf_head - used;
+    return w->buf_size - (used - w->buf_head);
+}
+
+/* move the images to a larger buffer, the previous one is kept until
+ * no thread can be reading it */
+static void glz_decoder_window_grow(SpiceGlzDecoderWindow *w, gsize size)
+{
+    uint8_t *new_buf;
+    gsize new_size, head = 0;
+    uint32_t i;
+
+    new_size = MAX(w->buf_size * WIN_REALLOC_FACTOR, w->buf_used + size);
+    new_size = MAX(new_size, w->max_size);
+    new_size = (new_size + WIN_ALIGN - 1) & ~(gsize)(WIN_ALIGN - 1);
+    SPICE_DEBUG("%s: buffer resize %" G_GSIZE_FORMAT " -> %" G_GSIZE_FORMAT,
+                __FUNCTION__, w->buf_size, new_size);
+    new_buf = g_malloc(new_size);
+
+    for (i = 0; i < w->chunks_len; i++) {
+        struct glz_window_chunk *chunk = &w->chunks[(w->chunks_first + i) % w->nchunks];
+        struct glz_image *image = glz_decoder_window_lookup(w, chunk->id);
+
+        if (image != NULL) {
+            gsize bytes = image->hdr.gross_pixels * 4;
+
+            memcpy(new_buf + head, image->data, bytes);
+            image->data = new_buf + head;
+            chunk->size = (bytes + WIN_ALIGN - 1) & ~(gsize)(WIN_ALIGN - 1);
+        } else {
+            /* released, but not reclaimed yet */
+            chunk->size = 0;
+        }
+        head += chunk->size;
+    }
+
+    if (w->buf != NULL)
+        w->retired = g_slist_prepend(w->retired, w->buf);
+    w->buf = new_buf;
+    w->buf_size = new_size;
+    w->buf_head = head;
+    w->buf_used = head;
+}
+
+/* returns where to store @size bytes, which are accounted as used */
+static uint8_t *glz_decoder_window_alloc(SpiceGlzDecoderWindow *w, gsize size,
+                                         gsize *charged)
 {
-    int slot = img->hdr.id % w->nimages;
+    gsize tail = glz_decoder_window_buf_tail(w);
+    gsize offset;
+
+    if (w->buf_used == 0 || w->buf_head > tail ||
+        (w->buf_head == tail && w->buf_used < w->buf_size)) {
+        if (w->buf_size - w->buf_head >= size) {
+            offset = w->buf_head;
+            *charged = size;
+        } else if (tail >= size) {
+            /* wrap around, the end of the buffer is lost until reclaimed */
+            offset = 0;
+            *charged = size + (w->buf_size - w->buf_head);
+        } else {
+            glz_decoder_window_grow(w, size);
+            return glz_decoder_window_alloc(w, size, charged);
+        }
+    } else if (tail - w->buf_head >= size) {
+        offset = w->buf_head;
+        *charged = size;
+    } else {
+        glz_decoder_window_grow(w, size);
+        return glz_decoder_window_alloc(w, size, charged);
+    }
 
-    if (w->images[slot]) {
-        /* need more space */
-        glz_decoder_window_resize(w);
-        slot = img->hdr.id % w->nimages;
+    w->buf_head = offset + size;
+    w->buf_used += *charged;
+    return w->buf + offset;
+}
+
+static void glz_decoder_window_push_chunk(SpiceGlzDecoderWindow *w,
+                                          uint64_t id, gsize size)
+{
+    if (w->chunks_len == w->nchunks) {
+        struct glz_window_chunk *chunks = g_new(struct glz_window_chunk, w->nchunks * 2);
+        uint32_t i;
+
+        for (i = 0; i < w->chunks_len; i++)
+            chunks[i] = w->chunks[(w->chunks_first + i) % w->nchunks];
+        g_free(w->chunks);
+        w->chunks = chunks;
+        w->chunks_first = 0;
+        w->nchunks *= 2;
     }
 
-    w->images[slot] = img;
+    w->chunks[(w->chunks_first + w->chunks_len) % w->nchunks].id = id;
+    w->chunks[(w->chunks_first + w->chunks_len) % w->nchunks].size = size;
+    w->chunks_len++;
+}
+
+/* main context, called with the window lock held */
+static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
+                                   struct glz_image_hdr *hdr, uint8_t *pixels)
+{
+    struct glz_image *image;
+    gsize size = hdr->gross_pixels * 4;
+    gsize charged;
+
+    if (w->n_live == 0 && w->oldest == 0 && w->tail_gap == 0 &&
+        hdr->id >= hdr->win_head_dist) {
+        /* start the window where the server one starts */
+        w->oldest = w->tail_gap = hdr->id - hdr->win_head_dist;
+    }
+    if (hdr->id < w->oldest) {
+        /* no image can refer to it anymore */
+        return;
+    }
+    if (hdr->id - w->oldest >= w->nimages)
+        glz_decoder_window_resize(w, hdr->id - w->oldest);
+
+    glz_decoder_window_free_retired(w);
+    size = (size + WIN_ALIGN - 1) & ~(gsize)(WIN_ALIGN - 1);
+    image = &w->images[hdr->id & (w->nimages - 1)];
+    g_warn_if_fail(image->data == NULL);
+    image->hdr = *hdr;
+    image->data = glz_decoder_window_alloc(w, size, &charged);
+    memcpy(image->data, pixels, hdr->gross_pixels * 4);
+    glz_decoder_window_push_chunk(w, hdr->id, charged);
+    w->n_live++;
 
     /* close the gap */
-    while (w->tail_gap <= img->hdr.id && w->images[w->tail_gap % w->nimages] != NULL)
+    while (w->tail_gap <= hdr->id && glz_decoder_window_lookup(w, w->tail_gap) != NULL)
         w->tail_gap++;
+
+    g_cond_broadcast(w->cond);
 }
 
 struct wait_for_image_data {
@@ -139,55 +378,91 @@ struct wait_for_image_data {
 static gboolean wait_for_image(gpointer data)
 {
     struct wait_for_image_data *wait = data;
-    int slot = wait->id % wait->window->nimages;
-    struct glz_image *image = wait->window->images[slot];
-    gboolean ready = image && image->hdr.id == wait->id;
+    gboolean ready;
+
+    g_mutex_lock(wait->window->lock);
+    ready = glz_decoder_window_lookup(wait->window, wait->id) != NULL;
+    g_mutex_unlock(wait->window->lock);
 
     return ready;
 }
 
-static void *glz_decoder_window_bits(SpiceGlzDecoderWindow *w, uint64_t id,
+static void *glz_decoder_window_bits(GlibGlzDecoder *d, uint64_t id,
                                      uint32_t dist, uint32_t offset)
 {
-    struct wait_for_image_data data = {
+    SpiceGlzDecoderWindow *w = d->window;
+    struct glz_image *image;
+    uint8_t *data = NULL;
+    struct wait_for_image_data wait = {
         .window = w,
         .id = id - dist,
     };
 
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_for_image, &data))
-        SPICE_DEBUG("wait for image cancelled");
+    if (!d->threaded) {
+        if (!g_coroutine_wait_queue_wait(w->waiters, wait.id, g_coroutine_self(),
+                                         wait_for_image, &wait))
+            SPICE_DEBUG("wait for image cancelled");
+    }
 
-    int slot = (id - dist) % w->nimages;
+    g_mutex_lock(w->lock);
+    /* the image may still be decoding in another display channel */
+    while ((image = glz_decoder_window_lookup(w, wait.id)) == NULL &&
+           d->threaded && !d->cancelled && d->generation == w->generation)
+        g_cond_wait(w->cond, w->lock);
+    if (image != NULL && image->hdr.gross_pixels >= offset)
+        data = image->data + offset * 4;
+    g_mutex_unlock(w->lock);
 
-    g_return_val_if_fail(w->images[slot] != NULL, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.id == id - dist, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.gross_pixels >= offset, NULL);
+    g_return_val_if_fail(data != NULL, NULL);
 
-    return w->images[slot]->data + offset * 4;
+    return data;
 }
 
+/* main context, called with the window lock held */
 static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
                                        uint64_t oldest)
 {
-    int slot;
+    struct glz_image *image;
 
     while (w->oldest < oldest) {
-        slot = w->oldest % w->nimages;
-        glz_image_destroy(w->images[slot]);
-        w->images[slot] = NULL;
+        image = glz_decoder_window_lookup(w, w->oldest);
+        if (image != NULL) {
+            image->data = NULL;
+            w->n_live--;
+        }
         w->oldest++;
     }
+    glz_decoder_window_reclaim(w);
 }
 
-/* ------------------------------------------------------------------ */
+void glz_decoder_window_set_size(SpiceGlzDecoderWindow *w, gsize size)
+{
+    g_mutex_lock(w->lock);
+    w->max_size = size * WIN_OVERFLOW_FACTOR;
+    if (w->buf_size < w->max_size && w->buf_used == 0) {
+        /* allocate it once, before it is in use */
+        g_free(w->buf);
+        w->buf_size = (w->max_size + WIN_ALIGN - 1) & ~(gsize)(WIN_ALIGN - 1);
+        w->buf = g_malloc(w->buf_size);
+        w->buf_head = 0;
+    }
+    g_mutex_unlock(w->lock);
+}
 
-typedef struct GlibGlzDecoder {
-    SpiceGlzDecoder         base;
-    uint8_t                 *in_start;
-    uint8_t                 *in_now;
-    SpiceGlzDecoderWindow   *window;
-    struct glz_image_hdr    image;
-} GlibGlzDecoder;
+void glz_decoder_window_get_stats(SpiceGlzDecoderWindow *w,
+                                  gsize *used, gsize *size, guint *n_images)
+{
+    g_mutex_lock(w->lock);
+    if (used)
+        *used = w->buf_used;
+    if (size)
+        *size = w->buf_size;
+    if (n_images)
+        *n_images = w->n_live;
+    g_mutex_unlock(w->lock);
+}
+
+/* ------------------------------------------------------------------ */
 
 /*
  * Give hints to the compiler for branch prediction optimization.
@@ -238,6 +513,26 @@ typedef uint16_t rgb16_pixel_t;
 
 #undef ATTR_PACKED
 
+/* main context, or window thread pool */
+static uint8_t *glz_decoder_refill(GlibGlzDecoder *d, uint8_t *ip)
+{
+    gsize left = ip < d->in_end ? d->in_end - ip : 0;
+
+    memmove(d->in_buf, ip, left);
+    d->in_end = d->in_buf + left;
+    d->in_end += zlib_decoder_stream_read(d->zlib, d->in_end, GLZ_IN_BUF_SIZE - left);
+    /* a truncated stream decodes as zeros, without reading past the buffer */
+    memset(d->in_end, 0, GLZ_IN_MARGIN);
+
+    return d->in_buf;
+}
+
+#define ENSURE_INPUT(decoder, ip) do {                                  \
+    if (LZ_UNEXPECT_CONDITIONAL((decoder)->in_end != NULL &&            \
+                                (decoder)->in_end - (ip) < GLZ_IN_MARGIN)) \
+        (ip) = glz_decoder_refill(decoder, ip);                         \
+} while (0)
+
 #define LZ_PLT
 #include "decode-glz-tmpl.c"
 
@@ -284,10 +579,11 @@ typedef uint16_t rgb16_pixel_t;
 
 #undef LZ_UNEXPECT_CONDITIONAL
 #undef LZ_EXPECT_CONDITIONAL
+#undef ENSURE_INPUT
 
-typedef size_t (*decode_function)(SpiceGlzDecoderWindow *window,
-                                  uint8_t* in_buf, uint8_t *out_buf, int size,
-                                  uint64_t id, SpicePalette *plt);
+typedef void (*decode_function)(GlibGlzDecoder *decoder,
+                                uint8_t *out_buf, int size,
+                                uint64_t id, SpicePalette *plt);
 
 // ordered according to LZ_IMAGE_TYPE
 const decode_function DECODE_TO_RGB32[] = {
@@ -374,17 +670,125 @@ static void decode_header(GlibGlzDecoder *d)
             d->image.id - d->image.win_head_dist);
 }
 
+/* main context, or window thread pool */
+static void glz_decode_pixels(GlibGlzDecoder *d)
+{
+    DECODE_TO_RGB32[d->image.type]
+        (d, d->out, d->image.gross_pixels, d->image.id, d->palette);
+
+    if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
+        glz_rgb_alpha_decode(d, d->out,
+                             d->image.gross_pixels, d->image.id, d->palette);
+    }
+}
+
+/* main context */
+static gboolean glz_decode_wake(gpointer data)
+{
+    GlibGlzDecoder *d = data;
+
+    /* done_id is set by the thread with the lock held */
+    g_mutex_lock(d->window->lock);
+    d->done_id = 0;
+    g_mutex_unlock(d->window->lock);
+
+    g_coroutine_wait_queue_wake(d->done_waiters, 0);
+
+    return FALSE;
+}
+
+/* window thread pool */
+static void glz_decode_thread(gpointer data, gpointer user_data)
+{
+    GlibGlzDecoder *d = data;
+    SpiceGlzDecoderWindow *w = user_data;
+
+    glz_decode_pixels(d);
+
+    g_mutex_lock(w->lock);
+    w->n_decoding--;
+    g_atomic_int_set(&d->done, TRUE);
+    g_cond_broadcast(w->cond);
+    if (!d->cancelled)
+        d->done_id = g_idle_add(glz_decode_wake, d);
+    g_mutex_unlock(w->lock);
+}
+
+static gboolean glz_decode_done(gpointer data)
+{
+    GlibGlzDecoder *d = data;
+
+    return g_atomic_int_get(&d->done);
+}
+
+/* main context, waits for the thread, which uses the decoder, its
+ * input and its output. With @cancel, it gives up waiting for images */
+static void glz_decode_join(GlibGlzDecoder *d, gboolean cancel)
+{
+    SpiceGlzDecoderWindow *w = d->window;
+
+    g_mutex_lock(w->lock);
+    if (cancel) {
+        d->cancelled = TRUE;
+        g_cond_broadcast(w->cond);
+    }
+    while (!g_atomic_int_get(&d->done))
+        g_cond_wait(w->cond, w->lock);
+    if (d->done_id != 0) {
+        g_source_remove(d->done_id);
+        d->done_id = 0;
+    }
+    g_mutex_unlock(w->lock);
+
+    d->threaded = FALSE;
+}
+
+/* coroutine context */
+static void glz_decode_threaded(GlibGlzDecoder *d)
+{
+    SpiceGlzDecoderWindow *w = d->window;
+    gboolean done;
+
+    g_mutex_lock(w->lock);
+    w->n_decoding++;
+    d->generation = w->generation;
+    d->cancelled = FALSE;
+    d->done = FALSE;
+    g_mutex_unlock(w->lock);
+
+    d->threaded = TRUE;
+    g_thread_pool_push(w->pool, d, NULL);
+
+    /* let the other channels run, and submit their own images. A
+     * cancelled coroutine is not resumed, glz_decoder_destroy() then
+     * waits for the thread */
+    done = g_coroutine_wait_queue_wait(d->done_waiters, 0, g_coroutine_self(),
+                                       glz_decode_done, d);
+    if (!done)
+        SPICE_DEBUG("wait for glz decode cancelled");
+    glz_decode_join(d, !done);
+}
+
 static void decode(SpiceGlzDecoder *decoder,
                    uint8_t *data, SpicePalette *palette,
                    void *usr_data)
 {
     GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+    SpiceGlzDecoderWindow *w = d->window;
     LzImageType decoded_type;
-    struct glz_image *decoded_image;
-    size_t n_in_bytes_decoded;
+    guint generation = w->generation;
+    pixman_image_t *surface;
 
     d->in_start = data;
     d->in_now = data;
+    d->in_end = NULL;
+    if (d->zlib != NULL && zlib_decoder_stream_start(d->zlib, data)) {
+        /* a ZLIB_GLZ image, @data was never inflated */
+        if (d->in_buf == NULL)
+            d->in_buf = g_malloc(GLZ_IN_BUF_SIZE + GLZ_IN_MARGIN);
+        d->in_end = d->in_buf;
+        d->in_now = glz_decoder_refill(d, d->in_buf);
+    }
 
     decode_header(d);
 
@@ -394,30 +798,42 @@ static void decode(SpiceGlzDecoder *decoder,
         decoded_type = LZ_IMAGE_TYPE_RGB32;
     }
 
-    decoded_image = glz_image_new(&d->image, decoded_type, usr_data);
-
-    n_in_bytes_decoded = DECODE_TO_RGB32[d->image.type]
-        (d->window, d->in_now, decoded_image->data,
-         d->image.gross_pixels, d->image.id, palette);
+    surface = alloc_lz_image_surface
+        (usr_data, decoded_type == LZ_IMAGE_TYPE_RGBA ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
+         d->image.width, d->image.height, d->image.gross_pixels, d->image.top_down);
+    d->out = (uint8_t *)pixman_image_get_data(surface);
+    if (!d->image.top_down) {
+        d->out = d->out - d->image.width * (d->image.height - 1) * 4;
+    }
+    d->palette = palette;
 
-    d->in_now += n_in_bytes_decoded;
+    if (w->pool != NULL && d->image.gross_pixels >= GLZ_THREAD_MIN_PIXELS)
+        glz_decode_threaded(d);
+    else
+        glz_decode_pixels(d);
 
-    if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
-        glz_rgb_alpha_decode(d->window, d->in_now, decoded_image->data,
-                             d->image.gross_pixels, d->image.id, palette);
+    g_mutex_lock(w->lock);
+    if (w->generation != generation) {
+        /* the window was cleared meanwhile */
+        g_mutex_unlock(w->lock);
+        return;
     }
 
-    glz_decoder_window_add(d->window, decoded_image);
+    /* the canvas owns the surface, keep a copy of the pixels */
+    glz_decoder_window_add(w, &d->image, d->out);
 
     { /* release old images from last tail_gap, only if the gap is closed  */
         uint64_t oldest;
-        struct glz_image *image = d->window->images[(d->window->tail_gap - 1) % d->window->nimages];
+        struct glz_image *image = glz_decoder_window_lookup(w, w->tail_gap - 1);
 
-        g_return_if_fail(image != NULL);
-
-        oldest = image->hdr.id - image->hdr.win_head_dist;
-        glz_decoder_window_release(d->window, oldest);
+        if (image != NULL) {
+            oldest = image->hdr.id - image->hdr.win_head_dist;
+            glz_decoder_window_release(w, oldest);
+        }
     }
+    g_mutex_unlock(w->lock);
+
+    g_coroutine_wait_queue_wake(w->waiters, d->image.id);
 }
 
 /* ------------------------------------------------------------------ */
@@ -428,25 +844,47 @@ static SpiceGlzDecoderOps glz_decoder_ops = {
 
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w)
 {
-    int i;
-
-    g_return_if_fail(w->nimages == 0 || w->images != NULL);
+    g_mutex_lock(w->lock);
+    /* make the threads waiting for an image give up */
+    w->generation++;
+    g_cond_broadcast(w->cond);
+    while (w->n_decoding > 0)
+        g_cond_wait(w->cond, w->lock);
 
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i]) {
-            glz_image_destroy(w->images[i]);
-        }
-    }
+    glz_decoder_window_free_retired(w);
 
-    w->nimages = 16;
+    /* the buffer is kept, its size only depends on the server window */
+    w->nimages = INIT_IMAGES_CAPACITY;
     g_free(w->images);
-    w->images = g_new0(struct glz_image*, w->nimages);
+    w->images = g_new0(struct glz_image, w->nimages);
+    w->n_live = 0;
+    w->oldest = 0;
     w->tail_gap = 0;
+
+    w->nchunks = INIT_CHUNKS_CAPACITY;
+    g_free(w->chunks);
+    w->chunks = g_new(struct glz_window_chunk, w->nchunks);
+    w->chunks_first = 0;
+    w->chunks_len = 0;
+    w->buf_head = 0;
+    w->buf_used = 0;
+    g_mutex_unlock(w->lock);
 }
 
 SpiceGlzDecoderWindow *glz_decoder_window_new(void)
 {
     SpiceGlzDecoderWindow *w = g_new0(SpiceGlzDecoderWindow, 1);
+
+    pixel_simd_setup();
+    w->waiters = g_coroutine_wait_queue_new();
+    w->lock = glz_mutex_new();
+    w->cond = glz_cond_new();
+    /* Each display channel has at most one image decoding at a time, so
+     * the number of threads is bounded by the number of channels. It
+     * must not be capped lower: a decode can wait for an image still
+     * decoding in another thread. */
+    if (!g_getenv("SPICE_DISABLE_GLZ_DECODE_THREADS"))
+        w->pool = g_thread_pool_new(glz_decode_thread, w, -1, FALSE, NULL);
     glz_decoder_window_clear(w);
     return w;
 }
@@ -457,8 +895,15 @@ void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w)
         return;
 
     glz_decoder_window_clear(w);
-    free(w->images);
-    free(w);
+    if (w->pool != NULL)
+        g_thread_pool_free(w->pool, FALSE, TRUE);
+    g_coroutine_wait_queue_free(w->waiters);
+    glz_cond_free(w->cond);
+    glz_mutex_free(w->lock);
+    g_free(w->chunks);
+    g_free(w->buf);
+    g_free(w->images);
+    g_free(w);
 }
 
 SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w)
@@ -466,10 +911,32 @@ SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w)
     GlibGlzDecoder *d = g_new0(GlibGlzDecoder, 1);
     d->base.ops = &glz_decoder_ops;
     d->window = w;
+    d->done_waiters = g_coroutine_wait_queue_new();
     return &d->base;
 }
 
-void glz_decoder_destroy(SpiceGlzDecoder *d)
+void glz_decoder_destroy(SpiceGlzDecoder *decoder)
 {
+    GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+
+    /* the coroutine waiting for a threaded decode was cancelled */
+    if (d->threaded)
+        glz_decode_join(d, TRUE);
+    g_coroutine_wait_queue_free(d->done_waiters);
+    g_free(d->in_buf);
     free(d);
 }
+
+/* The ZLIB_GLZ images decoded by @zlib are then inflated piecewise while
+ * @decoder reads them, instead of as a whole beforehand. Both must be
+ * used by the same canvas. */
+void glz_decoder_set_zlib(SpiceGlzDecoder *decoder, SpiceZlibDecoder *zlib)
+{
+    GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
+
+    if (d->zlib != NULL)
+        zlib_decoder_set_deferred(d->zlib, FALSE);
+    d->zlib = zlib;
+    if (zlib != NULL)
+        zlib_decoder_set_deferred(zlib, TRUE);
+}
@@ -33,6 +33,12 @@
 #include <stdio.h>
 #include <jpeglib.h>
 
+#if !defined(JCS_EXTENSIONS) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define JPEG_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
 typedef struct GlibJpegDecoder
 {
     SpiceJpegDecoder              base;
@@ -44,6 +50,11 @@ typedef struct GlibJpegDecoder
     int      _data_size;
     int      _width;
     int      _height;
+#ifndef JCS_EXTENSIONS
+    /* scanlines waiting for the conversion to the bitmap format */
+    uint8_t* _lines;
+    gsize    _lines_size;
+#endif
 } GlibJpegDecoder;
 
 static void begin_decode(SpiceJpegDecoder *decoder,
@@ -74,7 +85,7 @@ static void begin_decode(SpiceJpegDecoder *decoder,
     *out_height = d->_height;
 }
 
-/* TODO: move it elsewhere and reuse it in get_pixbuf(), optimize? */
+#ifndef JCS_EXTENSIONS
 typedef void (*converter_rgb_t)(uint8_t* src, uint8_t* dest, int width);
 
 static void convert_rgb_to_bgr(uint8_t* src, uint8_t* dest, int width)
@@ -97,39 +108,135 @@ static void convert_rgb_to_bgrx(uint8_t* src, uint8_t* dest, int width)
         *dest++ = src[2];
         *dest++ = src[1];
         *dest++ = src[0];
-        *dest++ = 0;
+        *dest++ = 0xff;
         src += 3;
     }
 }
 
+#ifdef JPEG_SIMD_X86
+/* the 16 bytes loads and stores go up to 1 pixel past the converted
+ * ones, the loops leave the last pixels to the scalar versions */
+
+__attribute__((target("ssse3")))
+static void convert_rgb_to_bgr_ssse3(uint8_t* src, uint8_t* dest, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 5, 4, 3, 8, 7, 6,
+                                          11, 10, 9, 14, 13, 12, 15);
+
+    for (; width >= 6; width -= 5, src += 15, dest += 15) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi8(v, shuffle));
+    }
+    convert_rgb_to_bgr(src, dest, width);
+}
+
+__attribute__((target("ssse3")))
+static void convert_rgb_to_bgrx_ssse3(uint8_t* src, uint8_t* dest, int width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                          8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i pad = _mm_set1_epi32(0xff000000);
+
+    for (; width >= 6; width -= 4, src += 12, dest += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        v = _mm_or_si128(_mm_shuffle_epi8(v, shuffle), pad);
+        _mm_storeu_si128((__m128i *)dest, v);
+    }
+    convert_rgb_to_bgrx(src, dest, width);
+}
+
+static gboolean have_ssse3(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+#endif /* JPEG_SIMD_X86 */
+
+static converter_rgb_t get_converter(int format)
+{
+#ifdef JPEG_SIMD_X86
+    static gsize ssse3 = 0;
+
+    if (g_once_init_enter(&ssse3))
+        g_once_init_leave(&ssse3, have_ssse3() ? 1 : 2);
+#endif
+
+    switch (format) {
+    case SPICE_BITMAP_FMT_24BIT:
+#ifdef JPEG_SIMD_X86
+        if (ssse3 == 1)
+            return convert_rgb_to_bgr_ssse3;
+#endif
+        return convert_rgb_to_bgr;
+    case SPICE_BITMAP_FMT_32BIT:
+#ifdef JPEG_SIMD_X86
+        if (ssse3 == 1)
+            return convert_rgb_to_bgrx_ssse3;
+#endif
+        return convert_rgb_to_bgrx;
+    default:
+        return NULL;
+    }
+}
+#endif /* !JCS_EXTENSIONS */
+
 static void decode(SpiceJpegDecoder *decoder,
                    uint8_t* dest, int stride, int format)
 {
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
-    uint8_t* scan_line = g_alloca(d->_width * 3);
-    converter_rgb_t converter = NULL;
-    int row;
-
+    JSAMPROW lines[4];
+#ifdef JCS_EXTENSIONS
+    /* requires jpeg-turbo, the scanlines are written to @dest directly */
     switch (format) {
     case SPICE_BITMAP_FMT_24BIT:
-        converter = convert_rgb_to_bgr;
+        d->_cinfo.out_color_space = JCS_EXT_BGR;
         break;
     case SPICE_BITMAP_FMT_32BIT:
-        converter = convert_rgb_to_bgrx;
+        d->_cinfo.out_color_space = JCS_EXT_BGRX;
         break;
     default:
         g_warning("bad bitmap format, %d", format);
         return;
     }
+#else
+    converter_rgb_t converter = get_converter(format);
+    gsize line_size = d->_width * 3;
 
-    g_return_if_fail(converter != NULL);
+    if (converter == NULL) {
+        g_warning("bad bitmap format, %d", format);
+        return;
+    }
+
+    if (d->_lines_size < line_size * G_N_ELEMENTS(lines)) {
+        g_free(d->_lines);
+        d->_lines_size = line_size * G_N_ELEMENTS(lines);
+        d->_lines = g_malloc(d->_lines_size);
+    }
+#endif
 
     jpeg_start_decompress(&d->_cinfo);
 
-    for (row = 0; row < d->_height; row++) {
-        jpeg_read_scanlines(&d->_cinfo, &scan_line, 1);
-        converter(scan_line, dest, d->_width);
-        dest += stride;
+    /* rec_outbuf_height is the number of lines libjpeg produces at once */
+    while (d->_cinfo.output_scanline < d->_cinfo.output_height) {
+        unsigned int row = d->_cinfo.output_scanline;
+        unsigned int nlines = MIN(d->_cinfo.rec_outbuf_height, G_N_ELEMENTS(lines));
+        unsigned int j, lines_read;
+
+        nlines = MIN(nlines, d->_cinfo.output_height - row);
+        for (j = 0; j < nlines; j++) {
+#ifdef JCS_EXTENSIONS
+            lines[j] = dest + (int)(row + j) * stride;
+#else
+            lines[j] = d->_lines + j * line_size;
+#endif
+        }
+        lines_read = jpeg_read_scanlines(&d->_cinfo, lines, nlines);
+        if (lines_read == 0)
+            break;
+#ifndef JCS_EXTENSIONS
+        for (j = 0; j < lines_read; j++)
+            converter(lines[j], dest + (int)(row + j) * stride, d->_width);
+#endif
     }
 
     jpeg_finish_decompress(&d->_cinfo);
@@ -187,5 +294,8 @@ void jpeg_decoder_destroy(SpiceJpegDecoder *decoder)
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
 
     jpeg_destroy_decompress(&d->_cinfo);
+#ifndef JCS_EXTENSIONS
+    g_free(d->_lines);
+#endif
     free(d);
 }
@@ -23,12 +23,27 @@
 #define ZLIB_WINAPI
 #endif
 
+#ifdef HAVE_ZLIB_NG
+#include <zlib-ng.h>
+#define z_stream zng_stream
+#define inflateInit zng_inflateInit
+#define inflateReset zng_inflateReset
+#define inflate zng_inflate
+#define inflateEnd zng_inflateEnd
+#else
 #include <zlib.h>
+#endif
 
 typedef struct GlibZlibDecoder
 {
     SpiceZlibDecoder         base;
     z_stream                 _z_strm;
+
+    /* see zlib_decoder_set_deferred() */
+    gboolean                 deferred;
+    uint8_t                  *pending_dest;
+    gsize                    stream_left;
+    gboolean                 stream_end;
 } GlibZlibDecoder;
 
 static void decode(SpiceZlibDecoder *decoder,
@@ -41,6 +56,14 @@ static void decode(SpiceZlibDecoder *decoder,
     inflateReset(&d->_z_strm);
     d->_z_strm.next_in = data;
     d->_z_strm.avail_in = data_size;
+
+    if (d->deferred) {
+        d->pending_dest = dest;
+        d->stream_left = dest_size;
+        d->stream_end = FALSE;
+        return;
+    }
+
     d->_z_strm.next_out = dest;
     d->_z_strm.avail_out = dest_size;
 
@@ -55,6 +78,57 @@ static SpiceZlibDecoderOps zlib_decoder_ops = {
     .decode = decode,
 };
 
+/*
+ * When deferred, decode() only records its input, and the output is
+ * produced piecewise by zlib_decoder_stream_read() once the consumer
+ * of @dest asks for it with zlib_decoder_stream_start(). @dest is
+ * never written.
+ */
+void zlib_decoder_set_deferred(SpiceZlibDecoder *decoder, gboolean deferred)
+{
+    GlibZlibDecoder *d = SPICE_CONTAINEROF(decoder, GlibZlibDecoder, base);
+
+    d->deferred = deferred;
+    d->pending_dest = NULL;
+}
+
+/* Returns TRUE if the last decode() was deferred and targets @dest */
+gboolean zlib_decoder_stream_start(SpiceZlibDecoder *decoder, uint8_t *dest)
+{
+    GlibZlibDecoder *d = SPICE_CONTAINEROF(decoder, GlibZlibDecoder, base);
+    gboolean pending = d->pending_dest != NULL && d->pending_dest == dest;
+
+    d->pending_dest = NULL;
+    return pending;
+}
+
+/* Inflates up to @size bytes to @buf, returns 0 at the end of the stream */
+gsize zlib_decoder_stream_read(SpiceZlibDecoder *decoder, uint8_t *buf, gsize size)
+{
+    GlibZlibDecoder *d = SPICE_CONTAINEROF(decoder, GlibZlibDecoder, base);
+    int z_ret;
+
+    size = MIN(size, d->stream_left);
+    if (d->stream_end || size == 0)
+        return 0;
+
+    d->_z_strm.next_out = buf;
+    d->_z_strm.avail_out = size;
+
+    z_ret = inflate(&d->_z_strm, Z_NO_FLUSH);
+
+    size -= d->_z_strm.avail_out;
+    d->stream_left -= size;
+    if (z_ret == Z_STREAM_END) {
+        d->stream_end = TRUE;
+    } else if (z_ret != Z_OK) {
+        g_warning("zlib inflate failed, error %d", z_ret);
+        d->stream_end = TRUE;
+    }
+
+    return size;
+}
+
 SpiceZlibDecoder *zlib_decoder_new(void)
 {
     GlibZlibDecoder *d = g_new0(GlibZlibDecoder, 1);
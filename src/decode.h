@@ -29,12 +29,19 @@ typedef struct SpiceGlzDecoderWindow SpiceGlzDecoderWindow;
 SpiceGlzDecoderWindow *glz_decoder_window_new(void);
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w);
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w);
+void glz_decoder_window_set_size(SpiceGlzDecoderWindow *w, gsize size);
+void glz_decoder_window_get_stats(SpiceGlzDecoderWindow *w,
+                                  gsize *used, gsize *size, guint *n_images);
 
 SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w);
 void glz_decoder_destroy(SpiceGlzDecoder *d);
+void glz_decoder_set_zlib(SpiceGlzDecoder *d, SpiceZlibDecoder *zlib);
 
 SpiceZlibDecoder *zlib_decoder_new(void);
 void zlib_decoder_destroy(SpiceZlibDecoder *d);
+void zlib_decoder_set_deferred(SpiceZlibDecoder *d, gboolean deferred);
+gboolean zlib_decoder_stream_start(SpiceZlibDecoder *d, uint8_t *dest);
+gsize zlib_decoder_stream_read(SpiceZlibDecoder *d, uint8_t *buf, gsize size);
 
 SpiceJpegDecoder *jpeg_decoder_new(void);
 void jpeg_decoder_destroy(SpiceJpegDecoder *d);
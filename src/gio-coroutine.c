@@ -24,12 +24,21 @@
 
 typedef struct _GConditionWaitSource
 {
+    GSource src; /* must be first */
     GCoroutine *self;
-    GSource src;
     GConditionWaitFunc func;
     gpointer data;
+    /* with a wait queue, only check the condition once woken up */
+    gboolean queued;
+    gboolean woken;
+    guint64 key;
 } GConditionWaitSource;
 
+struct _GCoroutineWaitQueue
+{
+    GSList *sources;
+};
+
 GCoroutine* g_coroutine_self(void)
 {
     return (GCoroutine*)coroutine_self();
@@ -99,6 +108,11 @@ static gboolean g_condition_wait_prepare(GSource *src,
 					 int *timeout) {
     GConditionWaitSource *vsrc = (GConditionWaitSource *)src;
     *timeout = -1;
+    if (vsrc->queued) {
+        if (!vsrc->woken)
+            return FALSE;
+        vsrc->woken = FALSE;
+    }
     return vsrc->func(vsrc->data);
 }
 
@@ -109,6 +123,11 @@ static gboolean g_condition_wait_prepare(GSource *src,
 static gboolean g_condition_wait_check(GSource *src)
 {
     GConditionWaitSource *vsrc = (GConditionWaitSource *)src;
+    if (vsrc->queued) {
+        if (!vsrc->woken)
+            return FALSE;
+        vsrc->woken = FALSE;
+    }
     return vsrc->func(vsrc->data);
 }
 
@@ -182,6 +201,111 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     return TRUE;
 }
 
+GCoroutineWaitQueue* g_coroutine_wait_queue_new(void)
+{
+    return g_new0(GCoroutineWaitQueue, 1);
+}
+
+void g_coroutine_wait_queue_free(GCoroutineWaitQueue *queue)
+{
+    if (queue == NULL)
+        return;
+
+    g_slist_free_full(queue->sources, (GDestroyNotify)g_source_unref);
+    g_free(queue);
+}
+
+/*
+ * g_coroutine_wait_queue_wait:
+ * @queue: the wait queue to register on
+ * @key: what the caller is waiting for
+ * @coroutine: the coroutine to wait on
+ * @func: the condition callback
+ * @data: the user data passed to @func callback
+ *
+ * Like g_coroutine_condition_wait(), but @func is only checked again
+ * once g_coroutine_wait_queue_wake() is called for @key, instead of on
+ * every main loop iteration.
+ *
+ * Returns: %TRUE if condition reached, %FALSE if not and cancelled
+ */
+gboolean g_coroutine_wait_queue_wait(GCoroutineWaitQueue *queue, guint64 key,
+                                     GCoroutine *self,
+                                     GConditionWaitFunc func, gpointer data)
+{
+    GSource *src;
+    GConditionWaitSource *vsrc;
+    gboolean ret = TRUE;
+
+    g_return_val_if_fail(queue != NULL, FALSE);
+    g_return_val_if_fail(self != NULL, FALSE);
+    g_return_val_if_fail(self->condition_id == 0, FALSE);
+    g_return_val_if_fail(func != NULL, FALSE);
+
+    if (func(data))
+        return TRUE;
+
+    src = g_source_new(&waitFuncs, sizeof(GConditionWaitSource));
+    vsrc = (GConditionWaitSource *)src;
+
+    vsrc->func = func;
+    vsrc->data = data;
+    vsrc->self = self;
+    vsrc->queued = TRUE;
+    vsrc->key = key;
+
+    queue->sources = g_slist_prepend(queue->sources, g_source_ref(src));
+    self->condition_id = g_source_attach(src, NULL);
+    g_source_set_callback(src, g_condition_wait_helper, self, NULL);
+    coroutine_yield(NULL);
+
+    /* it got woked up / cancelled? */
+    if (self->condition_id == 0)
+        ret = func(data);
+    self->condition_id = 0;
+
+    queue->sources = g_slist_remove(queue->sources, src);
+    g_source_unref(src);
+    g_source_unref(src);
+
+    return ret;
+}
+
+/*
+ * g_coroutine_wait_queue_wake:
+ * @queue: the wait queue
+ * @key: what became available
+ *
+ * Wakes up the coroutines waiting on @queue for @key, their condition
+ * is checked on the next main loop iteration.
+ */
+void g_coroutine_wait_queue_wake(GCoroutineWaitQueue *queue, guint64 key)
+{
+    GSList *l, *next;
+    gboolean woken = FALSE;
+
+    g_return_if_fail(queue != NULL);
+
+    for (l = queue->sources; l != NULL; l = next) {
+        GConditionWaitSource *vsrc = l->data;
+
+        next = l->next;
+        if (g_source_is_destroyed(&vsrc->src)) {
+            /* the wait was cancelled and never resumed */
+            queue->sources = g_slist_delete_link(queue->sources, l);
+            g_source_unref(&vsrc->src);
+            continue;
+        }
+        if (vsrc->key == key) {
+            vsrc->woken = TRUE;
+            woken = TRUE;
+        }
+    }
+
+    if (woken)
+        g_main_context_wakeup(NULL);
+}
+
 struct signal_data
 {
     gpointer instance;
@@ -46,6 +46,13 @@ struct _GCoroutine
  */
 typedef gboolean (*GConditionWaitFunc)(gpointer);
 
+/*
+ * A set of coroutines waiting for keyed events, such as an image
+ * identified by its id being decoded. Unlike a plain condition wait,
+ * the condition is only checked when its key is woken up.
+ */
+typedef struct _GCoroutineWaitQueue GCoroutineWaitQueue;
+
 typedef void (*GSignalEmitMainFunc)(GObject *object, int signum, gpointer params);
 
 GCoroutine*  g_coroutine_self           (void);
@@ -56,6 +63,13 @@ gboolean     g_coroutine_condition_wait (GCoroutine *coroutine,
                                          GConditionWaitFunc func, gpointer data);
 void         g_coroutine_condition_cancel(GCoroutine *coroutine);
 
+GCoroutineWaitQueue* g_coroutine_wait_queue_new (void);
+void         g_coroutine_wait_queue_free(GCoroutineWaitQueue *queue);
+gboolean     g_coroutine_wait_queue_wait(GCoroutineWaitQueue *queue, guint64 key,
+                                         GCoroutine *coroutine,
+                                         GConditionWaitFunc func, gpointer data);
+void         g_coroutine_wait_queue_wake(GCoroutineWaitQueue *queue, guint64 key);
+
 void         g_coroutine_signal_emit (gpointer instance, guint signal_id,
                                       GQuark detail, ...);
 
@@ -0,0 +1,356 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <glib.h>
+
+#include "spice-util.h"
+#include "pixel-simd.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define PIXEL_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+/* ------------------------------------------------------------------ */
+/* scalar */
+
+static void fill32_c(uint32_t *dst, uint32_t value, size_t n)
+{
+    while (n-- > 0)
+        *dst++ = value;
+}
+
+static void rgb24_to_rgb32_c(uint32_t *dst, const uint8_t *src, size_t n)
+{
+    for (; n > 0; n--, src += 3)
+        *dst++ = src[0] | (src[1] << 8) | ((uint32_t)src[2] << 16);
+}
+
+/* the top bit of 555 is ignored */
+static inline uint32_t rgb555_to_rgb32_pixel(uint32_t v)
+{
+    uint32_t r = (v >> 10) & 0x1f, g = (v >> 5) & 0x1f, b = v & 0x1f;
+
+    r = (r << 3) | (r >> 2);
+    g = (g << 3) | (g >> 2);
+    b = (b << 3) | (b >> 2);
+    return b | (g << 8) | (r << 16);
+}
+
+static inline uint32_t rgb565_to_rgb32_pixel(uint32_t v)
+{
+    uint32_t r = (v >> 11) & 0x1f, g = (v >> 5) & 0x3f, b = v & 0x1f;
+
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+    return b | (g << 8) | (r << 16);
+}
+
+static void rgb555_be_to_rgb32_c(uint32_t *dst, const uint8_t *src, size_t n)
+{
+    for (; n > 0; n--, src += 2)
+        *dst++ = rgb555_to_rgb32_pixel((src[0] << 8) | src[1]);
+}
+
+static void rgb555_to_rgb32_c(uint32_t *dst, const uint16_t *src, size_t n)
+{
+    for (; n > 0; n--)
+        *dst++ = rgb555_to_rgb32_pixel(*src++);
+}
+
+static void rgb565_to_rgb32_c(uint32_t *dst, const uint16_t *src, size_t n)
+{
+    for (; n > 0; n--)
+        *dst++ = rgb565_to_rgb32_pixel(*src++);
+}
+
+#ifdef PIXEL_SIMD_X86
+/* ------------------------------------------------------------------ */
+/* SSE2 */
+
+/* The 16 bits pixels are split in components extended to 8 bits in 16
+ * bits lanes, then b | g << 8 and r are interleaved into the 32 bits
+ * pixels. */
+
+__attribute__((target("sse2")))
+static void fill32_sse2(uint32_t *dst, uint32_t value, size_t n)
+{
+    __m128i v = _mm_set1_epi32(value);
+
+    for (; n >= 4; n -= 4, dst += 4)
+        _mm_storeu_si128((__m128i *)dst, v);
+    fill32_c(dst, value, n);
+}
+
+__attribute__((target("sse2")))
+static inline void store_rgb32_sse2(uint32_t *dst, __m128i r, __m128i g, __m128i b)
+{
+    __m128i lo = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi16(lo, r));
+    _mm_storeu_si128((__m128i *)(dst + 4), _mm_unpackhi_epi16(lo, r));
+}
+
+/* 8 native endian 555 pixels of @v */
+__attribute__((target("sse2")))
+static inline void rgb555_to_rgb32_8_sse2(uint32_t *dst, __m128i v)
+{
+    const __m128i mask = _mm_set1_epi16(0x1f);
+    __m128i r = _mm_and_si128(_mm_srli_epi16(v, 10), mask);
+    __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask);
+    __m128i b = _mm_and_si128(v, mask);
+
+    r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+    g = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
+    b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+    store_rgb32_sse2(dst, r, g, b);
+}
+
+__attribute__((target("sse2")))
+static void rgb555_be_to_rgb32_sse2(uint32_t *dst, const uint8_t *src, size_t n)
+{
+    for (; n >= 8; n -= 8, dst += 8, src += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        rgb555_to_rgb32_8_sse2(dst, v);
+    }
+    rgb555_be_to_rgb32_c(dst, src, n);
+}
+
+__attribute__((target("sse2")))
+static void rgb555_to_rgb32_sse2(uint32_t *dst, const uint16_t *src, size_t n)
+{
+    for (; n >= 8; n -= 8, dst += 8, src += 8)
+        rgb555_to_rgb32_8_sse2(dst, _mm_loadu_si128((const __m128i *)src));
+    rgb555_to_rgb32_c(dst, src, n);
+}
+
+__attribute__((target("sse2")))
+static void rgb565_to_rgb32_sse2(uint32_t *dst, const uint16_t *src, size_t n)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    const __m128i mask6 = _mm_set1_epi16(0x3f);
+
+    for (; n >= 8; n -= 8, dst += 8, src += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        __m128i r = _mm_srli_epi16(v, 11);
+        __m128i g = _mm_and_si128(_mm_srli_epi16(v, 5), mask6);
+        __m128i b = _mm_and_si128(v, mask5);
+
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        store_rgb32_sse2(dst, r, g, b);
+    }
+    rgb565_to_rgb32_c(dst, src, n);
+}
+
+/* ------------------------------------------------------------------ */
+/* SSSE3 */
+
+/* a 16 bytes load of 4 pixels reads 4 bytes ahead, so the vector loops
+ * stop while 2 pixels are left, to never read past the literal run */
+#define RGB24_SHUFFLE \
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1
+
+__attribute__((target("ssse3")))
+static void rgb24_to_rgb32_ssse3(uint32_t *dst, const uint8_t *src, size_t n)
+{
+    const __m128i shuffle = _mm_setr_epi8(RGB24_SHUFFLE);
+
+    for (; n >= 6; n -= 4, dst += 4, src += 12) {
+        __m128i v = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dst, _mm_shuffle_epi8(v, shuffle));
+    }
+    rgb24_to_rgb32_c(dst, src, n);
+}
+
+/* ------------------------------------------------------------------ */
+/* AVX2 */
+
+__attribute__((target("avx2")))
+static void fill32_avx2(uint32_t *dst, uint32_t value, size_t n)
+{
+    __m256i v = _mm256_set1_epi32(value);
+
+    for (; n >= 8; n -= 8, dst += 8)
+        _mm256_storeu_si256((__m256i *)dst, v);
+    fill32_c(dst, value, n);
+}
+
+__attribute__((target("avx2")))
+static void rgb24_to_rgb32_avx2(uint32_t *dst, const uint8_t *src, size_t n)
+{
+    const __m256i shuffle = _mm256_setr_epi8(RGB24_SHUFFLE, RGB24_SHUFFLE);
+
+    for (; n >= 10; n -= 8, dst += 8, src += 24) {
+        __m256i v = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src));
+        v = _mm256_inserti128_si256(v, _mm_loadu_si128((const __m128i *)(src + 12)), 1);
+        _mm256_storeu_si256((__m256i *)dst, _mm256_shuffle_epi8(v, shuffle));
+    }
+    rgb24_to_rgb32_ssse3(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static inline void store_rgb32_avx2(uint32_t *dst, __m256i r, __m256i g, __m256i b)
+{
+    __m256i lo = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+    /* the unpacks work per 128 bits lane, put the pixels back in order */
+    __m256i p0 = _mm256_unpacklo_epi16(lo, r);
+    __m256i p1 = _mm256_unpackhi_epi16(lo, r);
+
+    _mm256_storeu_si256((__m256i *)dst, _mm256_permute2x128_si256(p0, p1, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + 8), _mm256_permute2x128_si256(p0, p1, 0x31));
+}
+
+/* 16 native endian 555 pixels of @v */
+__attribute__((target("avx2")))
+static inline void rgb555_to_rgb32_16_avx2(uint32_t *dst, __m256i v)
+{
+    const __m256i mask = _mm256_set1_epi16(0x1f);
+    __m256i r = _mm256_and_si256(_mm256_srli_epi16(v, 10), mask);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi16(v, 5), mask);
+    __m256i b = _mm256_and_si256(v, mask);
+
+    r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+    g = _mm256_or_si256(_mm256_slli_epi16(g, 3), _mm256_srli_epi16(g, 2));
+    b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+    store_rgb32_avx2(dst, r, g, b);
+}
+
+__attribute__((target("avx2")))
+static void rgb555_be_to_rgb32_avx2(uint32_t *dst, const uint8_t *src, size_t n)
+{
+    for (; n >= 16; n -= 16, dst += 16, src += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+
+        v = _mm256_or_si256(_mm256_slli_epi16(v, 8), _mm256_srli_epi16(v, 8));
+        rgb555_to_rgb32_16_avx2(dst, v);
+    }
+    rgb555_be_to_rgb32_sse2(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void rgb555_to_rgb32_avx2(uint32_t *dst, const uint16_t *src, size_t n)
+{
+    for (; n >= 16; n -= 16, dst += 16, src += 16)
+        rgb555_to_rgb32_16_avx2(dst, _mm256_loadu_si256((const __m256i *)src));
+    rgb555_to_rgb32_sse2(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void rgb565_to_rgb32_avx2(uint32_t *dst, const uint16_t *src, size_t n)
+{
+    const __m256i mask5 = _mm256_set1_epi16(0x1f);
+    const __m256i mask6 = _mm256_set1_epi16(0x3f);
+
+    for (; n >= 16; n -= 16, dst += 16, src += 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)src);
+        __m256i r = _mm256_srli_epi16(v, 11);
+        __m256i g = _mm256_and_si256(_mm256_srli_epi16(v, 5), mask6);
+        __m256i b = _mm256_and_si256(v, mask5);
+
+        r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+        g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+        b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+        store_rgb32_avx2(dst, r, g, b);
+    }
+    rgb565_to_rgb32_sse2(dst, src, n);
+}
+#endif /* PIXEL_SIMD_X86 */
+
+/* ------------------------------------------------------------------ */
+
+G_GNUC_INTERNAL void (*pixel_fill32)(uint32_t *dst, uint32_t value, size_t n) = fill32_c;
+G_GNUC_INTERNAL void (*pixel_rgb24_to_rgb32)(uint32_t *dst, const uint8_t *src, size_t n) = rgb24_to_rgb32_c;
+G_GNUC_INTERNAL void (*pixel_rgb555_be_to_rgb32)(uint32_t *dst, const uint8_t *src, size_t n) = rgb555_be_to_rgb32_c;
+G_GNUC_INTERNAL void (*pixel_rgb555_to_rgb32)(uint32_t *dst, const uint16_t *src, size_t n) = rgb555_to_rgb32_c;
+G_GNUC_INTERNAL void (*pixel_rgb565_to_rgb32)(uint32_t *dst, const uint16_t *src, size_t n) = rgb565_to_rgb32_c;
+
+G_GNUC_INTERNAL
+PixelSimdLevel pixel_simd_detect(void)
+{
+#ifdef PIXEL_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return PIXEL_SIMD_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+        return PIXEL_SIMD_SSSE3;
+    if (__builtin_cpu_supports("sse2"))
+        return PIXEL_SIMD_SSE2;
+#endif
+    return PIXEL_SIMD_NONE;
+}
+
+/* Selects the kernels of @level, returns FALSE if the CPU can't run them. */
+G_GNUC_INTERNAL
+gboolean pixel_simd_init(PixelSimdLevel level)
+{
+    if (level > pixel_simd_detect())
+        return FALSE;
+
+    pixel_fill32 = fill32_c;
+    pixel_rgb24_to_rgb32 = rgb24_to_rgb32_c;
+    pixel_rgb555_be_to_rgb32 = rgb555_be_to_rgb32_c;
+    pixel_rgb555_to_rgb32 = rgb555_to_rgb32_c;
+    pixel_rgb565_to_rgb32 = rgb565_to_rgb32_c;
+
+#ifdef PIXEL_SIMD_X86
+    switch (level) {
+    case PIXEL_SIMD_AVX2:
+        pixel_fill32 = fill32_avx2;
+        pixel_rgb24_to_rgb32 = rgb24_to_rgb32_avx2;
+        pixel_rgb555_be_to_rgb32 = rgb555_be_to_rgb32_avx2;
+        pixel_rgb555_to_rgb32 = rgb555_to_rgb32_avx2;
+        pixel_rgb565_to_rgb32 = rgb565_to_rgb32_avx2;
+        break;
+    case PIXEL_SIMD_SSSE3:
+        pixel_rgb24_to_rgb32 = rgb24_to_rgb32_ssse3;
+        /* fall through */
+    case PIXEL_SIMD_SSE2:
+        pixel_fill32 = fill32_sse2;
+        pixel_rgb555_be_to_rgb32 = rgb555_be_to_rgb32_sse2;
+        pixel_rgb555_to_rgb32 = rgb555_to_rgb32_sse2;
+        pixel_rgb565_to_rgb32 = rgb565_to_rgb32_sse2;
+        break;
+    default:
+        break;
+    }
+#endif
+
+    SPICE_DEBUG("pixel: using SIMD level %d", level);
+    return TRUE;
+}
+
+/* Selects the best kernels once, unless SPICE_DISABLE_PIXEL_SIMD is set.
+ * This file is built in both libraries, each one must call it. */
+G_GNUC_INTERNAL
+void pixel_simd_setup(void)
+{
+    static gsize once = 0;
+
+    if (g_once_init_enter(&once)) {
+        if (!g_getenv("SPICE_DISABLE_PIXEL_SIMD"))
+            pixel_simd_init(pixel_simd_detect());
+        g_once_init_leave(&once, 1);
+    }
+}
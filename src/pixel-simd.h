@@ -0,0 +1,81 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef SPICEGTK_PIXEL_SIMD_H_
+#define SPICEGTK_PIXEL_SIMD_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Pixel kernels producing 32 bits xRGB pixels, shared by the GLZ
+ * decoder and the widget. The implementation is picked at runtime
+ * after the CPU features. */
+
+typedef enum {
+    PIXEL_SIMD_NONE,
+    PIXEL_SIMD_SSE2,
+    PIXEL_SIMD_SSSE3,
+    PIXEL_SIMD_AVX2,
+} PixelSimdLevel;
+
+PixelSimdLevel pixel_simd_detect(void);
+gboolean pixel_simd_init(PixelSimdLevel level);
+void pixel_simd_setup(void);
+
+/* sets @n pixels to @value */
+extern void (*pixel_fill32)(uint32_t *dst, uint32_t value, size_t n);
+/* expands @n packed b, g, r pixels */
+extern void (*pixel_rgb24_to_rgb32)(uint32_t *dst, const uint8_t *src, size_t n);
+/* expands @n big endian 555 pixels, as found in the GLZ images */
+extern void (*pixel_rgb555_be_to_rgb32)(uint32_t *dst, const uint8_t *src, size_t n);
+/* expands @n native endian 555 pixels, as found in the 16 bits surfaces */
+extern void (*pixel_rgb555_to_rgb32)(uint32_t *dst, const uint16_t *src, size_t n);
+/* expands @n native endian 565 pixels */
+extern void (*pixel_rgb565_to_rgb32)(uint32_t *dst, const uint16_t *src, size_t n);
+
+/* copies @n pixels one after the other, @src may overlap the start
+ * of @dst to repeat a pattern */
+static inline void pixel_copy32(uint32_t *dst, const uint32_t *src, size_t n)
+{
+    size_t dist = ((uintptr_t)dst - (uintptr_t)src) / sizeof(uint32_t);
+
+    if (dist == 1) {
+        pixel_fill32(dst, *src, n);
+        return;
+    }
+    if (dist >= n) {
+        memcpy(dst, src, n * sizeof(uint32_t));
+        return;
+    }
+
+    /* the pattern doubles after each copy */
+    while (n > 0) {
+        size_t len = MIN(dist, n);
+
+        memcpy(dst, src, len * sizeof(uint32_t));
+        dst += len;
+        n -= len;
+        dist += len;
+    }
+}
+
+G_END_DECLS
+
+#endif // SPICEGTK_PIXEL_SIMD_H_
@@ -0,0 +1,118 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <glib/gstdio.h>
+
+#include "spice-client.h"
+#include "spice-capture.h"
+
+struct SpiceCapture {
+    FILE    *file;
+    gchar   *filename;
+    gboolean failed;
+};
+
+/* big enough for the messages headers and most of the small messages */
+#define CAPTURE_BUFFER_SIZE (256 * 1024)
+
+static gboolean capture_write(SpiceCapture *capture, const void *data, gsize size)
+{
+    if (capture->failed)
+        return FALSE;
+
+    if (size > 0 && fwrite(data, size, 1, capture->file) != 1) {
+        g_warning("failed to write capture %s: %s",
+                  capture->filename, g_strerror(errno));
+        capture->failed = TRUE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* coroutine context */
+G_GNUC_INTERNAL
+SpiceCapture *spice_capture_new(const gchar *dir, gint channel_type, gint channel_id,
+                                const void *link, gsize link_size, GError **error)
+{
+    SpiceCapture *capture = g_new0(SpiceCapture, 1);
+    SpiceCaptureHeader header = {
+        .version = GUINT32_TO_LE(SPICE_CAPTURE_VERSION),
+        .channel_type = GUINT32_TO_LE(channel_type),
+        .channel_id = GUINT32_TO_LE(channel_id),
+        .link_size = GUINT32_TO_LE(link_size),
+    };
+    gchar *basename;
+
+    memcpy(header.magic, SPICE_CAPTURE_MAGIC, sizeof(header.magic));
+    basename = g_strdup_printf("%s-%d" SPICE_CAPTURE_SUFFIX,
+                               spice_channel_type_to_string(channel_type), channel_id);
+    capture->filename = g_build_filename(dir, basename, NULL);
+    g_free(basename);
+
+    capture->file = g_fopen(capture->filename, "wb");
+    if (capture->file == NULL) {
+        int err = errno;
+
+        g_set_error(error, G_FILE_ERROR, g_file_error_from_errno(err),
+                    "failed to open capture %s: %s", capture->filename, g_strerror(err));
+        g_free(capture->filename);
+        g_free(capture);
+        return NULL;
+    }
+    setvbuf(capture->file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+    capture_write(capture, &header, sizeof(header));
+    capture_write(capture, link, link_size);
+    SPICE_DEBUG("capturing %s", capture->filename);
+
+    return capture;
+}
+
+/* coroutine context */
+G_GNUC_INTERNAL
+void spice_capture_msg(SpiceCapture *capture,
+                       const guint8 *header, gsize header_size,
+                       const guint8 *data, gsize data_size)
+{
+    SpiceCaptureRecord record = {
+        .time = GUINT64_TO_LE(g_get_monotonic_time()),
+        .size = GUINT32_TO_LE(header_size + data_size),
+    };
+
+    if (capture_write(capture, &record, sizeof(record)) &&
+        capture_write(capture, header, header_size))
+        capture_write(capture, data, data_size);
+}
+
+G_GNUC_INTERNAL
+void spice_capture_free(SpiceCapture *capture)
+{
+    if (capture == NULL)
+        return;
+
+    if (fclose(capture->file) != 0 && !capture->failed)
+        g_warning("failed to write capture %s: %s",
+                  capture->filename, g_strerror(errno));
+    g_free(capture->filename);
+    g_free(capture);
+}
@@ -0,0 +1,69 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_CAPTURE_H__
+#define __SPICE_CAPTURE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * A channel capture file holds the messages received by a channel, so
+ * that they can be replayed without a server (see spicy-replay).
+ *
+ * All the integers are little endian. The file starts with a
+ * SpiceCaptureHeader, followed by the link header and the link reply
+ * of the server, as received. Then each message is a
+ * SpiceCaptureRecord followed by the message header and data, as
+ * received.
+ */
+
+#define SPICE_CAPTURE_MAGIC "SPICECAP"
+#define SPICE_CAPTURE_VERSION 1
+#define SPICE_CAPTURE_SUFFIX ".spicecap"
+
+typedef struct SpiceCaptureHeader {
+    gchar   magic[8];
+    guint32 version;
+    guint32 channel_type;
+    guint32 channel_id;
+    /* size of the link header and reply that follow */
+    guint32 link_size;
+} SpiceCaptureHeader;
+
+typedef struct SpiceCaptureRecord {
+    /* arrival time, in microseconds of the monotonic clock, only
+     * comparable between the captures of a session */
+    guint64 time;
+    /* size of the message header and data that follow */
+    guint32 size;
+    guint32 reserved;
+} SpiceCaptureRecord;
+
+typedef struct SpiceCapture SpiceCapture;
+
+SpiceCapture *spice_capture_new(const gchar *dir, gint channel_type, gint channel_id,
+                                const void *link, gsize link_size, GError **error);
+void spice_capture_msg(SpiceCapture *capture,
+                       const guint8 *header, gsize header_size,
+                       const guint8 *data, gsize data_size);
+void spice_capture_free(SpiceCapture *capture);
+
+G_END_DECLS
+
+#endif /* __SPICE_CAPTURE_H__ */
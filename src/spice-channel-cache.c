@@ -0,0 +1,341 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <glib.h>
+#include <string.h>
+
+#include "spice-channel-cache.h"
+
+#define CACHE_SLOTS_MIN 64
+
+static inline guint32 cache_hash(guint64 id)
+{
+    /* the server ids are mostly sequential, mix all the bits in */
+    id ^= id >> 33;
+    id *= G_GUINT64_CONSTANT(0xff51afd7ed558ccd);
+    id ^= id >> 33;
+    return (guint32)id;
+}
+
+static guint32 cache_lookup(display_cache *cache, guint64 id)
+{
+    guint32 mask = cache->n_slots - 1;
+    guint32 i = cache_hash(id) & mask;
+
+    while (cache->slots[i].used) {
+        if (cache->slots[i].id == id)
+            return i;
+        i = (i + 1) & mask;
+    }
+
+    return CACHE_SLOT_NONE;
+}
+
+static void lru_link(display_cache *cache, guint32 i)
+{
+    display_cache_item *item = &cache->slots[i];
+
+    item->lru_prev = CACHE_SLOT_NONE;
+    item->lru_next = cache->lru_head;
+    if (cache->lru_head != CACHE_SLOT_NONE)
+        cache->slots[cache->lru_head].lru_prev = i;
+    else
+        cache->lru_tail = i;
+    cache->lru_head = i;
+}
+
+static void lru_unlink(display_cache *cache, guint32 i)
+{
+    display_cache_item *item = &cache->slots[i];
+
+    if (item->lru_prev != CACHE_SLOT_NONE)
+        cache->slots[item->lru_prev].lru_next = item->lru_next;
+    else
+        cache->lru_head = item->lru_next;
+    if (item->lru_next != CACHE_SLOT_NONE)
+        cache->slots[item->lru_next].lru_prev = item->lru_prev;
+    else
+        cache->lru_tail = item->lru_prev;
+}
+
+/* point the neighbours of an item moved to slot @i back at it */
+static void lru_relink(display_cache *cache, guint32 i)
+{
+    display_cache_item *item = &cache->slots[i];
+
+    if (item->lru_prev != CACHE_SLOT_NONE)
+        cache->slots[item->lru_prev].lru_next = i;
+    else
+        cache->lru_head = i;
+    if (item->lru_next != CACHE_SLOT_NONE)
+        cache->slots[item->lru_next].lru_prev = i;
+    else
+        cache->lru_tail = i;
+}
+
+static guint32 cache_insert_slot(display_cache *cache, guint64 id)
+{
+    guint32 mask = cache->n_slots - 1;
+    guint32 i = cache_hash(id) & mask;
+
+    while (cache->slots[i].used)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+static void cache_resize(display_cache *cache, guint32 n_slots)
+{
+    display_cache_item *old_slots = cache->slots;
+    guint32 old = cache->lru_tail;
+
+    cache->slots = g_new0(display_cache_item, n_slots);
+    cache->n_slots = n_slots;
+    cache->lru_head = cache->lru_tail = CACHE_SLOT_NONE;
+
+    /* reinsert from the least recently used to keep the order */
+    while (old != CACHE_SLOT_NONE) {
+        guint32 i = cache_insert_slot(cache, old_slots[old].id);
+
+        cache->slots[i] = old_slots[old];
+        lru_link(cache, i);
+        old = old_slots[old].lru_prev;
+    }
+
+    g_free(old_slots);
+}
+
+/* returns the value of the removed item, to be destroyed by the caller */
+static gpointer cache_remove_slot(display_cache *cache, guint32 i)
+{
+    guint32 mask = cache->n_slots - 1;
+    gpointer value = cache->slots[i].value;
+    guint32 j = i;
+
+    lru_unlink(cache, i);
+    cache->size -= cache->slots[i].size;
+    cache->bytes -= cache->slots[i].bytes;
+    cache->n_items--;
+    memset(&cache->slots[i], 0, sizeof(display_cache_item));
+
+    /* backward shift the following items of the cluster, so lookups
+     * never need tombstones */
+    for (;;) {
+        guint32 home;
+
+        j = (j + 1) & mask;
+        if (!cache->slots[j].used)
+            break;
+
+        home = cache_hash(cache->slots[j].id) & mask;
+        if (i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        cache->slots[i] = cache->slots[j];
+        lru_relink(cache, i);
+        memset(&cache->slots[j], 0, sizeof(display_cache_item));
+        i = j;
+    }
+
+    return value;
+}
+
+static void cache_value_destroy(display_cache *cache, gpointer value)
+{
+    if (cache->value_destroy)
+        cache->value_destroy(value);
+}
+
+G_GNUC_INTERNAL
+display_cache* cache_new(GDestroyNotify value_destroy)
+{
+    display_cache *self = g_slice_new0(display_cache);
+
+    self->slots = g_new0(display_cache_item, CACHE_SLOTS_MIN);
+    self->n_slots = CACHE_SLOTS_MIN;
+    self->lru_head = self->lru_tail = CACHE_SLOT_NONE;
+    self->value_destroy = value_destroy;
+    self->ref_counted = FALSE;
+    return self;
+}
+
+G_GNUC_INTERNAL
+display_cache* cache_image_new(GDestroyNotify value_destroy,
+                               display_cache_size_func size_func)
+{
+    display_cache *self = cache_new(value_destroy);
+
+    self->ref_counted = TRUE;
+    self->size_func = size_func;
+    self->waiters = g_coroutine_wait_queue_new();
+    return self;
+}
+
+/* Items are evicted, least recently used first, once their sizes add
+ * up to more than @max_size, in the units of the size function. 0 means
+ * no limit. */
+G_GNUC_INTERNAL
+void cache_set_max_size(display_cache *cache, gsize max_size)
+{
+    cache->max_size = max_size;
+    if (max_size != 0 && cache->evicted == NULL)
+        cache->evicted = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                               g_free, NULL);
+}
+
+G_GNUC_INTERNAL
+gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
+{
+    guint32 i = cache_lookup(cache, id);
+
+    if (i == CACHE_SLOT_NONE)
+        return NULL;
+
+    if (cache->lru_head != i) {
+        lru_unlink(cache, i);
+        lru_link(cache, i);
+    }
+    if (lossy)
+        *lossy = cache->slots[i].lossy;
+
+    return cache->slots[i].value;
+}
+
+/* whether @id was dropped by the client while the server may still use it */
+G_GNUC_INTERNAL
+gboolean cache_is_evicted(display_cache *cache, uint64_t id)
+{
+    return cache->evicted != NULL &&
+        g_hash_table_lookup_extended(cache->evicted, &id, NULL, NULL);
+}
+
+static void cache_evict(display_cache *cache, guint64 keep)
+{
+    while (cache->max_size != 0 && cache->size > cache->max_size &&
+           cache->lru_tail != CACHE_SLOT_NONE) {
+        guint64 id = cache->slots[cache->lru_tail].id;
+
+        if (id == keep)
+            break;
+
+        g_hash_table_insert(cache->evicted, g_memdup(&id, sizeof(id)), NULL);
+        cache->evictions++;
+        cache_value_destroy(cache, cache_remove_slot(cache, cache->lru_tail));
+    }
+}
+
+G_GNUC_INTERNAL
+void cache_add_lossy(display_cache *cache, uint64_t id,
+                     gpointer value, gboolean lossy)
+{
+    gsize bytes = 0;
+    gsize size = cache->size_func ? cache->size_func(value, &bytes) : 0;
+    guint32 i = cache_lookup(cache, id);
+    gpointer old_value = NULL;
+    display_cache_item *item;
+
+    if (i != CACHE_SLOT_NONE) {
+        item = &cache->slots[i];
+        old_value = item->value;
+        //If image is currently in the table add its reference count before replacing it
+        item->ref_count = cache->ref_counted ? item->ref_count + 1 : 1;
+        cache->size -= item->size;
+        cache->bytes -= item->bytes;
+        lru_unlink(cache, i);
+    } else {
+        if ((cache->n_items + 1) * 4 > cache->n_slots * 3)
+            cache_resize(cache, cache->n_slots * 2);
+        i = cache_insert_slot(cache, id);
+        item = &cache->slots[i];
+        item->id = id;
+        item->used = TRUE;
+        item->ref_count = 1;
+        cache->n_items++;
+    }
+
+    item->value = value;
+    item->lossy = lossy;
+    item->size = size;
+    item->bytes = bytes;
+    cache->size += size;
+    cache->bytes += bytes;
+    lru_link(cache, i);
+
+    if (old_value)
+        cache_value_destroy(cache, old_value);
+
+    if (cache->waiters != NULL)
+        g_coroutine_wait_queue_wake(cache->waiters, id);
+
+    if (cache->evicted != NULL) {
+        g_hash_table_remove(cache->evicted, &id);
+        cache_evict(cache, id);
+    }
+}
+
+G_GNUC_INTERNAL
+gboolean cache_remove(display_cache *cache, uint64_t id)
+{
+    guint32 i = cache_lookup(cache, id);
+
+    if (i == CACHE_SLOT_NONE) {
+        /* the server is done with an item we already evicted */
+        return cache->evicted != NULL && g_hash_table_remove(cache->evicted, &id);
+    }
+
+    --cache->slots[i].ref_count;
+    if (!cache->ref_counted || cache->slots[i].ref_count == 0)
+        cache_value_destroy(cache, cache_remove_slot(cache, i));
+
+    return TRUE;
+}
+
+G_GNUC_INTERNAL
+void cache_clear(display_cache *cache)
+{
+    display_cache_item *slots = cache->slots;
+    guint32 i, n_slots = cache->n_slots;
+
+    /* destroy the values once the cache is consistent again */
+    cache->slots = g_new0(display_cache_item, CACHE_SLOTS_MIN);
+    cache->n_slots = CACHE_SLOTS_MIN;
+    cache->n_items = 0;
+    cache->lru_head = cache->lru_tail = CACHE_SLOT_NONE;
+    cache->size = 0;
+    cache->bytes = 0;
+    if (cache->evicted != NULL)
+        g_hash_table_remove_all(cache->evicted);
+
+    for (i = 0; i < n_slots; i++) {
+        if (slots[i].used)
+            cache_value_destroy(cache, slots[i].value);
+    }
+    g_free(slots);
+}
+
+G_GNUC_INTERNAL
+void cache_unref(display_cache *cache)
+{
+    cache_clear(cache);
+    g_free(cache->slots);
+    if (cache->evicted != NULL)
+        g_hash_table_unref(cache->evicted);
+    g_coroutine_wait_queue_free(cache->waiters);
+    g_slice_free(display_cache, cache);
+}
@@ -21,84 +21,70 @@
 #include <inttypes.h> /* For PRIx64 */
 #include "common/mem.h"
 #include "common/ring.h"
+#include "gio-coroutine.h"
 
 G_BEGIN_DECLS
 
+typedef struct display_cache display_cache;
+
+/* returns the size of @value counted against the max size, and stores
+ * its memory footprint in @bytes */
+typedef gsize (*display_cache_size_func)(gpointer value, gsize *bytes);
+
+#define CACHE_SLOT_NONE G_MAXUINT32
+
+/* Items are stored inline in an open addressing table keyed on the
+ * 64-bit id, and chained in least recently used order by slot index. */
 typedef struct display_cache_item {
     guint64                     id;
-    gboolean                    lossy;
+    gpointer                    value;
+    gsize                       size;
+    gsize                       bytes;
     guint32                     ref_count;
+    guint32                     lru_prev; /* more recently used */
+    guint32                     lru_next; /* less recently used */
+    guint8                      used;
+    guint8                      lossy;
 } display_cache_item;
 
-typedef struct display_cache {
-    GHashTable  *table;
-    gboolean    ref_counted;
-}display_cache;
-
-static inline display_cache_item* cache_item_new(guint64 id, gboolean lossy)
-{
-    display_cache_item *self = g_slice_new(display_cache_item);
-    self->id = id;
-    self->lossy = lossy;
-    self->ref_count = 1;
-    return self;
-}
-
-static inline void cache_item_free(display_cache_item *self)
-{
-    g_slice_free(display_cache_item, self);
-}
-
-static inline display_cache* cache_new(GDestroyNotify value_destroy)
-{
-    display_cache * self = g_slice_new(display_cache);
-    self->table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-                                       (GDestroyNotify) cache_item_free,
-                                       value_destroy);
-    self->ref_counted = FALSE;
-    return self;
-}
-
-static inline display_cache * cache_image_new(GDestroyNotify value_destroy)
-{
-    display_cache * self = cache_new(value_destroy);
-    self->ref_counted = TRUE;
-    return self;
+struct display_cache {
+    display_cache_item          *slots;
+    guint32                     n_slots; /* power of 2 */
+    guint32                     n_items;
+    guint32                     lru_head;
+    guint32                     lru_tail;
+    GDestroyNotify              value_destroy;
+    gboolean                    ref_counted;
+
+    display_cache_size_func     size_func;
+    gsize                       size;
+    gsize                       max_size;
+    gsize                       bytes;
+    /* ids evicted by the client the server may still refer to */
+    GHashTable                  *evicted;
+    /* coroutines waiting for an id to be added */
+    GCoroutineWaitQueue         *waiters;
+
+    guint64                     hits;
+    guint64                     misses;
+    guint64                     evictions;
 };
 
-static inline gpointer cache_find(display_cache *cache, uint64_t id)
-{
-    return g_hash_table_lookup(cache->table, &id);
-}
-
-static inline gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
-{
-    gpointer value;
-    display_cache_item *item;
-
-    if (!g_hash_table_lookup_extended(cache->table, &id, (gpointer*)&item, &value))
-        return NULL;
-
-    *lossy = item->lossy;
-
-    return value;
-}
+display_cache* cache_new(GDestroyNotify value_destroy);
+display_cache* cache_image_new(GDestroyNotify value_destroy,
+                               display_cache_size_func size_func);
+void cache_set_max_size(display_cache *cache, gsize max_size);
+gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy);
+gboolean cache_is_evicted(display_cache *cache, uint64_t id);
+void cache_add_lossy(display_cache *cache, uint64_t id,
+                     gpointer value, gboolean lossy);
+gboolean cache_remove(display_cache *cache, uint64_t id);
+void cache_clear(display_cache *cache);
+void cache_unref(display_cache *cache);
 
-static inline void cache_add_lossy(display_cache *cache, uint64_t id,
-                                   gpointer value, gboolean lossy)
+static inline gpointer cache_find(display_cache *cache, uint64_t id)
 {
-    display_cache_item *item = cache_item_new(id, lossy);
-    display_cache_item *current_item;
-    gpointer            current_image;
-
-    //If image is currently in the table add its reference count before replacing it
-    if(cache->ref_counted) {
-        if(g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &current_item,
-                                        (gpointer*) &current_image)) {
-            item->ref_count = current_item->ref_count + 1;
-        }
-    }
-    g_hash_table_replace(cache->table, item, value);
+    return cache_find_lossy(cache, id, NULL);
 }
 
 static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
@@ -106,31 +92,12 @@ static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
     cache_add_lossy(cache, id, value, FALSE);
 }
 
-static inline gboolean cache_remove(display_cache *cache, uint64_t id)
-{
-    display_cache_item * item;
-    gpointer value;
-
-    if( g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &item, &value)) {
-        --item->ref_count;
-        if(!cache->ref_counted || item->ref_count == 0 ) {
-            return g_hash_table_remove(cache->table, &id);
-        }
-    }
-    else {
-        return FALSE;
-    }
-    return TRUE;
-}
-
-static inline void cache_clear(display_cache *cache)
-{
-    g_hash_table_remove_all(cache->table);
-}
-
-static inline void cache_unref(display_cache *cache)
+static inline void cache_account_lookup(display_cache *cache, gboolean hit)
 {
-    g_hash_table_unref(cache->table);
+    if (hit)
+        cache->hits++;
+    else
+        cache->misses++;
 }
 
 G_END_DECLS
@@ -32,6 +32,7 @@
 #include "spice-util-priv.h"
 #include "coroutine.h"
 #include "gio-coroutine.h"
+#include "spice-capture.h"
 
 #include "common/client_marshallers.h"
 #include "common/client_demarshallers.h"
@@ -63,8 +64,22 @@ struct _SpiceMsgIn {
     size_t                psize;
     message_destructor_t  pfree;
     SpiceMsgIn            *parent;
+    /* where data goes back to, it may outlive the channel */
+    struct spice_msg_in_pool *pool;
+    int                   buf_class;
 };
 
+/* recycled incoming message buffers, by power of two size classes
+ * from 256 bytes to 16 MiB */
+#define MSG_IN_BUF_CLASSES 17
+
+typedef struct spice_msg_in_pool {
+    guint                       refcount;
+    gpointer                    free_list[MSG_IN_BUF_CLASSES];
+    guint                       nfree[MSG_IN_BUF_CLASSES];
+    gsize                       cached_bytes;
+} spice_msg_in_pool;
+
 enum spice_channel_state {
     SPICE_CHANNEL_STATE_UNCONNECTED = 0,
     SPICE_CHANNEL_STATE_RECONNECTING,
@@ -96,6 +111,9 @@ struct _SpiceChannelPrivate {
     unsigned int                sasl_decoded_length;
     unsigned int                sasl_decoded_offset;
 #endif
+    uint8_t                     *read_buf;
+    gsize                       read_buf_offset;
+    gsize                       read_buf_length;
 
     gboolean                    use_mini_header;
     uint64_t                    out_serial;
@@ -113,6 +131,9 @@ struct _SpiceChannelPrivate {
     gboolean                    xmit_queue_blocked;
     STATIC_MUTEX                xmit_queue_lock;
     guint                       xmit_queue_wakeup_id;
+    uint8_t                     *write_buf;
+    gsize                       write_buf_len;
+    gsize                       write_coalesce_size;
 
     char                        name[16];
     enum spice_channel_state    state;
@@ -133,6 +154,7 @@ struct _SpiceChannelPrivate {
     SpiceLinkHeader             peer_hdr;
     SpiceLinkReply*             peer_msg;
     int                         peer_pos;
+    SpiceCapture                *capture;
 
     int                         message_ack_window;
     int                         message_ack_count;
@@ -143,6 +165,9 @@ struct _SpiceChannelPrivate {
     GArray                      *remote_common_caps;
 
     gsize                       total_read_bytes;
+    SpiceChannelStats           stats; /* msg_stats is unused */
+    GArray                      *msg_stats;
+    spice_msg_in_pool           *msg_in_pool;
     uint64_t                    last_message_serial;
     GSList                      *flushing;
 
@@ -87,6 +87,7 @@ enum {
     PROP_CHANNEL_TYPE,
     PROP_CHANNEL_ID,
     PROP_TOTAL_READ_BYTES,
+    PROP_STATS,
 };
 
 /* Signals */
@@ -101,6 +102,13 @@ static guint signals[SPICE_CHANNEL_LAST_SIGNAL];
 
 static void spice_channel_iterate_write(SpiceChannel *channel);
 static void spice_channel_iterate_read(SpiceChannel *channel);
+static spice_msg_in_pool *spice_msg_in_pool_new(void);
+static void spice_msg_in_pool_unref(spice_msg_in_pool *pool);
+
+/* queued messages are gathered up to this size before being written
+ * on TLS and websocket connections, 16k is the largest TLS record */
+#define WRITE_COALESCE_SIZE_DEFAULT (16 * 1024)
+#define WRITE_COALESCE_SIZE_MAX (1024 * 1024)
 
 static void spice_channel_init(SpiceChannel *channel)
 {
@@ -124,6 +132,13 @@ static void spice_channel_init(SpiceChannel *channel)
 #endif
     g_queue_init(&c->xmit_queue);
     STATIC_MUTEX_INIT(c->xmit_queue_lock);
+    c->msg_stats = g_array_new(FALSE, TRUE, sizeof(SpiceChannelMsgStats));
+    c->msg_in_pool = spice_msg_in_pool_new();
+
+    c->write_coalesce_size = WRITE_COALESCE_SIZE_DEFAULT;
+    if (g_getenv("SPICE_WRITE_COALESCE_SIZE"))
+        c->write_coalesce_size = CLAMP(atoi(g_getenv("SPICE_WRITE_COALESCE_SIZE")),
+                                       0, WRITE_COALESCE_SIZE_MAX);
 }
 
 static void spice_channel_constructed(GObject *gobject)
@@ -178,6 +193,10 @@ static void spice_channel_finalize(GObject *gobject)
     g_idle_remove_by_data(gobject);
 
     STATIC_MUTEX_CLEAR(c->xmit_queue_lock);
+    spice_msg_in_pool_unref(c->msg_in_pool);
+    g_free(c->read_buf);
+    g_free(c->write_buf);
+    g_array_unref(c->msg_stats);
 
     if (c->caps)
         g_array_free(c->caps, TRUE);
@@ -217,6 +236,9 @@ static void spice_channel_get_property(GObject    *gobject,
     case PROP_TOTAL_READ_BYTES:
         g_value_set_ulong(value, c->total_read_bytes);
         break;
+    case PROP_STATS:
+        g_value_take_boxed(value, spice_channel_get_stats(channel));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -319,6 +341,23 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
                             G_PARAM_READABLE |
                             G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceChannel:stats:
+     *
+     * A copy of the channel transport statistics, see
+     * spice_channel_get_stats().
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_STATS,
+         g_param_spec_boxed("stats",
+                            "Stats",
+                            "Channel transport statistics",
+                            SPICE_TYPE_CHANNEL_STATS,
+                            G_PARAM_READABLE |
+                            G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceChannel::channel-event:
      * @channel: the channel that emitted the signal
@@ -461,6 +500,104 @@ static inline uint32_t spice_header_get_msg_sub_list(uint8_t *header, gboolean i
     }
 }
 
+/* ---------------------------------------------------------------- */
+/* incoming message buffers pool                                    */
+
+#define MSG_IN_BUF_MIN_SHIFT 8
+#define MSG_IN_BUF_SIZE(c) ((gsize)1 << ((c) + MSG_IN_BUF_MIN_SHIFT))
+#define MSG_IN_BUF_POOL_DEPTH 4
+#define MSG_IN_BUF_POOL_MAX_BYTES (32 * 1024 * 1024)
+
+/* returns -1 if the buffer is too big to be pooled */
+static int spice_msg_in_buf_class(gsize size)
+{
+    int size_class;
+
+    for (size_class = 0; size_class < MSG_IN_BUF_CLASSES; size_class++) {
+        if (MSG_IN_BUF_SIZE(size_class) >= size)
+            return size_class;
+    }
+
+    return -1;
+}
+
+static spice_msg_in_pool *spice_msg_in_pool_new(void)
+{
+    spice_msg_in_pool *pool = g_slice_new0(spice_msg_in_pool);
+
+    pool->refcount = 1;
+    return pool;
+}
+
+static spice_msg_in_pool *spice_msg_in_pool_ref(spice_msg_in_pool *pool)
+{
+    pool->refcount++;
+    return pool;
+}
+
+/* the channel and each message holding a buffer have a reference, so
+ * the messages kept by the application can still be released once the
+ * channel is gone */
+static void spice_msg_in_pool_unref(spice_msg_in_pool *pool)
+{
+    int size_class;
+
+    if (--pool->refcount > 0)
+        return;
+
+    for (size_class = 0; size_class < MSG_IN_BUF_CLASSES; size_class++) {
+        while (pool->free_list[size_class] != NULL) {
+            gpointer buf = pool->free_list[size_class];
+
+            pool->free_list[size_class] = *(gpointer *)buf;
+            g_free(buf);
+        }
+    }
+    g_slice_free(spice_msg_in_pool, pool);
+}
+
+/* coroutine context, the buffer is not zeroed */
+static uint8_t *spice_msg_in_buf_get(SpiceChannel *channel, SpiceMsgIn *in, gsize size)
+{
+    spice_msg_in_pool *pool = channel->priv->msg_in_pool;
+    int size_class = spice_msg_in_buf_class(size);
+    gpointer buf;
+
+    in->pool = spice_msg_in_pool_ref(pool);
+    in->buf_class = size_class;
+    if (size_class < 0)
+        return g_malloc(size);
+
+    buf = pool->free_list[size_class];
+    if (buf == NULL)
+        return g_malloc(MSG_IN_BUF_SIZE(size_class));
+
+    pool->free_list[size_class] = *(gpointer *)buf;
+    pool->nfree[size_class]--;
+    pool->cached_bytes -= MSG_IN_BUF_SIZE(size_class);
+
+    return buf;
+}
+
+/* main or coroutine context */
+static void spice_msg_in_buf_release(spice_msg_in_pool *pool, uint8_t *buf, int size_class)
+{
+    if (buf == NULL)
+        return;
+
+    if (size_class < 0 ||
+        pool->nfree[size_class] >= MSG_IN_BUF_POOL_DEPTH ||
+        pool->cached_bytes + MSG_IN_BUF_SIZE(size_class) > MSG_IN_BUF_POOL_MAX_BYTES) {
+        g_free(buf);
+        return;
+    }
+
+    *(gpointer *)buf = pool->free_list[size_class];
+    pool->free_list[size_class] = buf;
+    pool->nfree[size_class]++;
+    pool->cached_bytes += MSG_IN_BUF_SIZE(size_class);
+}
+
 /* ---------------------------------------------------------------- */
 /* private msg api                                                  */
 
@@ -474,6 +611,7 @@ SpiceMsgIn *spice_msg_in_new(SpiceChannel *channel)
     in = g_slice_new0(SpiceMsgIn);
     in->refcount = 1;
     in->channel  = channel;
+    in->buf_class = -1;
 
     return in;
 }
@@ -516,8 +654,9 @@ void spice_msg_in_unref(SpiceMsgIn *in)
         in->pfree(in->parsed);
     if (in->parent) {
         spice_msg_in_unref(in->parent);
-    } else {
-        g_free(in->data);
+    } else if (in->pool) {
+        spice_msg_in_buf_release(in->pool, in->data, in->buf_class);
+        spice_msg_in_pool_unref(in->pool);
     }
     g_slice_free(SpiceMsgIn, in);
 }
@@ -711,6 +850,8 @@ void spice_msg_out_send(SpiceMsgOut *out)
 
     was_empty = g_queue_is_empty(&c->xmit_queue);
     g_queue_push_tail(&c->xmit_queue, out);
+    c->stats.xmit_queue_max_length = MAX(c->stats.xmit_queue_max_length,
+                                         g_queue_get_length(&c->xmit_queue));
 
     /* One wakeup is enough to empty the entire queue -> only do a wakeup
        if the queue was empty, and there isn't one pending already. */
@@ -735,6 +876,21 @@ void spice_msg_out_send_internal(SpiceMsgOut *out)
     spice_channel_write_msg(out->channel, out);
 }
 
+/*
+ * Wait for the socket condition, accounting the time spent in
+ * @wait_time
+ */
+/* coroutine context */
+static void spice_channel_socket_wait(SpiceChannel *channel, GIOCondition cond,
+                                      guint64 *wait_time)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gint64 start = g_get_monotonic_time();
+
+    g_coroutine_socket_wait(&c->coroutine, c->sock, cond);
+    *wait_time += g_get_monotonic_time() - start;
+}
+
 /*
  * Write all 'data' of length 'datalen' bytes out to
  * the wire
@@ -755,6 +911,7 @@ static void spice_channel_flush_wire(SpiceChannel *channel,
 
         if (c->has_error) return;
 
+        c->stats.write_calls++;
         cond = 0;
         if (c->ws) {
             ret = nopoll_conn_send_binary(c->np_conn, ptr+offset, datalen-offset);
@@ -793,7 +950,7 @@ static void spice_channel_flush_wire(SpiceChannel *channel,
         if (ret == -1) {
             if (cond != 0) {
                 // TODO: should use g_pollable_input/output_stream_create_source() in 2.28 ?
-                g_coroutine_socket_wait(&c->coroutine, c->sock, cond);
+                spice_channel_socket_wait(channel, cond, &c->stats.write_wait_time);
                 continue;
             } else {
                 CHANNEL_DEBUG(channel, "Closing the channel: spice_channel_flush %d", errno);
@@ -806,10 +963,67 @@ static void spice_channel_flush_wire(SpiceChannel *channel,
             c->has_error = TRUE;
             return;
         }
+        c->stats.bytes_written += ret;
         offset += ret;
     }
 }
 
+/* maximum number of buffers written at once */
+#define WRITE_VECTORS_MAX 64
+
+/*
+ * Write all the buffers out to the wire, with as few syscalls as
+ * possible. Only for plain sockets.
+ */
+/* coroutine context */
+static void spice_channel_flush_wire_vectored(SpiceChannel *channel,
+                                              GOutputVector *vectors,
+                                              guint n_vectors)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    while (n_vectors > 0) {
+        gssize ret;
+        GError *error = NULL;
+
+        if (c->has_error) return;
+
+        c->stats.write_calls++;
+        ret = g_socket_send_message(c->sock, NULL, vectors, n_vectors,
+                                    NULL, 0, 0, NULL, &error);
+        if (ret < 0) {
+            if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)
+             || g_error_matches(error, G_IO_ERROR, G_IO_ERROR_NOT_CONNECTED)) {
+                g_clear_error(&error);
+                spice_channel_socket_wait(channel, G_IO_OUT, &c->stats.write_wait_time);
+                continue;
+            }
+            CHANNEL_DEBUG(channel, "Closing the channel: send error %s", error->message);
+            g_clear_error(&error);
+            c->has_error = TRUE;
+            return;
+        }
+        if (ret == 0) {
+            CHANNEL_DEBUG(channel, "Closing the connection: spice_channel_flush");
+            c->has_error = TRUE;
+            return;
+        }
+
+        c->stats.bytes_written += ret;
+
+        /* skip what was written */
+        while (n_vectors > 0 && ret >= vectors->size) {
+            ret -= vectors->size;
+            vectors++;
+            n_vectors--;
+        }
+        if (n_vectors > 0) {
+            vectors->buffer = (const guint8 *)vectors->buffer + ret;
+            vectors->size -= ret;
+        }
+    }
+}
+
 #if HAVE_SASL
 /*
  * Encode all buffered data, write all encrypted data out
@@ -848,30 +1062,44 @@ static void spice_channel_write(SpiceChannel *channel, const void *data, size_t
         spice_channel_flush_wire(channel, data, len);
 }
 
+/* coroutine context */
+static gboolean spice_msg_out_prepare(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    uint32_t msg_size;
+
+    if (out->ro_check &&
+        spice_channel_get_read_only(channel)) {
+        g_warning("Try to send message while read-only. Please report a bug.");
+        return FALSE;
+    }
+
+    msg_size = spice_marshaller_get_total_size(out->marshaller) -
+               spice_header_get_header_size(channel->priv->use_mini_header);
+    spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
+
+    return TRUE;
+}
+
 /* coroutine context */
 static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
 {
     uint8_t *data;
     int free_data;
     size_t len;
-    uint32_t msg_size;
 
     g_return_if_fail(channel != NULL);
     g_return_if_fail(out != NULL);
     g_return_if_fail(channel == out->channel);
 
-    if (out->ro_check &&
-        spice_channel_get_read_only(channel)) {
-        g_warning("Try to send message while read-only. Please report a bug.");
+    if (!spice_msg_out_prepare(channel, out)) {
+        spice_msg_out_unref(out);
         return;
     }
 
-    msg_size = spice_marshaller_get_total_size(out->marshaller) -
-               spice_header_get_header_size(channel->priv->use_mini_header);
-    spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
     data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
     /* spice_msg_out_hexdump(out, data, len); */
     spice_channel_write(channel, data, len);
+    channel->priv->stats.messages_written++;
 
     if (free_data)
         g_free(data);
@@ -894,6 +1122,7 @@ reread:
 
     if (c->has_error) return 0; /* has_error is set by disconnect(), return no error */
 
+    c->stats.read_calls++;
     cond = 0;
     if (c->ws) {
         ret = nopoll_conn_read(c->np_conn, data, len, nopoll_false, 0);
@@ -943,7 +1172,7 @@ reread:
     if (ret == -1) {
         if (cond != 0) {
             // TODO: should use g_pollable_input/output_stream_create_source() ?
-            g_coroutine_socket_wait(&c->coroutine, c->sock, cond);
+            spice_channel_socket_wait(channel, cond, &c->stats.read_wait_time);
             goto reread;
         } else {
             c->has_error = TRUE;
@@ -1008,8 +1237,26 @@ static int spice_channel_read_sasl(SpiceChannel *channel, void *data, size_t len
 }
 #endif
 
+/* coroutine context */
+static int spice_channel_read_raw(SpiceChannel *channel, void *data, size_t len)
+{
+#if HAVE_SASL
+    if (channel->priv->sasl_conn)
+        return spice_channel_read_sasl(channel, data, len);
+#endif
+    return spice_channel_read_wire(channel, data, len);
+}
+
+/* size of the read-ahead buffer, bigger reads go straight to the
+ * destination buffer */
+#define READ_BUF_SIZE (16 * 1024)
+
 /*
  * Fill the 'data' buffer up with exactly 'len' bytes worth of data
+ *
+ * Once the channel is ready, small reads are served from a read-ahead
+ * buffer, so that a single read from the connection can feed several
+ * messages.
  */
 /* coroutine context */
 static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
@@ -1021,14 +1268,25 @@ static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
     while (len > 0) {
         if (c->has_error) return 0; /* has_error is set by disconnect(), return no error */
 
-#if HAVE_SASL
-        if (c->sasl_conn)
-            ret = spice_channel_read_sasl(channel, data, len);
-        else
-#endif
-            ret = spice_channel_read_wire(channel, data, len);
-        if (ret < 0)
-            return ret;
+        if (c->read_buf_length > 0) {
+            ret = MIN(len, c->read_buf_length);
+            memcpy(data, c->read_buf + c->read_buf_offset, ret);
+            c->read_buf_offset += ret;
+            c->read_buf_length -= ret;
+        } else if (len < READ_BUF_SIZE && c->state == SPICE_CHANNEL_STATE_READY) {
+            if (c->read_buf == NULL)
+                c->read_buf = g_malloc(READ_BUF_SIZE);
+            ret = spice_channel_read_raw(channel, c->read_buf, READ_BUF_SIZE);
+            if (ret < 0)
+                return ret;
+            c->read_buf_offset = 0;
+            c->read_buf_length = ret;
+            continue;
+        } else {
+            ret = spice_channel_read_raw(channel, data, len);
+            if (ret < 0)
+                return ret;
+        }
         g_assert(ret <= len);
         len -= ret;
         data = ((char*)data) + ret;
@@ -1120,6 +1378,31 @@ cleanup:
     return ret;
 }
 
+/* coroutine context */
+static void spice_channel_capture_start(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    const gchar *dir = spice_session_get_capture_dir(c->session);
+    GError *error = NULL;
+    guint8 *link;
+
+    if (dir == NULL || c->capture != NULL)
+        return;
+
+    /* keep the link as received, so that it can be replayed as is */
+    link = g_malloc(sizeof(c->peer_hdr) + c->peer_hdr.size);
+    memcpy(link, &c->peer_hdr, sizeof(c->peer_hdr));
+    memcpy(link + sizeof(c->peer_hdr), c->peer_msg, c->peer_hdr.size);
+    c->capture = spice_capture_new(dir, c->channel_type, c->channel_id,
+                                   link, sizeof(c->peer_hdr) + c->peer_hdr.size,
+                                   &error);
+    if (error != NULL) {
+        g_warning("%s", error->message);
+        g_clear_error(&error);
+    }
+    g_free(link);
+}
+
 /* coroutine context */
 static gboolean spice_channel_recv_auth(SpiceChannel *channel)
 {
@@ -1142,6 +1425,7 @@ static gboolean spice_channel_recv_auth(SpiceChannel *channel)
     }
 
     c->state = SPICE_CHANNEL_STATE_READY;
+    spice_channel_capture_start(channel);
 
     g_coroutine_signal_emit(channel, signals[SPICE_CHANNEL_EVENT], 0, SPICE_CHANNEL_OPENED);
 
@@ -1842,6 +2126,32 @@ gboolean spice_channel_get_read_only(SpiceChannel *channel)
     return spice_session_get_read_only(channel->priv->session);
 }
 
+/* message types above are not accounted individually */
+#define MSG_STATS_TYPES_MAX 1024
+
+/* coroutine context */
+static void spice_channel_handle_msg_in(SpiceChannel *channel,
+                                        handler_msg_in msg_handler,
+                                        SpiceMsgIn *in, gpointer data)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    int type = spice_msg_in_type(in);
+    gint64 start = g_get_monotonic_time();
+    SpiceChannelMsgStats *stats;
+
+    msg_handler(channel, in, data);
+
+    if (type < 0 || type >= MSG_STATS_TYPES_MAX)
+        return;
+    if (type >= c->msg_stats->len)
+        g_array_set_size(c->msg_stats, type + 1);
+    stats = &g_array_index(c->msg_stats, SpiceChannelMsgStats, type);
+    stats->type = type;
+    stats->count++;
+    stats->bytes += in->dpos;
+    stats->handler_time += g_get_monotonic_time() - start;
+}
+
 /* coroutine context */
 G_GNUC_INTERNAL
 void spice_channel_recv_msg(SpiceChannel *channel,
@@ -1867,10 +2177,9 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     }
 
     msg_size = spice_header_get_msg_size(in->header, c->use_mini_header);
-    /* FIXME: do not allow others to take ref on in, and use realloc here?
-     * this would avoid malloc/free on each message?
-     */
-    in->data = g_malloc0(msg_size);
+    /* the buffers are recycled when the messages are released, which
+     * avoids a malloc/free on each message */
+    in->data = spice_msg_in_buf_get(channel, in, msg_size);
     do {
         c->has_error = FALSE;
         c->error_was_ping = FALSE;
@@ -1879,6 +2188,12 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     if (c->has_error)
         goto end;
     in->dpos = msg_size;
+    c->stats.messages_read++;
+
+    if (c->capture != NULL)
+        spice_capture_msg(c->capture, in->header,
+                          spice_header_get_header_size(c->use_mini_header),
+                          in->data, msg_size);
 
     msg_type = spice_header_get_msg_type(in->header, c->use_mini_header);
     sub_list_offset = spice_header_get_msg_sub_list(in->header, c->use_mini_header);
@@ -1903,7 +2218,7 @@ void spice_channel_recv_msg(SpiceChannel *channel,
                            c->name, spice_header_get_msg_type(sub_in->header, c->use_mini_header));
                 goto end;
             }
-            msg_handler(channel, sub_in, data);
+            spice_channel_handle_msg_in(channel, msg_handler, sub_in, data);
             spice_msg_in_unref(sub_in);
         }
     }
@@ -1933,7 +2248,7 @@ void spice_channel_recv_msg(SpiceChannel *channel,
 
     /* process message */
     /* spice_msg_in_hexdump(in); */
-    msg_handler(channel, in, data);
+    spice_channel_handle_msg_in(channel, msg_handler, in, data);
 
 end:
     /* If the server uses full header, the serial is not necessarily equal
@@ -2142,35 +2457,229 @@ static void spice_channel_flushed(SpiceChannel *channel, gboolean success)
 }
 
 /* coroutine context */
-static void spice_channel_iterate_write(SpiceChannel *channel)
+static gboolean spice_channel_can_write_vectored(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
+
+#if HAVE_SASL
+    if (c->sasl_conn)
+        return FALSE;
+#endif
+    return !c->tls && !c->ws && c->sock != NULL;
+}
+
+/*
+ * Fill @vectors with the chunks of the message marshaller.
+ *
+ * Returns: the number of vectors used, or -1 if they are not enough
+ */
+static int spice_msg_out_fill_vectors(SpiceMsgOut *out,
+                                      GOutputVector *vectors, int n_vectors)
+{
+    struct iovec iov[WRITE_VECTORS_MAX];
+    size_t size = 0;
+    int i, n;
+
+    n = spice_marshaller_fill_iovec(out->marshaller, iov,
+                                    MIN(n_vectors, WRITE_VECTORS_MAX), 0);
+    for (i = 0; i < n; i++) {
+        vectors[i].buffer = iov[i].iov_base;
+        vectors[i].size = iov[i].iov_len;
+        size += iov[i].iov_len;
+    }
+
+    return size == spice_marshaller_get_total_size(out->marshaller) ? n : -1;
+}
+
+/* coroutine context */
+static void spice_channel_write_vectors(SpiceChannel *channel,
+                                        GOutputVector *vectors, guint n_vectors,
+                                        SpiceMsgOut **outs, guint n_outs)
+{
+    guint i;
+
+    spice_channel_flush_wire_vectored(channel, vectors, n_vectors);
+    channel->priv->stats.messages_written += n_outs;
+    for (i = 0; i < n_outs; i++)
+        spice_msg_out_unref(outs[i]);
+}
+
+/*
+ * Send the queued messages without copying their data, several of
+ * them at once if possible.
+ */
+/* coroutine context */
+static void spice_channel_iterate_write_vectored(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    GOutputVector vectors[WRITE_VECTORS_MAX];
+    SpiceMsgOut *outs[WRITE_VECTORS_MAX];
+    guint n_vectors = 0, n_outs = 0;
     SpiceMsgOut *out;
-    int pending_bytes;
+    int n;
 
     do {
         STATIC_MUTEX_LOCK(c->xmit_queue_lock);
         out = g_queue_pop_head(&c->xmit_queue);
         STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
         if (out) {
-            spice_channel_write_msg(channel, out);
-            if (c->ws) {
-                while ((pending_bytes = nopoll_conn_complete_pending_write(c->np_conn) != 0)) {
-                    g_warning("Writing %d pending bytes", pending_bytes);
-                    if (pending_bytes < 0 && errno != EAGAIN
+            if (!spice_msg_out_prepare(channel, out)) {
+                spice_msg_out_unref(out);
+                continue;
+            }
+
+            n = spice_msg_out_fill_vectors(out, vectors + n_vectors,
+                                           WRITE_VECTORS_MAX - n_vectors);
+            if (n < 0 && n_vectors > 0) {
+                /* send what is pending first */
+                spice_channel_write_vectors(channel, vectors, n_vectors, outs, n_outs);
+                n_vectors = n_outs = 0;
+                n = spice_msg_out_fill_vectors(out, vectors, WRITE_VECTORS_MAX);
+            }
+            if (n < 0) {
+                /* too many chunks, fallback to a copy */
+                spice_channel_write_msg(channel, out);
+                continue;
+            }
+            n_vectors += n;
+            outs[n_outs++] = out;
+        }
+
+        if (n_vectors > 0 && (out == NULL || n_vectors == WRITE_VECTORS_MAX)) {
+            spice_channel_write_vectors(channel, vectors, n_vectors, outs, n_outs);
+            n_vectors = n_outs = 0;
+        }
+    } while (out);
+}
+
+/* coroutine context */
+static gboolean spice_channel_complete_ws_write(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    int pending_bytes;
+
+    while ((pending_bytes = nopoll_conn_complete_pending_write(c->np_conn) != 0)) {
+        g_warning("Writing %d pending bytes", pending_bytes);
+        if (pending_bytes < 0 && errno != EAGAIN
 #ifdef WIN32
-                        && WSAGetLastError() != WSAEWOULDBLOCK
+            && WSAGetLastError() != WSAEWOULDBLOCK
 #endif
-                    ) {
-                        c->has_error = TRUE;
-                        return;
-                    }
-                    g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_OUT);
-                }
+        ) {
+            c->has_error = TRUE;
+            return FALSE;
+        }
+        spice_channel_socket_wait(channel, G_IO_OUT, &c->stats.write_wait_time);
+    }
+
+    return TRUE;
+}
+
+/* coroutine context */
+static gboolean spice_channel_can_coalesce_writes(SpiceChannel *channel)
+{
+#if HAVE_SASL
+    /* sasl_encode() input size is limited */
+    if (channel->priv->sasl_conn)
+        return FALSE;
+#endif
+    return channel->priv->write_coalesce_size > 0;
+}
+
+/* coroutine context */
+static void spice_channel_coalesce_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    struct iovec iov[16];
+    size_t size, offset = 0;
+
+    if (!spice_msg_out_prepare(channel, out)) {
+        spice_msg_out_unref(out);
+        return;
+    }
+
+    if (c->write_buf == NULL)
+        c->write_buf = g_malloc(c->write_coalesce_size);
+
+    size = spice_marshaller_get_total_size(out->marshaller);
+    g_warn_if_fail(c->write_buf_len + size <= c->write_coalesce_size);
+    while (offset < size) {
+        int i, n;
+
+        n = spice_marshaller_fill_iovec(out->marshaller, iov, G_N_ELEMENTS(iov), offset);
+        if (n <= 0)
+            break;
+        for (i = 0; i < n; i++) {
+            memcpy(c->write_buf + c->write_buf_len, iov[i].iov_base, iov[i].iov_len);
+            c->write_buf_len += iov[i].iov_len;
+            offset += iov[i].iov_len;
+        }
+    }
+    c->stats.messages_written++;
+
+    spice_msg_out_unref(out);
+}
+
+/* coroutine context */
+static gboolean spice_channel_flush_write_buf(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->write_buf_len == 0)
+        return TRUE;
+
+    spice_channel_write(channel, c->write_buf, c->write_buf_len);
+    c->write_buf_len = 0;
+
+    return !c->ws || spice_channel_complete_ws_write(channel);
+}
+
+/*
+ * On TLS and websocket connections, the small messages queued are
+ * gathered in a single write, to avoid sending one record per message.
+ * Nothing is held back: the data is written as soon as the queue is
+ * empty or the buffer full.
+ */
+/* coroutine context */
+static void spice_channel_iterate_write(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    SpiceMsgOut *out;
+    gboolean coalesce;
+
+    if (spice_channel_can_write_vectored(channel)) {
+        spice_channel_iterate_write_vectored(channel);
+        spice_channel_flushed(channel, TRUE);
+        return;
+    }
+
+    coalesce = spice_channel_can_coalesce_writes(channel);
+    do {
+        STATIC_MUTEX_LOCK(c->xmit_queue_lock);
+        out = g_queue_pop_head(&c->xmit_queue);
+        STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
+        if (out) {
+            gsize size = spice_marshaller_get_total_size(out->marshaller);
+
+            if (coalesce && size < c->write_coalesce_size) {
+                if (c->write_buf_len + size > c->write_coalesce_size &&
+                    !spice_channel_flush_write_buf(channel))
+                    return;
+                spice_channel_coalesce_msg(channel, out);
+                continue;
             }
+
+            /* keep messages ordered */
+            if (!spice_channel_flush_write_buf(channel))
+                return;
+            spice_channel_write_msg(channel, out);
+            if (c->ws && !spice_channel_complete_ws_write(channel))
+                return;
         }
     } while (out);
 
+    if (!spice_channel_flush_write_buf(channel))
+        return;
+
     spice_channel_flushed(channel, TRUE);
 }
 
@@ -2179,12 +2688,15 @@ static void spice_channel_iterate_read(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
 
-    g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
+    if (c->read_buf_length == 0)
+        g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
 
-    /* treat all incoming data (block on message completion) */
+    /* treat all incoming data (block on message completion), starting
+     * with the messages already in the read-ahead buffer */
     while (!c->has_error &&
            c->state != SPICE_CHANNEL_STATE_MIGRATING &&
-           g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in))) {
+           (c->read_buf_length > 0 ||
+            g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in)))) {
         do
             spice_channel_recv_msg(channel,
                                    (handler_msg_in)SPICE_CHANNEL_GET_CLASS(channel)->handle_msg, NULL);
@@ -2365,6 +2877,86 @@ const GError* spice_channel_get_error(SpiceChannel *self)
     return c->error;
 }
 
+G_DEFINE_BOXED_TYPE(SpiceChannelStats, spice_channel_stats,
+                    spice_channel_stats_copy, spice_channel_stats_free)
+
+/**
+ * spice_channel_get_stats:
+ * @channel: a #SpiceChannel
+ *
+ * Retrieves the transport statistics of @channel since it was created.
+ *
+ * Returns: (transfer full): a copy of the statistics, free with
+ * spice_channel_stats_free()
+ * Since: 0.30
+ **/
+SpiceChannelStats *spice_channel_get_stats(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c;
+    SpiceChannelStats *stats;
+    guint i, n;
+
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), NULL);
+    c = channel->priv;
+
+    stats = g_new0(SpiceChannelStats, 1);
+    *stats = c->stats;
+    stats->bytes_read = c->total_read_bytes;
+
+    STATIC_MUTEX_LOCK(c->xmit_queue_lock);
+    stats->xmit_queue_length = g_queue_get_length(&c->xmit_queue);
+    stats->xmit_queue_max_length = c->stats.xmit_queue_max_length;
+    STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
+
+    stats->msg_stats = g_new0(SpiceChannelMsgStats, c->msg_stats->len);
+    for (i = 0, n = 0; i < c->msg_stats->len; i++) {
+        SpiceChannelMsgStats *msg_stats = &g_array_index(c->msg_stats, SpiceChannelMsgStats, i);
+
+        if (msg_stats->count > 0)
+            stats->msg_stats[n++] = *msg_stats;
+    }
+    stats->n_msg_stats = n;
+
+    return stats;
+}
+
+/**
+ * spice_channel_stats_copy:
+ * @stats: a #SpiceChannelStats
+ *
+ * Returns: (transfer full): a copy of @stats
+ * Since: 0.30
+ **/
+SpiceChannelStats *spice_channel_stats_copy(const SpiceChannelStats *stats)
+{
+    SpiceChannelStats *copy;
+
+    g_return_val_if_fail(stats != NULL, NULL);
+
+    copy = g_memdup(stats, sizeof(SpiceChannelStats));
+    copy->msg_stats = g_memdup(stats->msg_stats,
+                               stats->n_msg_stats * sizeof(SpiceChannelMsgStats));
+
+    return copy;
+}
+
+/**
+ * spice_channel_stats_free:
+ * @stats: a #SpiceChannelStats
+ *
+ * Frees @stats.
+ *
+ * Since: 0.30
+ **/
+void spice_channel_stats_free(SpiceChannelStats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    g_free(stats->msg_stats);
+    g_free(stats);
+}
+
 static void nopoll_log_handler(noPollCtx *ctx, noPollDebugLevel level,
                                const char *log_msg, noPollPtr user_data)
 {
@@ -2741,6 +3333,8 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
         c->sasl_decoded_offset = c->sasl_decoded_length = 0;
     }
 #endif
+    c->read_buf_offset = c->read_buf_length = 0;
+    c->write_buf_len = 0;
 
     spice_openssl_verify_free(c->sslverify);
     c->sslverify = NULL;
@@ -2770,6 +3364,9 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
     c->peer_msg = NULL;
     c->peer_pos = 0;
 
+    spice_capture_free(c->capture);
+    c->capture = NULL;
+
     STATIC_MUTEX_LOCK(c->xmit_queue_lock);
     c->xmit_queue_blocked = TRUE; /* Disallow queuing new messages */
     gboolean was_empty = g_queue_is_empty(&c->xmit_queue);
@@ -3002,6 +3599,9 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     SWAP(sasl_decoded_length);
     SWAP(sasl_decoded_offset);
 #endif
+    SWAP(read_buf);
+    SWAP(read_buf_offset);
+    SWAP(read_buf_length);
 }
 
 /* coroutine context */
@@ -32,9 +32,63 @@ G_BEGIN_DECLS
 #define SPICE_IS_CHANNEL_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), SPICE_TYPE_CHANNEL))
 #define SPICE_CHANNEL_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), SPICE_TYPE_CHANNEL, SpiceChannelClass))
 
+#define SPICE_TYPE_CHANNEL_STATS      (spice_channel_stats_get_type ())
+
 typedef struct _SpiceMsgIn  SpiceMsgIn;
 typedef struct _SpiceMsgOut SpiceMsgOut;
 
+/**
+ * SpiceChannelMsgStats:
+ * @type: the message type
+ * @count: number of messages of this type received
+ * @bytes: total size of these messages
+ * @handler_time: time spent handling these messages, in microseconds
+ *
+ * Statistics about the messages of a given type received by a channel.
+ *
+ * Since: 0.30
+ **/
+typedef struct _SpiceChannelMsgStats {
+    guint       type;
+    guint64     count;
+    guint64     bytes;
+    guint64     handler_time;
+} SpiceChannelMsgStats;
+
+/**
+ * SpiceChannelStats:
+ * @bytes_read: bytes received
+ * @bytes_written: bytes sent
+ * @messages_read: messages received
+ * @messages_written: messages sent
+ * @read_calls: number of reads from the connection
+ * @write_calls: number of writes to the connection
+ * @read_wait_time: time spent waiting for the rest of a message, in microseconds
+ * @write_wait_time: time spent waiting for the connection to be writable, in microseconds
+ * @xmit_queue_length: number of messages waiting to be sent
+ * @xmit_queue_max_length: highest number of messages waiting to be sent
+ * @n_msg_stats: number of elements of @msg_stats
+ * @msg_stats: (array length=n_msg_stats): statistics of the message types received
+ *
+ * Transport statistics of a #SpiceChannel, see spice_channel_get_stats().
+ *
+ * Since: 0.30
+ **/
+typedef struct _SpiceChannelStats {
+    guint64     bytes_read;
+    guint64     bytes_written;
+    guint64     messages_read;
+    guint64     messages_written;
+    guint64     read_calls;
+    guint64     write_calls;
+    guint64     read_wait_time;
+    guint64     write_wait_time;
+    guint       xmit_queue_length;
+    guint       xmit_queue_max_length;
+    guint       n_msg_stats;
+    SpiceChannelMsgStats *msg_stats;
+} SpiceChannelStats;
+
 /**
  * SpiceChannelEvent:
  * @SPICE_CHANNEL_NONE: no event, or ignored event
@@ -128,6 +182,11 @@ gint spice_channel_string_to_type(const gchar *str);
 
 const GError* spice_channel_get_error(SpiceChannel *channel);
 
+GType spice_channel_stats_get_type(void);
+SpiceChannelStats *spice_channel_get_stats(SpiceChannel *channel);
+SpiceChannelStats *spice_channel_stats_copy(const SpiceChannelStats *stats);
+void spice_channel_stats_free(SpiceChannelStats *stats);
+
 G_END_DECLS
 
 #endif /* __SPICE_CLIENT_CHANNEL_H__ */
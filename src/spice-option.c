@@ -40,8 +40,11 @@ static gboolean disable_usbredir = FALSE;
 static gint cache_size = 0;
 static gint glz_window_size = 0;
 static gint inactivity_timeout = 0;
+static gint stream_latency = 0;
+static gint stream_late_tolerance = 0;
 static gchar *secure_channels = NULL;
 static gchar *shared_dir = NULL;
+static gchar *capture_dir = NULL;
 static SpiceImageCompression preferred_compression = SPICE_IMAGE_COMPRESSION_INVALID;
 
 G_GNUC_NORETURN
@@ -221,8 +224,14 @@ GOptionGroup* spice_get_option_group(void)
           N_("Image cache size"), N_("<bytes>") },
         { "spice-glz-window-size", '\0', 0, G_OPTION_ARG_INT, &glz_window_size,
           N_("Glz compression history size"), N_("<bytes>") },
+        { "spice-stream-latency", '\0', 0, G_OPTION_ARG_INT, &stream_latency,
+          N_("Video streams jitter buffer latency"), N_("<ms>") },
+        { "spice-stream-late-tolerance", '\0', 0, G_OPTION_ARG_INT, &stream_late_tolerance,
+          N_("Maximum lateness of video stream frames before dropping them"), N_("<ms>") },
         { "spice-shared-dir", '\0', 0, G_OPTION_ARG_FILENAME, &shared_dir,
           N_("Shared directory"), N_("<dir>") },
+        { "spice-capture-dir", '\0', 0, G_OPTION_ARG_FILENAME, &capture_dir,
+          N_("Record the received messages to directory"), N_("<dir>") },
         { "spice-preferred-compression", '\0', 0, G_OPTION_ARG_CALLBACK, parse_preferred_compression,
           N_("Preferred image compression algorithm"),
 #ifdef USE_LZ4
@@ -317,8 +326,14 @@ void spice_set_session_option(SpiceSession *session)
         g_object_set(session, "cache-size", cache_size, NULL);
     if (glz_window_size)
         g_object_set(session, "glz-window-size", glz_window_size, NULL);
+    if (stream_latency > 0)
+        g_object_set(session, "stream-latency", stream_latency, NULL);
+    if (stream_late_tolerance > 0)
+        g_object_set(session, "stream-late-tolerance", stream_late_tolerance, NULL);
     if (shared_dir)
         g_object_set(session, "shared-dir", shared_dir, NULL);
+    if (capture_dir)
+        g_object_set(session, "capture-dir", capture_dir, NULL);
     if (preferred_compression != SPICE_IMAGE_COMPRESSION_INVALID)
         g_object_set(session, "preferred-compression", preferred_compression, NULL);
     if (inactivity_timeout)
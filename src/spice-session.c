@@ -42,6 +42,10 @@ struct channel {
 };
 
 #define IMAGES_CACHE_SIZE_DEFAULT (1024 * 1024 * 80)
+/* The images cache is counted in pixels, like the server does with the
+ * pixmap cache size we advertise. A server keeping to it never makes us
+ * evict, the margin only bounds the memory a misbehaving one can use. */
+#define IMAGES_CACHE_MAX_SIZE_FACTOR 2
 #define MIN_GLZ_WINDOW_SIZE_DEFAULT (1024 * 1024 * 12)
 #define MAX_GLZ_WINDOW_SIZE_DEFAULT MIN((LZ_MAX_WINDOW_SIZE * 4), 1024 * 1024 * 64)
 
@@ -63,6 +67,7 @@ struct _SpiceSessionPrivate {
     SpiceURI          *proxy;
     gchar             *shared_dir;
     gboolean          share_dir_ro;
+    gchar             *capture_dir;
 
     /* whether to enable audio */
     gboolean          audio;
@@ -132,6 +137,10 @@ struct _SpiceSessionPrivate {
     GStrv             redirected_lports;
 
     gint inactivity_timeout;
+
+    /* video streams jitter buffer */
+    guint             stream_latency;
+    guint             stream_late_tolerance;
 };
 
 
@@ -217,6 +226,14 @@ enum {
     PROP_REDIR_RPORTS,
     PROP_REDIR_LPORTS,
     PROP_INACTIVITY_TIMEOUT,
+    PROP_STREAM_LATENCY,
+    PROP_STREAM_LATE_TOLERANCE,
+    PROP_IMAGES_CACHE_BYTES,
+    PROP_IMAGES_CACHE_HITS,
+    PROP_IMAGES_CACHE_MISSES,
+    PROP_IMAGES_CACHE_EVICTIONS,
+    PROP_GLZ_WINDOW_BYTES,
+    PROP_CAPTURE_DIR,
 };
 
 /* signals */
@@ -290,6 +307,15 @@ static void update_proxy(SpiceSession *self, const gchar *str)
     }
 }
 
+static gsize images_cache_item_size(gpointer value, gsize *bytes)
+{
+    pixman_image_t *image = value;
+    gsize height = pixman_image_get_height(image);
+
+    *bytes = (gsize)pixman_image_get_stride(image) * height;
+    return pixman_image_get_width(image) * height;
+}
+
 static void spice_session_init(SpiceSession *session)
 {
     SpiceSessionPrivate *s;
@@ -303,7 +329,8 @@ static void spice_session_init(SpiceSession *session)
     g_free(channels);
 
     ring_init(&s->channels);
-    s->images = cache_image_new((GDestroyNotify)pixman_image_unref);
+    s->images = cache_image_new((GDestroyNotify)pixman_image_unref,
+                                images_cache_item_size);
     s->glz_window = glz_decoder_window_new();
     update_proxy(session, NULL);
 }
@@ -384,6 +411,7 @@ spice_session_finalize(GObject *gobject)
     g_strfreev(s->disable_effects);
     g_strfreev(s->secure_channels);
     g_free(s->shared_dir);
+    g_free(s->capture_dir);
     g_strfreev(s->redirected_rports);
     g_strfreev(s->redirected_lports);
 
@@ -731,6 +759,33 @@ static void spice_session_get_property(GObject    *gobject,
     case PROP_INACTIVITY_TIMEOUT:
         g_value_set_int(value, s->inactivity_timeout);
         break;
+    case PROP_STREAM_LATENCY:
+        g_value_set_uint(value, s->stream_latency);
+        break;
+    case PROP_STREAM_LATE_TOLERANCE:
+        g_value_set_uint(value, s->stream_late_tolerance);
+        break;
+    case PROP_IMAGES_CACHE_BYTES:
+        g_value_set_uint64(value, s->images->bytes);
+        break;
+    case PROP_IMAGES_CACHE_HITS:
+        g_value_set_uint64(value, s->images->hits);
+        break;
+    case PROP_IMAGES_CACHE_MISSES:
+        g_value_set_uint64(value, s->images->misses);
+        break;
+    case PROP_IMAGES_CACHE_EVICTIONS:
+        g_value_set_uint64(value, s->images->evictions);
+        break;
+    case PROP_GLZ_WINDOW_BYTES: {
+        gsize used;
+        glz_decoder_window_get_stats(s->glz_window, &used, NULL, NULL);
+        g_value_set_uint64(value, used);
+        break;
+    }
+    case PROP_CAPTURE_DIR:
+        g_value_set_string(value, s->capture_dir);
+        break;
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
 	break;
@@ -885,6 +940,16 @@ static void spice_session_set_property(GObject      *gobject,
     case PROP_INACTIVITY_TIMEOUT:
         s->inactivity_timeout = g_value_get_int(value);
         break;
+    case PROP_STREAM_LATENCY:
+        s->stream_latency = g_value_get_uint(value);
+        break;
+    case PROP_STREAM_LATE_TOLERANCE:
+        s->stream_late_tolerance = g_value_get_uint(value);
+        break;
+    case PROP_CAPTURE_DIR:
+        g_free(s->capture_dir);
+        s->capture_dir = g_value_dup_string(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -1583,6 +1648,147 @@ static void spice_session_class_init(SpiceSessionClass *klass)
                           G_PARAM_READWRITE |
                           G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceSession:stream-latency:
+     *
+     * Additional delay applied to the presentation of video stream
+     * frames. Frames are buffered for this long, so that irregular
+     * arrival times on the network are absorbed instead of causing
+     * frames to be dropped.
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_STREAM_LATENCY,
+         g_param_spec_uint("stream-latency",
+                           "Stream latency",
+                           "Video streams jitter buffer target latency (ms)",
+                           0, 1000, 0,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:stream-late-tolerance:
+     *
+     * How late a video stream frame may be presented before it is
+     * dropped.
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_STREAM_LATE_TOLERANCE,
+         g_param_spec_uint("stream-late-tolerance",
+                           "Stream late tolerance",
+                           "Maximum video stream frame lateness (ms)",
+                           0, 1000, 0,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:images-cache-bytes:
+     *
+     * Amount of pixel memory currently held by the images cache. The
+     * cache evicts its least recently used images only once the server
+     * sends twice as many pixels as #SpiceSession:cache-size allows it.
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_IMAGES_CACHE_BYTES,
+         g_param_spec_uint64("images-cache-bytes",
+                             "Images cache bytes",
+                             "Images cache memory footprint (bytes)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:images-cache-hits:
+     *
+     * Number of images found in the cache when the server referred to
+     * them.
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_IMAGES_CACHE_HITS,
+         g_param_spec_uint64("images-cache-hits",
+                             "Images cache hits",
+                             "Number of images found in the cache",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:images-cache-misses:
+     *
+     * Number of images the server referred to which were not in the
+     * cache yet, or had been evicted.
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_IMAGES_CACHE_MISSES,
+         g_param_spec_uint64("images-cache-misses",
+                             "Images cache misses",
+                             "Number of images missing from the cache",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:images-cache-evictions:
+     *
+     * Number of images evicted by the client to stay within its
+     * memory ceiling.
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_IMAGES_CACHE_EVICTIONS,
+         g_param_spec_uint64("images-cache-evictions",
+                             "Images cache evictions",
+                             "Number of images evicted from the cache",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:glz-window-bytes:
+     *
+     * Amount of memory currently used by the images of the GLZ
+     * decoding window, which is allocated after
+     * #SpiceSession:glz-window-size.
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_GLZ_WINDOW_BYTES,
+         g_param_spec_uint64("glz-window-bytes",
+                             "Glz window bytes",
+                             "Glz window memory in use (bytes)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:capture-dir:
+     *
+     * Directory where the channels connected afterwards record the
+     * messages they receive, one file per channel, for later replay
+     * with spicy-replay. %NULL disables the recording.
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_CAPTURE_DIR,
+         g_param_spec_string("capture-dir",
+                             "Capture directory",
+                             "Directory to record the channels messages to",
+                             NULL,
+                             G_PARAM_READWRITE |
+                             G_PARAM_STATIC_STRINGS));
+
     g_type_class_add_private(klass, sizeof(SpiceSessionPrivate));
 }
 
@@ -2609,6 +2815,21 @@ void spice_session_get_caches(SpiceSession *session,
         *glz_window = s->glz_window;
 }
 
+G_GNUC_INTERNAL
+void spice_session_get_stream_latency(SpiceSession *session,
+                                      guint *latency,
+                                      guint *late_tolerance)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    SpiceSessionPrivate *s = session->priv;
+
+    if (latency)
+        *latency = s->stream_latency;
+    if (late_tolerance)
+        *late_tolerance = s->stream_late_tolerance;
+}
+
 G_GNUC_INTERNAL
 void spice_session_set_caches_hints(SpiceSession *session,
                                     uint32_t pci_ram_size,
@@ -2626,11 +2847,15 @@ void spice_session_set_caches_hints(SpiceSession *session,
     if (s->images_cache_size == 0) {
         s->images_cache_size = IMAGES_CACHE_SIZE_DEFAULT;
     }
+    /* in pixels, as sent in SPICE_MSGC_DISPLAY_INIT */
+    cache_set_max_size(s->images,
+                       (gsize)(s->images_cache_size / 4) * IMAGES_CACHE_MAX_SIZE_FACTOR);
 
     if (s->glz_window_size == 0) {
         s->glz_window_size = MIN(MAX_GLZ_WINDOW_SIZE_DEFAULT, pci_ram_size / 2);
         s->glz_window_size = MAX(MIN_GLZ_WINDOW_SIZE_DEFAULT, s->glz_window_size);
     }
+    glz_decoder_window_set_size(s->glz_window, s->glz_window_size);
 }
 
 G_GNUC_INTERNAL
@@ -2718,6 +2943,14 @@ const gchar* spice_session_get_shared_dir(SpiceSession *session)
     return s->shared_dir;
 }
 
+G_GNUC_INTERNAL
+const gchar* spice_session_get_capture_dir(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    return session->priv->capture_dir;
+}
+
 G_GNUC_INTERNAL
 void spice_session_set_shared_dir(SpiceSession *session, const gchar *dir)
 {
@@ -17,6 +17,8 @@
 */
 #include "config.h"
 
+#include <math.h>
+
 #include "gtk-compat.h"
 #include "spice-widget.h"
 #include "spice-widget-priv.h"
@@ -62,6 +64,8 @@ void spicex_image_destroy(SpiceDisplay *display)
         cairo_surface_destroy(d->ximage);
         d->ximage = NULL;
     }
+    g_clear_pointer(&d->scaled, cairo_surface_destroy);
+    g_clear_pointer(&d->scaled_damage, cairo_region_destroy);
     if (d->convert && d->data) {
         g_free(d->data);
         d->data = NULL;
@@ -69,12 +73,104 @@ void spicex_image_destroy(SpiceDisplay *display)
     d->convert = FALSE;
 }
 
+/* @x, @y, @w, @h is the damage scaled at the widget resolution */
+G_GNUC_INTERNAL
+void spicex_image_invalidate(SpiceDisplay *display,
+                             gint x, gint y, gint w, gint h)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    cairo_rectangle_int_t rect;
+    int margin;
+
+    if (d->scaled == NULL)
+        return;
+
+    /* the filters read the neighbours of the source pixels */
+    margin = ceil(d->scaled_s) + 1;
+    rect.x = x - margin;
+    rect.y = y - margin;
+    rect.width = w + 2 * margin;
+    rect.height = h + 2 * margin;
+    cairo_region_union_rectangle(d->scaled_damage, &rect);
+}
+
+static cairo_filter_t get_filter(SpiceDisplayScaleFilter filter)
+{
+    switch (filter) {
+    case SPICE_DISPLAY_SCALE_FILTER_NEAREST:
+        return CAIRO_FILTER_NEAREST;
+    case SPICE_DISPLAY_SCALE_FILTER_BILINEAR:
+        return CAIRO_FILTER_BILINEAR;
+    default:
+        /* a box filter when scaling down, with cairo >= 1.14 */
+        return CAIRO_FILTER_GOOD;
+    }
+}
+
+/* Scales the damage of the display within @clip into the backbuffer,
+ * so that drawing the display is a copy of the backbuffer. */
+static void update_scaled(SpiceDisplay *display, double s, int w, int h,
+                          const cairo_rectangle_int_t *clip)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    cairo_rectangle_int_t rect;
+    cairo_region_t *region;
+    cairo_pattern_t *pattern;
+    cairo_t *cr;
+    int i, n;
+
+    if (d->scaled == NULL ||
+        d->scaled_s != s || d->scaled_filter != d->scale_filter ||
+        cairo_image_surface_get_width(d->scaled) != w ||
+        cairo_image_surface_get_height(d->scaled) != h) {
+        g_clear_pointer(&d->scaled, cairo_surface_destroy);
+        g_clear_pointer(&d->scaled_damage, cairo_region_destroy);
+        d->scaled = cairo_image_surface_create(CAIRO_FORMAT_RGB24, w, h);
+        d->scaled_s = s;
+        d->scaled_filter = d->scale_filter;
+        rect.x = rect.y = 0;
+        rect.width = w;
+        rect.height = h;
+        d->scaled_damage = cairo_region_create_rectangle(&rect);
+    }
+
+    region = cairo_region_copy(d->scaled_damage);
+    cairo_region_intersect_rectangle(region, clip);
+    if (cairo_region_is_empty(region)) {
+        cairo_region_destroy(region);
+        return;
+    }
+    cairo_region_subtract(d->scaled_damage, region);
+
+    cr = cairo_create(d->scaled);
+    n = cairo_region_num_rectangles(region);
+    for (i = 0; i < n; i++) {
+        cairo_region_get_rectangle(region, i, &rect);
+        cairo_rectangle(cr, rect.x, rect.y, rect.width, rect.height);
+    }
+    cairo_clip(cr);
+    cairo_region_destroy(region);
+
+    cairo_scale(cr, s, s);
+    if (!d->convert)
+        cairo_translate(cr, -d->area.x, -d->area.y);
+    cairo_set_source_surface(cr, d->ximage, 0, 0);
+    pattern = cairo_get_source(cr);
+    cairo_pattern_set_filter(pattern, get_filter(d->scale_filter));
+    /* don't blend the borders of the image with the previous content */
+    cairo_pattern_set_extend(pattern, CAIRO_EXTEND_PAD);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_destroy(cr);
+}
+
 G_GNUC_INTERNAL
 void spicex_draw_event(SpiceDisplay *display, cairo_t *cr)
 {
     SpiceDisplayPrivate *d = display->priv;
     cairo_rectangle_int_t rect;
     cairo_region_t *region;
+    GdkRectangle clip;
     double s;
     int x, y;
     int ww, wh;
@@ -115,11 +211,24 @@ void spicex_draw_event(SpiceDisplay *display, cairo_t *cr)
     if (d->ximage) {
         cairo_translate(cr, x, y);
         cairo_rectangle(cr, 0, 0, w, h);
-        cairo_scale(cr, s, s);
-        if (!d->convert)
-            cairo_translate(cr, -d->area.x, -d->area.y);
-        cairo_set_source_surface(cr, d->ximage, 0, 0);
-        cairo_fill(cr);
+        if (s != 1.0 && gdk_cairo_get_clip_rectangle(cr, &clip)) {
+            rect.x = clip.x;
+            rect.y = clip.y;
+            rect.width = clip.width;
+            rect.height = clip.height;
+            update_scaled(display, s, w, h, &rect);
+            cairo_set_source_surface(cr, d->scaled, 0, 0);
+            cairo_fill(cr);
+            cairo_scale(cr, s, s);
+            if (!d->convert)
+                cairo_translate(cr, -d->area.x, -d->area.y);
+        } else {
+            cairo_scale(cr, s, s);
+            if (!d->convert)
+                cairo_translate(cr, -d->area.x, -d->area.y);
+            cairo_set_source_surface(cr, d->ximage, 0, 0);
+            cairo_fill(cr);
+        }
 
 #ifdef USE_VA
         GSList *va_sessions = NULL, *v;
@@ -63,6 +63,10 @@ struct _SpiceDisplayPrivate {
     gint                    ww, wh, mx, my;
 
     bool                    convert;
+#if GTK_CHECK_VERSION (2, 91, 0)
+    gboolean                convert_lazy;
+    cairo_region_t          *convert_pending; /* guest coordinates */
+#endif
     bool                    have_mitshm;
     gboolean                allow_scaling;
     gboolean                only_downscale;
@@ -75,9 +79,18 @@ struct _SpiceDisplayPrivate {
     XImage                  *ximage;
     XShmSegmentInfo         *shminfo;
     GC                      gc;
+    int                     shm_completion; /* the completion event type */
+    guint                   shm_pending; /* puts not completed yet */
+    GdkRegion               *shm_deferred; /* held while some are pending */
 #else
     cairo_surface_t         *ximage;
+    /* the display scaled at the widget resolution */
+    cairo_surface_t         *scaled;
+    cairo_region_t          *scaled_damage; /* scaled coordinates */
+    double                  scaled_s;
+    SpiceDisplayScaleFilter scaled_filter;
 #endif
+    SpiceDisplayScaleFilter scale_filter;
 
     SpiceSession            *session;
     SpiceGtkSession         *gtk_session;
@@ -126,10 +139,16 @@ struct _SpiceDisplayPrivate {
 #endif
     gint                    time_to_inactivity;
     gint64                  last_input_time;
+#if GTK_CHECK_VERSION(3, 8, 0)
+    GdkFrameClock           *frame_clock;
+    gulong                  frame_clock_update_id;
+    cairo_region_t          *damage; /* guest coordinates */
+#endif
 };
 
 int      spicex_image_create                 (SpiceDisplay *display);
 void     spicex_image_destroy                (SpiceDisplay *display);
+void     spicex_image_invalidate             (SpiceDisplay *display, gint x, gint y, gint w, gint h);
 #if GTK_CHECK_VERSION (2, 91, 0)
 void     spicex_draw_event                   (SpiceDisplay *display, cairo_t *cr);
 #else
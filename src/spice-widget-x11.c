@@ -116,6 +116,38 @@ static int catch_no_mitshm(Display * dpy, XErrorEvent * event)
     return 0;
 }
 
+static void put_region(SpiceDisplay *display, GdkRegion *region);
+
+/* The X server tells when it is done with each XShmPutImage(), the
+ * updates are held until the previous ones are completed instead of
+ * queuing them up in the server. */
+static GdkFilterReturn shm_completion_filter(GdkXEvent *xevent,
+                                             GdkEvent *event,
+                                             gpointer data)
+{
+    SpiceDisplay *display = data;
+    SpiceDisplayPrivate *d = display->priv;
+    XShmCompletionEvent *xev = xevent;
+    GdkWindow *window = gtk_widget_get_window(GTK_WIDGET(display));
+    GdkRegion *region;
+
+    if (xev->type != d->shm_completion || window == NULL ||
+        xev->drawable != gdk_x11_drawable_get_xid(window))
+        return GDK_FILTER_CONTINUE;
+
+    if (d->shm_pending > 0)
+        d->shm_pending--;
+
+    if (d->shm_pending == 0 && d->shm_deferred != NULL) {
+        region = d->shm_deferred;
+        d->shm_deferred = NULL;
+        put_region(display, region);
+        gdk_region_destroy(region);
+    }
+
+    return GDK_FILTER_REMOVE;
+}
+
 G_GNUC_INTERNAL
 int spicex_image_create(SpiceDisplay *display)
 {
@@ -131,6 +163,7 @@ int spicex_image_create(SpiceDisplay *display)
         .foreground = 0,
         .background = 0,
     };
+    gint            width, height, stride, shmid;
 
     d->dpy = gdk_x11_display_get_xdisplay(gtkdpy);
     d->convert = false;
@@ -141,17 +174,38 @@ int spicex_image_create(SpiceDisplay *display)
         d->vi = get_visual_for_format(GTK_WIDGET(display), SPICE_SURFACE_FMT_32_xRGB);
         g_return_val_if_fail(d->vi != NULL, 1);
     }
+
     if (d->convert) {
-        d->data = g_malloc0(d->height * d->stride); /* pixels are 32 bits */
+        /* the 32 bits copy of the monitor area, see do_color_convert(),
+           shared with the X server too when possible */
+        width = d->area.width;
+        height = d->area.height;
+        stride = width * 4;
+        shmid = -1;
+        d->data = NULL;
+        if (d->have_mitshm)
+            shmid = shmget(IPC_PRIVATE, stride * height, IPC_CREAT | 0600);
+        if (shmid >= 0) {
+            d->data = shmat(shmid, NULL, 0);
+            if (d->data == (void *)-1) {
+                d->data = NULL;
+                shmctl(shmid, IPC_RMID, 0);
+                shmid = -1;
+            }
+        }
+        if (d->data == NULL)
+            d->data = g_malloc0(stride * height);
+    } else {
+        width = d->width;
+        height = d->height;
+        stride = d->stride;
+        shmid = d->shmid;
     }
 
     d->gc = XCreateGC(d->dpy, gdk_x11_drawable_get_xid(window),
                       GCForeground | GCBackground, &gcval);
 
-    if (d->convert) /* do not use shm when doing color format conversion */
-        goto xcreate;
-
-    if (d->have_mitshm && d->shmid != -1) {
+    if (d->have_mitshm && shmid != -1) {
         if (!XShmQueryExtension(d->dpy)) {
             goto shm_fail;
         }
@@ -159,30 +213,45 @@ int spicex_image_create(SpiceDisplay *display)
         old_handler = XSetErrorHandler(catch_no_mitshm);
         d->shminfo = g_new0(XShmSegmentInfo, 1);
         d->ximage = XShmCreateImage(d->dpy, d->vi->visual, d->vi->depth,
-                                    ZPixmap, d->data, d->shminfo, d->width, d->height);
+                                    ZPixmap, d->data, d->shminfo, width, height);
         if (d->ximage == NULL)
             goto shm_fail;
         d->shminfo->shmaddr = d->data;
-        d->shminfo->shmid = d->shmid;
+        d->shminfo->shmid = shmid;
         d->shminfo->readOnly = false;
         XShmAttach(d->dpy, d->shminfo);
         XSync(d->dpy, False);
-        shmctl(d->shmid, IPC_RMID, 0);
+        shmctl(shmid, IPC_RMID, 0);
         if (no_mitshm)
             goto shm_fail;
         XSetErrorHandler(old_handler);
+
+        d->shm_completion = XShmGetEventBase(d->dpy) + ShmCompletion;
+        d->shm_pending = 0;
+        gdk_window_add_filter(NULL, shm_completion_filter, display);
         return 0;
     }
 
  shm_fail:
     d->have_mitshm = false;
+    if (d->ximage) {
+        d->ximage->data = NULL;
+        XDestroyImage(d->ximage);
+        d->ximage = NULL;
+    }
     g_free(d->shminfo);
     d->shminfo = NULL;
     if (old_handler)
         XSetErrorHandler(old_handler);
- xcreate:
+    if (d->convert && shmid != -1) {
+        /* fall back to a private conversion buffer */
+        shmctl(shmid, IPC_RMID, 0);
+        shmdt(d->data);
+        d->data = g_malloc0(stride * height);
+    }
+
     d->ximage = XCreateImage(d->dpy, d->vi->visual, d->vi->depth, ZPixmap, 0,
-                             d->data, d->width, d->height, 32, d->stride);
+                             d->data, width, height, 32, stride);
     return 0;
 }
 
@@ -191,19 +260,33 @@ void spicex_image_destroy(SpiceDisplay *display)
 {
     SpiceDisplayPrivate *d = display->priv;
 
+    if (d->shm_completion != 0) {
+        gdk_window_remove_filter(NULL, shm_completion_filter, display);
+        d->shm_completion = 0;
+    }
+    d->shm_pending = 0;
+    if (d->shm_deferred != NULL) {
+        gdk_region_destroy(d->shm_deferred);
+        d->shm_deferred = NULL;
+    }
+
     if (d->ximage) {
         /* avoid XDestroy to free shared memory, owned and freed by
-           channel-display itself */
-        if (d->ximage->data == d->data_origin)
+           channel-display itself, or detached below */
+        if (d->ximage->data == d->data_origin || d->shminfo != NULL)
             d->ximage->data = NULL;
         XDestroyImage(d->ximage);
         d->ximage = NULL;
-        if (d->convert)
+        if (d->convert && d->shminfo == NULL)
             d->data = 0;
     }
     if (d->shminfo) {
         XShmDetach(d->dpy, d->shminfo);
-        free(d->shminfo);
+        if (d->convert) {
+            shmdt(d->shminfo->shmaddr);
+            d->data = NULL;
+        }
+        g_free(d->shminfo);
         d->shminfo = NULL;
     }
     if (d->gc) {
@@ -217,35 +300,63 @@ void spicex_image_destroy(SpiceDisplay *display)
 }
 
 G_GNUC_INTERNAL
-void spicex_expose_event(SpiceDisplay *display, GdkEventExpose *expose)
+void spicex_image_invalidate(SpiceDisplay *display,
+                             gint x, gint y, gint w, gint h)
+{
+    /* the image is drawn unscaled straight from the display data */
+}
+
+/* @region is in window coordinates, within the guest screen */
+static void put_region(SpiceDisplay *display, GdkRegion *region)
 {
     GdkDrawable *window = gtk_widget_get_window(GTK_WIDGET(display));
     SpiceDisplayPrivate *d = display->priv;
-    int x, y, w, h;
+    GdkRectangle *rects;
+    int i, n, x, y, src_x, src_y;
 
-    spice_display_get_scaling(display, NULL, &x, &y, &w, &h);
+    spice_display_get_scaling(display, NULL, &x, &y, NULL, NULL);
+
+    /* the converted image only holds the monitor area */
+    src_x = d->convert ? -x : d->area.x - x;
+    src_y = d->convert ? -y : d->area.y - y;
 
-    if (expose->area.x >= x &&
-        expose->area.y >= y &&
-        expose->area.x + expose->area.width  <= x + w &&
-        expose->area.y + expose->area.height <= y + h) {
-        /* area is completely inside the guest screen -- blit it */
+    gdk_region_get_rectangles(region, &rects, &n);
+    for (i = 0; i < n; i++) {
         if (d->have_mitshm && d->shminfo) {
             XShmPutImage(d->dpy, gdk_x11_drawable_get_xid(window),
                          d->gc, d->ximage,
-                         d->area.x + expose->area.x - x, d->area.y + expose->area.y - y,
-                         expose->area.x, expose->area.y,
-                         expose->area.width, expose->area.height,
+                         src_x + rects[i].x, src_y + rects[i].y,
+                         rects[i].x, rects[i].y,
+                         rects[i].width, rects[i].height,
                          true);
+            d->shm_pending++;
         } else {
             XPutImage(d->dpy, gdk_x11_drawable_get_xid(window),
                       d->gc, d->ximage,
-                      d->area.x + expose->area.x - x, d->area.y + expose->area.y - y,
-                      expose->area.x, expose->area.y,
-                      expose->area.width, expose->area.height);
+                      src_x + rects[i].x, src_y + rects[i].y,
+                      rects[i].x, rects[i].y,
+                      rects[i].width, rects[i].height);
         }
-    } else {
-        /* complete window update */
+    }
+    g_free(rects);
+}
+
+G_GNUC_INTERNAL
+void spicex_expose_event(SpiceDisplay *display, GdkEventExpose *expose)
+{
+    GdkDrawable *window = gtk_widget_get_window(GTK_WIDGET(display));
+    SpiceDisplayPrivate *d = display->priv;
+    GdkRectangle guest;
+    GdkRegion *region;
+    int x, y, w, h;
+
+    spice_display_get_scaling(display, NULL, &x, &y, &w, &h);
+
+    if (expose->area.x < x ||
+        expose->area.y < y ||
+        expose->area.x + expose->area.width  > x + w ||
+        expose->area.y + expose->area.height > y + h) {
+        /* paint the window border */
         if (d->ww > d->area.width || d->wh > d->area.height) {
             int x1 = x;
             int x2 = x + w;
@@ -260,17 +371,24 @@ void spicex_expose_event(SpiceDisplay *display, GdkEventExpose *expose)
             XFillRectangle(d->dpy, gdk_x11_drawable_get_xid(window),
                            d->gc, 0, y2, d->ww, d->wh - y2);
         }
-        if (d->have_mitshm && d->shminfo) {
-            XShmPutImage(d->dpy, gdk_x11_drawable_get_xid(window),
-                         d->gc, d->ximage,
-                         d->area.x, d->area.y, x, y, w, h,
-                         true);
-        } else {
-            XPutImage(d->dpy, gdk_x11_drawable_get_xid(window),
-                      d->gc, d->ximage,
-                      d->area.x, d->area.y, x, y, w, h);
-        }
     }
+
+    /* blit each exposed rectangle of the guest screen */
+    guest.x = x;
+    guest.y = y;
+    guest.width = w;
+    guest.height = h;
+    region = gdk_region_rectangle(&guest);
+    gdk_region_intersect(region, expose->region);
+
+    if (d->shm_pending > 0) {
+        if (d->shm_deferred == NULL)
+            d->shm_deferred = gdk_region_new();
+        gdk_region_union(d->shm_deferred, region);
+    } else {
+        put_region(display, region);
+    }
+    gdk_region_destroy(region);
 }
 
 G_GNUC_INTERNAL
@@ -40,6 +40,7 @@
 #include "spice-widget-priv.h"
 #include "spice-gtk-session-priv.h"
 #include "vncdisplaykeymap.h"
+#include "pixel-simd.h"
 
 #include "glib-compat.h"
 #include "gtk-compat.h"
@@ -87,7 +88,8 @@ enum {
     PROP_ZOOM_LEVEL,
     PROP_MONITOR_ID,
     PROP_KEYPRESS_DELAY,
-    PROP_READY
+    PROP_READY,
+    PROP_SCALE_FILTER,
 };
 
 /* Signals */
@@ -169,6 +171,9 @@ static void spice_display_get_property(GObject    *object,
     case PROP_KEYPRESS_DELAY:
         g_value_set_uint(value, d->keypress_delay);
         break;
+    case PROP_SCALE_FILTER:
+        g_value_set_enum(value, d->scale_filter);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -403,6 +408,10 @@ static void spice_display_set_property(GObject      *object,
             d->keypress_delay = delay;
         }
         break;
+    case PROP_SCALE_FILTER:
+        d->scale_filter = g_value_get_enum(value);
+        scaling_updated(display);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -589,6 +598,9 @@ static void spice_display_init(SpiceDisplay *display)
     gtk_widget_set_double_buffered(widget, true);
 #endif
     gtk_widget_set_can_focus(widget, true);
+#if GTK_CHECK_VERSION (2, 91, 0)
+    d->convert_lazy = !g_getenv("SPICE_DISABLE_LAZY_CONVERT");
+#endif
     gtk_widget_set_has_window(widget, true);
     d->grabseq = spice_grab_sequence_new_from_string("Control_L+Alt_L");
     d->activeseq = g_new0(gboolean, d->grabseq->nkeysyms);
@@ -1092,57 +1104,116 @@ static void recalc_geometry(GtkWidget *widget)
 
 /* ---------------------------------------------------------------- */
 
-#define CONVERT_0565_TO_0888(s)                                         \
-    (((((s) << 3) & 0xf8) | (((s) >> 2) & 0x7)) |                       \
-     ((((s) << 5) & 0xfc00) | (((s) >> 1) & 0x300)) |                   \
-     ((((s) << 8) & 0xf80000) | (((s) << 3) & 0x70000)))
-
-#define CONVERT_0565_TO_8888(s) (CONVERT_0565_TO_0888(s) | 0xff000000)
-
-#define CONVERT_0555_TO_0888(s)                                         \
-    (((((s) & 0x001f) << 3) | (((s) & 0x001c) >> 2)) |                  \
-     ((((s) & 0x03e0) << 6) | (((s) & 0x0380) << 1)) |                  \
-     ((((s) & 0x7c00) << 9) | ((((s) & 0x7000)) << 4)))
-
-#define CONVERT_0555_TO_8888(s) (CONVERT_0555_TO_0888(s) | 0xff000000)
-
 static gboolean do_color_convert(SpiceDisplay *display, GdkRectangle *r)
 {
     SpiceDisplayPrivate *d = display->priv;
     guint32 *dest = d->data;
     guint16 *src = d->data_origin;
-    gint x, y;
+    void (*convert)(uint32_t *dst, const uint16_t *src, size_t n);
+    gint y;
 
     g_return_val_if_fail(r != NULL, false);
     g_return_val_if_fail(d->format == SPICE_SURFACE_FMT_16_555 ||
                          d->format == SPICE_SURFACE_FMT_16_565, false);
 
+    if (d->format == SPICE_SURFACE_FMT_16_555)
+        convert = pixel_rgb555_to_rgb32;
+    else
+        convert = pixel_rgb565_to_rgb32;
+
     src += (d->stride / 2) * r->y + r->x;
     dest += d->area.width * (r->y - d->area.y) + (r->x - d->area.x);
 
-    if (d->format == SPICE_SURFACE_FMT_16_555) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0555_TO_0888(src[x]);
-            }
+    for (y = 0; y < r->height; y++) {
+        convert(dest, src, r->width);
+        dest += d->area.width;
+        src += d->stride / 2;
+    }
 
-            dest += d->area.width;
-            src += d->stride / 2;
-        }
-    } else if (d->format == SPICE_SURFACE_FMT_16_565) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0565_TO_0888(src[x]);
-            }
+    return true;
+}
 
-            dest += d->area.width;
-            src += d->stride / 2;
-        }
+#if GTK_CHECK_VERSION (2, 91, 0)
+/* converts the pending damage within @clip, in guest coordinates, or
+ * all of it if @clip is NULL */
+static void color_convert_pending(SpiceDisplay *display, const GdkRectangle *clip)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    cairo_region_t *region;
+    cairo_rectangle_int_t rect;
+    int i, n;
+
+    if (d->convert_pending == NULL)
+        return;
+
+    if (clip != NULL) {
+        region = cairo_region_copy(d->convert_pending);
+        cairo_region_intersect_rectangle(region, clip);
+        cairo_region_subtract(d->convert_pending, region);
+        if (cairo_region_is_empty(d->convert_pending))
+            g_clear_pointer(&d->convert_pending, cairo_region_destroy);
+    } else {
+        region = d->convert_pending;
+        d->convert_pending = NULL;
     }
 
-    return true;
+    n = cairo_region_num_rectangles(region);
+    for (i = 0; i < n; i++) {
+        cairo_region_get_rectangle(region, i, &rect);
+        do_color_convert(display, &rect);
+    }
+    cairo_region_destroy(region);
 }
 
+/* converts the pending damage that @cr is about to draw */
+static void color_convert_visible(SpiceDisplay *display, cairo_t *cr)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    GdkRectangle clip, rect;
+    int x, y, margin;
+    double s;
+
+    if (d->convert_pending == NULL ||
+        !gdk_cairo_get_clip_rectangle(cr, &clip))
+        return;
+
+    spice_display_get_scaling(display, &s, &x, &y, NULL, NULL);
+
+    /* back to guest coordinates, the filtering of a scaled image
+     * samples the pixels around */
+    margin = ceil(1 / s) + 1;
+    rect.x = d->area.x + floor((clip.x - x) / s) - margin;
+    rect.y = d->area.y + floor((clip.y - y) / s) - margin;
+    rect.width = d->area.x + ceil((clip.x + clip.width - x) / s) + margin - rect.x;
+    rect.height = d->area.y + ceil((clip.y + clip.height - y) / s) + margin - rect.y;
+
+    color_convert_pending(display, &rect);
+}
+#endif
+
+static void queue_color_convert(SpiceDisplay *display, GdkRectangle *r)
+{
+#if GTK_CHECK_VERSION (2, 91, 0)
+    SpiceDisplayPrivate *d = display->priv;
+
+    /* only the parts being drawn are converted, see draw_event() */
+    if (d->convert_lazy) {
+        if (d->convert_pending == NULL)
+            d->convert_pending = cairo_region_create();
+        cairo_region_union_rectangle(d->convert_pending, r);
+        return;
+    }
+#endif
+
+    do_color_convert(display, r);
+}
+
+static void clear_color_convert(SpiceDisplay *display)
+{
+#if GTK_CHECK_VERSION (2, 91, 0)
+    g_clear_pointer(&display->priv->convert_pending, cairo_region_destroy);
+#endif
+}
 
 #if GTK_CHECK_VERSION (2, 91, 0)
 static gboolean draw_event(GtkWidget *widget, cairo_t *cr)
@@ -1156,6 +1227,7 @@ static gboolean draw_event(GtkWidget *widget, cairo_t *cr)
         return false;
     g_return_val_if_fail(d->ximage != NULL, false);
 
+    color_convert_visible(display, cr);
     spicex_draw_event(display, cr);
     update_mouse_pointer(display);
 
@@ -1799,10 +1871,15 @@ static void update_image(SpiceDisplay *display)
     SpiceDisplayPrivate *d = display->priv;
 
     spicex_image_create(display);
+    clear_color_convert(display);
     if (d->convert)
-        do_color_convert(display, &d->area);
+        queue_color_convert(display, &d->area);
 }
 
+#if GTK_CHECK_VERSION(3, 8, 0)
+static void frame_clock_update(GdkFrameClock *clock, gpointer data);
+#endif
+
 static void realize(GtkWidget *widget)
 {
     SpiceDisplay *display = SPICE_DISPLAY(widget);
@@ -1813,11 +1890,29 @@ static void realize(GtkWidget *widget)
     d->keycode_map =
         vnc_display_keymap_gdk2xtkbd_table(gtk_widget_get_window(widget),
                                            &d->keycode_maplen);
+#if GTK_CHECK_VERSION(3, 8, 0)
+    d->frame_clock = gtk_widget_get_frame_clock(widget);
+    if (d->frame_clock != NULL)
+        d->frame_clock_update_id =
+            g_signal_connect(d->frame_clock, "update",
+                             G_CALLBACK(frame_clock_update), display);
+#endif
     update_image(display);
 }
 
 static void unrealize(GtkWidget *widget)
 {
+#if GTK_CHECK_VERSION(3, 8, 0)
+    SpiceDisplayPrivate *d = SPICE_DISPLAY(widget)->priv;
+
+    if (d->frame_clock_update_id != 0) {
+        g_signal_handler_disconnect(d->frame_clock, d->frame_clock_update_id);
+        d->frame_clock_update_id = 0;
+    }
+    d->frame_clock = NULL;
+    g_clear_pointer(&d->damage, cairo_region_destroy);
+#endif
+    clear_color_convert(SPICE_DISPLAY(widget));
     spicex_image_destroy(SPICE_DISPLAY(widget));
 
     GTK_WIDGET_CLASS(spice_display_parent_class)->unrealize(widget);
@@ -1836,6 +1931,8 @@ static void spice_display_class_init(SpiceDisplayClass *klass)
 #else
     gtkwidget_class->expose_event = expose_event;
 #endif
+    pixel_simd_setup();
+
     gtkwidget_class->key_press_event = key_event;
     gtkwidget_class->key_release_event = key_event;
     gtkwidget_class->enter_notify_event = enter_event;
@@ -2034,6 +2131,26 @@ static void spice_display_class_init(SpiceDisplayClass *klass)
                           G_PARAM_CONSTRUCT |
                           G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceDisplay:scale-filter:
+     *
+     * The filter used when scaling the display. The scaled display is
+     * kept in a buffer at the widget resolution, updated only where
+     * the guest display changed.
+     * (this option is only supported with cairo backend)
+     *
+     * Since: 0.30
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_SCALE_FILTER,
+         g_param_spec_enum("scale-filter", "Scale filter",
+                           "The filter used to scale the display",
+                           SPICE_TYPE_DISPLAY_SCALE_FILTER,
+                           SPICE_DISPLAY_SCALE_FILTER_BOX,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT |
+                           G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceDisplay:monitor-id:
      *
@@ -2172,6 +2289,7 @@ static void update_area(SpiceDisplay *display,
     }
 
     spicex_image_destroy(display);
+    clear_color_convert(display);
     d->area = area;
     if (gtk_widget_get_realized(GTK_WIDGET(display)))
         update_image(display);
@@ -2204,6 +2322,10 @@ static void primary_destroy(SpiceChannel *channel, gpointer data)
     SpiceDisplayPrivate *d = display->priv;
 
     spicex_image_destroy(display);
+    clear_color_convert(display);
+#if GTK_CHECK_VERSION(3, 8, 0)
+    g_clear_pointer(&d->damage, cairo_region_destroy);
+#endif
     d->width  = 0;
     d->height = 0;
     d->stride = 0;
@@ -2213,29 +2335,19 @@ static void primary_destroy(SpiceChannel *channel, gpointer data)
     set_monitor_ready(display, false);
 }
 
-static void invalidate(SpiceChannel *channel,
-                       gint x, gint y, gint w, gint h, gpointer data)
+static void invalidate_area(SpiceDisplay *display, const GdkRectangle *area)
 {
-    SpiceDisplay *display = data;
     SpiceDisplayPrivate *d = display->priv;
     int display_x, display_y;
     int x1, y1, x2, y2;
     double s;
-    GdkRectangle rect = {
-        .x = x,
-        .y = y,
-        .width = w,
-        .height = h
-    };
+    GdkRectangle rect;
 
-    if (!gtk_widget_get_window(GTK_WIDGET(display)))
-        return;
-
-    if (!gdk_rectangle_intersect(&rect, &d->area, &rect))
+    if (!gdk_rectangle_intersect(area, &d->area, &rect))
         return;
 
     if (d->convert)
-        do_color_convert(display, &rect);
+        queue_color_convert(display, &rect);
 
     spice_display_get_scaling(display, &s,
                               &display_x, &display_y,
@@ -2246,11 +2358,74 @@ static void invalidate(SpiceChannel *channel,
     x2 = ceil ((rect.x - d->area.x + rect.width) * s);
     y2 = ceil ((rect.y - d->area.y + rect.height) * s);
 
+    spicex_image_invalidate(display, x1, y1, x2 - x1, y2 - y1);
     gtk_widget_queue_draw_area(GTK_WIDGET(display),
                                display_x + x1, display_y + y1,
                                x2 - x1, y2-y1);
 }
 
+#if GTK_CHECK_VERSION(3, 8, 0)
+/* above this, the bounding box of the damage is redrawn instead */
+#define DAMAGE_RECTS_MAX 32
+
+/* the damage is flushed before the layout and paint of each frame */
+static void frame_clock_update(GdkFrameClock *clock, gpointer data)
+{
+    SpiceDisplay *display = data;
+    SpiceDisplayPrivate *d = display->priv;
+    cairo_region_t *damage = d->damage;
+    cairo_rectangle_int_t rect;
+    int i, n;
+
+    if (damage == NULL)
+        return;
+
+    d->damage = NULL;
+    n = cairo_region_num_rectangles(damage);
+    if (n > DAMAGE_RECTS_MAX) {
+        cairo_region_get_extents(damage, &rect);
+        invalidate_area(display, &rect);
+    } else {
+        for (i = 0; i < n; i++) {
+            cairo_region_get_rectangle(damage, i, &rect);
+            invalidate_area(display, &rect);
+        }
+    }
+    cairo_region_destroy(damage);
+}
+#endif
+
+static void invalidate(SpiceChannel *channel,
+                       gint x, gint y, gint w, gint h, gpointer data)
+{
+    SpiceDisplay *display = data;
+#if GTK_CHECK_VERSION(3, 8, 0)
+    SpiceDisplayPrivate *d = display->priv;
+#endif
+    GdkRectangle rect = {
+        .x = x,
+        .y = y,
+        .width = w,
+        .height = h
+    };
+
+    if (!gtk_widget_get_window(GTK_WIDGET(display)))
+        return;
+
+#if GTK_CHECK_VERSION(3, 8, 0)
+    if (d->frame_clock != NULL) {
+        if (d->damage == NULL)
+            d->damage = cairo_region_create();
+        cairo_region_union_rectangle(d->damage, &rect);
+        gdk_frame_clock_request_phase(d->frame_clock,
+                                      GDK_FRAME_CLOCK_PHASE_UPDATE);
+        return;
+    }
+#endif
+
+    invalidate_area(display, &rect);
+}
+
 static void mark(SpiceDisplay *display, gint mark)
 {
     SpiceDisplayPrivate *d = display->priv;
@@ -2663,6 +2838,9 @@ GdkPixbuf *spice_display_get_pixbuf(SpiceDisplay *display)
     g_return_val_if_fail(d != NULL, NULL);
     /* TODO: ensure d->data has been exposed? */
     g_return_val_if_fail(d->data != NULL, NULL);
+#if GTK_CHECK_VERSION (2, 91, 0)
+    color_convert_pending(display, NULL);
+#endif
 
     data = g_malloc0(d->area.width * d->area.height * 3);
     src = d->data;
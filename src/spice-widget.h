@@ -68,6 +68,24 @@ typedef enum
 	SPICE_DISPLAY_KEY_EVENT_CLICK = 3,
 } SpiceDisplayKeyEvent;
 
+/**
+ * SpiceDisplayScaleFilter:
+ * @SPICE_DISPLAY_SCALE_FILTER_NEAREST: the nearest pixel, fastest
+ * @SPICE_DISPLAY_SCALE_FILTER_BILINEAR: bilinear interpolation
+ * @SPICE_DISPLAY_SCALE_FILTER_BOX: averages all the covered pixels
+ * when scaling down, the smoothest
+ *
+ * The filter used to scale the display, see #SpiceDisplay:scale-filter.
+ *
+ * Since: 0.30
+ **/
+typedef enum
+{
+	SPICE_DISPLAY_SCALE_FILTER_NEAREST,
+	SPICE_DISPLAY_SCALE_FILTER_BILINEAR,
+	SPICE_DISPLAY_SCALE_FILTER_BOX,
+} SpiceDisplayScaleFilter;
+
 GType	        spice_display_get_type(void);
 
 SpiceDisplay* spice_display_new(SpiceSession *session, int channel_id);
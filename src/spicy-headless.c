@@ -0,0 +1,421 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2010 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <unistd.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-cmdline.h"
+
+/* config */
+static gboolean version = FALSE;
+static gint sessions = 1;
+static gint duration = 0;
+static gint interval = 0;
+static gint max_fps = 0;
+
+typedef struct viewer {
+    SpiceSession *session;
+    gboolean     closed;
+} viewer;
+
+typedef struct display {
+    SpiceChannel *channel;
+    gboolean     frame_pending;
+    guint64      frames;
+    guint64      pixels;
+} display;
+
+/* state */
+static GMainLoop     *mainloop;
+static GPtrArray     *viewers;
+static GPtrArray     *displays;
+static gint          viewers_open;
+
+static const char *display_msg_names[SPICE_MSG_END_DISPLAY] = {
+    [ SPICE_MSG_DISPLAY_MODE ]               = "mode",
+    [ SPICE_MSG_DISPLAY_MARK ]               = "mark",
+    [ SPICE_MSG_DISPLAY_RESET ]              = "reset",
+    [ SPICE_MSG_DISPLAY_COPY_BITS ]          = "copy-bits",
+    [ SPICE_MSG_DISPLAY_INVAL_LIST ]         = "inval-list",
+    [ SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS ]  = "inval-all-pixmaps",
+    [ SPICE_MSG_DISPLAY_INVAL_PALETTE ]      = "inval-palette",
+    [ SPICE_MSG_DISPLAY_INVAL_ALL_PALETTES ] = "inval-all-palettes",
+    [ SPICE_MSG_DISPLAY_STREAM_CREATE ]      = "stream-create",
+    [ SPICE_MSG_DISPLAY_STREAM_DATA ]        = "stream-data",
+    [ SPICE_MSG_DISPLAY_STREAM_CLIP ]        = "stream-clip",
+    [ SPICE_MSG_DISPLAY_STREAM_DESTROY ]     = "stream-destroy",
+    [ SPICE_MSG_DISPLAY_STREAM_DESTROY_ALL ] = "stream-destroy-all",
+    [ SPICE_MSG_DISPLAY_DRAW_FILL ]          = "draw-fill",
+    [ SPICE_MSG_DISPLAY_DRAW_OPAQUE ]        = "draw-opaque",
+    [ SPICE_MSG_DISPLAY_DRAW_COPY ]          = "draw-copy",
+    [ SPICE_MSG_DISPLAY_DRAW_BLEND ]         = "draw-blend",
+    [ SPICE_MSG_DISPLAY_DRAW_BLACKNESS ]     = "draw-blackness",
+    [ SPICE_MSG_DISPLAY_DRAW_WHITENESS ]     = "draw-whiteness",
+    [ SPICE_MSG_DISPLAY_DRAW_INVERS ]        = "draw-invers",
+    [ SPICE_MSG_DISPLAY_DRAW_ROP3 ]          = "draw-rop3",
+    [ SPICE_MSG_DISPLAY_DRAW_STROKE ]        = "draw-stroke",
+    [ SPICE_MSG_DISPLAY_DRAW_TEXT ]          = "draw-text",
+    [ SPICE_MSG_DISPLAY_DRAW_TRANSPARENT ]   = "draw-transparent",
+    [ SPICE_MSG_DISPLAY_DRAW_ALPHA_BLEND ]   = "draw-alpha-blend",
+    [ SPICE_MSG_DISPLAY_SURFACE_CREATE ]     = "surface-create",
+    [ SPICE_MSG_DISPLAY_SURFACE_DESTROY ]    = "surface-destroy",
+    [ SPICE_MSG_DISPLAY_STREAM_DATA_SIZED ]  = "stream-data-sized",
+    [ SPICE_MSG_DISPLAY_MONITORS_CONFIG ]    = "monitors-config",
+    [ SPICE_MSG_DISPLAY_DRAW_COMPOSITE ]     = "draw-composite",
+};
+
+/* ------------------------------------------------------------------ */
+static void main_channel_event(SpiceChannel *channel, SpiceChannelEvent event,
+                               gpointer data)
+{
+    viewer *v = data;
+
+    switch (event) {
+    case SPICE_CHANNEL_OPENED:
+        break;
+    default:
+        g_warning("main channel event: %d", event);
+        if (v->closed)
+            break;
+        v->closed = TRUE;
+        if (--viewers_open == 0)
+            g_main_loop_quit(mainloop);
+    }
+}
+
+static gboolean display_frame_done(gpointer data)
+{
+    display *d = data;
+
+    d->frame_pending = FALSE;
+    d->frames++;
+
+    return FALSE;
+}
+
+static void display_invalidate(SpiceChannel *channel,
+                               gint x, gint y, gint w, gint h,
+                               gpointer data)
+{
+    display *d = data;
+
+    d->pixels += (guint64)w * h;
+
+    /* all the damage flushed in one main loop iteration is one frame */
+    if (!d->frame_pending) {
+        d->frame_pending = TRUE;
+        g_idle_add(display_frame_done, d);
+    }
+}
+
+static void display_primary_create(SpiceChannel *channel, gint format,
+                                   gint width, gint height, gint stride,
+                                   gint shmid, gpointer imgdata, gpointer data)
+{
+    gint id;
+
+    g_object_get(channel, "channel-id", &id, NULL);
+    SPICE_DEBUG("display %d: primary surface %dx%d", id, width, height);
+}
+
+static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
+{
+    if (SPICE_IS_MAIN_CHANNEL(channel)) {
+        SPICE_DEBUG("new main channel");
+        g_signal_connect(channel, "channel-event",
+                         G_CALLBACK(main_channel_event), data);
+    } else if (SPICE_IS_DISPLAY_CHANNEL(channel)) {
+        display *d = g_new0(display, 1);
+
+        d->channel = g_object_ref(channel);
+        g_ptr_array_add(displays, d);
+        if (max_fps > 0)
+            g_object_set(channel, "max-invalidate-rate", max_fps, NULL);
+        g_signal_connect(channel, "display-primary-create",
+                         G_CALLBACK(display_primary_create), d);
+        g_signal_connect(channel, "display-invalidate",
+                         G_CALLBACK(display_invalidate), d);
+    } else if (!SPICE_IS_CURSOR_CHANNEL(channel)) {
+        /* nothing else takes part in the rendering */
+        return;
+    }
+
+    spice_channel_connect(channel);
+}
+
+/* ------------------------------------------------------------------ */
+
+static guint64 get_rss(void)
+{
+    gchar *contents;
+    guint64 rss = 0;
+    unsigned long size, resident;
+
+    if (!g_file_get_contents("/proc/self/statm", &contents, NULL, NULL))
+        return 0;
+    if (sscanf(contents, "%lu %lu", &size, &resident) == 2)
+        rss = (guint64)resident * sysconf(_SC_PAGESIZE);
+    g_free(contents);
+
+    return rss;
+}
+
+static void print_draw_stats(void)
+{
+    guint64 count[SPICE_MSG_END_DISPLAY] = { 0, };
+    guint64 bytes[SPICE_MSG_END_DISPLAY] = { 0, };
+    guint64 handler_time[SPICE_MSG_END_DISPLAY] = { 0, };
+    guint i, j;
+
+    for (i = 0; i < displays->len; i++) {
+        display *d = g_ptr_array_index(displays, i);
+        SpiceChannelStats *stats = spice_channel_get_stats(d->channel);
+
+        for (j = 0; j < stats->n_msg_stats; j++) {
+            SpiceChannelMsgStats *msg = &stats->msg_stats[j];
+
+            if (msg->type >= SPICE_MSG_END_DISPLAY)
+                continue;
+            count[msg->type] += msg->count;
+            bytes[msg->type] += msg->bytes;
+            handler_time[msg->type] += msg->handler_time;
+        }
+        spice_channel_stats_free(stats);
+    }
+
+    for (i = 0; i < SPICE_MSG_END_DISPLAY; i++) {
+        if (count[i] == 0)
+            continue;
+        if (display_msg_names[i])
+            printf("    %-20s", display_msg_names[i]);
+        else
+            printf("    type %-15u", i);
+        printf(" %10" G_GUINT64_FORMAT " msgs %10" G_GUINT64_FORMAT " kbytes"
+               " avg %6" G_GUINT64_FORMAT " us total %8" G_GUINT64_FORMAT " ms\n",
+               count[i], bytes[i] / 1024, handler_time[i] / count[i], handler_time[i] / 1000);
+    }
+}
+
+static void print_memory_stats(void)
+{
+    guint64 surfaces_bytes = 0, cache_bytes = 0, glz_bytes = 0;
+    guint i;
+
+    for (i = 0; i < displays->len; i++) {
+        display *d = g_ptr_array_index(displays, i);
+        guint64 bytes;
+
+        g_object_get(d->channel, "surfaces-bytes", &bytes, NULL);
+        surfaces_bytes += bytes;
+    }
+    for (i = 0; i < viewers->len; i++) {
+        viewer *v = g_ptr_array_index(viewers, i);
+        guint64 cache, glz;
+
+        g_object_get(v->session,
+                     "images-cache-bytes", &cache,
+                     "glz-window-bytes", &glz,
+                     NULL);
+        cache_bytes += cache;
+        glz_bytes += glz;
+    }
+
+    printf("memory: surfaces %" G_GUINT64_FORMAT " kbytes"
+           " images cache %" G_GUINT64_FORMAT " kbytes"
+           " glz window %" G_GUINT64_FORMAT " kbytes"
+           " rss %" G_GUINT64_FORMAT " kbytes\n",
+           surfaces_bytes / 1024, cache_bytes / 1024, glz_bytes / 1024,
+           get_rss() / 1024);
+}
+
+static void print_report(gint64 elapsed, guint64 frames, guint64 pixels)
+{
+    gdouble seconds = elapsed / (gdouble)G_USEC_PER_SEC;
+    gdouble fps = seconds > 0 ? frames / seconds : 0;
+
+    printf("%.1f s: %u viewers %u displays %" G_GUINT64_FORMAT " frames"
+           " %.1f fps (%.1f per display) %.1f Mpixels/s\n",
+           seconds, viewers_open, displays->len, frames, fps,
+           displays->len ? fps / displays->len : 0,
+           seconds > 0 ? pixels / seconds / 1000000 : 0);
+    print_draw_stats();
+    print_memory_stats();
+    printf("\n");
+    fflush(stdout);
+}
+
+static void get_frames(guint64 *frames, guint64 *pixels)
+{
+    guint i;
+
+    *frames = *pixels = 0;
+    for (i = 0; i < displays->len; i++) {
+        display *d = g_ptr_array_index(displays, i);
+
+        *frames += d->frames;
+        *pixels += d->pixels;
+    }
+}
+
+static gint64 start_time;
+static gint64 last_time;
+static guint64 last_frames;
+static guint64 last_pixels;
+
+static gboolean print_stats(gpointer data)
+{
+    gint64 now = g_get_monotonic_time();
+    guint64 frames, pixels;
+
+    get_frames(&frames, &pixels);
+    print_report(now - last_time, frames - last_frames, pixels - last_pixels);
+    last_time = now;
+    last_frames = frames;
+    last_pixels = pixels;
+
+    return TRUE;
+}
+
+static gboolean quit(gpointer data)
+{
+    g_main_loop_quit(mainloop);
+
+    return FALSE;
+}
+
+static GOptionEntry app_entries[] = {
+    {
+        .long_name        = "version",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &version,
+        .description      = "Display version and quit",
+    },
+    {
+        .long_name        = "sessions",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &sessions,
+        .description      = "Number of simultaneous viewers",
+        .arg_description  = "<count>",
+    },
+    {
+        .long_name        = "duration",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &duration,
+        .description      = "Quit after <seconds>",
+        .arg_description  = "<seconds>",
+    },
+    {
+        .long_name        = "interval",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &interval,
+        .description      = "Print the rendering statistics every <seconds>",
+        .arg_description  = "<seconds>",
+    },
+    {
+        .long_name        = "max-fps",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &max_fps,
+        .description      = "Limit the display updates to <fps> per second",
+        .arg_description  = "<fps>",
+    },
+    {
+        /* end of list */
+    }
+};
+
+static void
+signal_handler(int signum)
+{
+    g_main_loop_quit(mainloop);
+}
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    guint64 frames, pixels;
+    gint i;
+
+    signal(SIGINT, signal_handler);
+
+    /* parse opts */
+    context = g_option_context_new(NULL);
+    g_option_context_set_summary(context, "A Spice client rendering the displays "
+                                 "in memory, used for benchmarks.");
+    g_option_context_set_description(context, "Report bugs to " PACKAGE_BUGREPORT ".");
+    g_option_context_set_main_group(context, spice_cmdline_get_option_group());
+    g_option_context_add_main_entries(context, app_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print("option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+
+    if (version) {
+        g_print("spicy-headless " PACKAGE_VERSION "\n");
+        exit(0);
+    }
+
+    if (sessions < 1 || max_fps < 0 || max_fps > 1000) {
+        g_print("invalid --sessions or --max-fps value\n");
+        exit(1);
+    }
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+    g_type_init();
+#endif
+    mainloop = g_main_loop_new(NULL, false);
+    viewers = g_ptr_array_new();
+    displays = g_ptr_array_new();
+
+    for (i = 0; i < sessions; i++) {
+        viewer *v = g_new0(viewer, 1);
+
+        v->session = spice_session_new();
+        g_object_set(v->session,
+                     "enable-audio", FALSE,
+                     "enable-usbredir", FALSE,
+                     "enable-smartcard", FALSE,
+                     NULL);
+        g_signal_connect(v->session, "channel-new",
+                         G_CALLBACK(channel_new), v);
+        spice_cmdline_session_setup(v->session);
+
+        if (!spice_session_connect(v->session)) {
+            fprintf(stderr, "spice_session_connect failed\n");
+            exit(1);
+        }
+        g_ptr_array_add(viewers, v);
+        viewers_open++;
+    }
+
+    start_time = last_time = g_get_monotonic_time();
+    if (interval > 0)
+        g_timeout_add_seconds(interval, print_stats, NULL);
+    if (duration > 0)
+        g_timeout_add_seconds(duration, quit, NULL);
+
+    g_main_loop_run(mainloop);
+
+    get_frames(&frames, &pixels);
+    printf("total:\n");
+    print_report(g_get_monotonic_time() - start_time, frames, pixels);
+
+    return 0;
+}
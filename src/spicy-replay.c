@@ -0,0 +1,524 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-capture.h"
+
+/*
+ * Replays the channels captures recorded with --spice-capture-dir (or
+ * the SpiceSession:capture-dir property). Each recorded channel gets
+ * a socket pair, a thread writes the recorded link reply and messages
+ * to it, while another one discards what the client sends. The
+ * messages go through the usual handlers of the channels, without
+ * any server.
+ */
+
+/* config */
+static gboolean version = FALSE;
+static gboolean realtime = FALSE;
+static gchar **dirs = NULL;
+
+typedef struct Replay {
+    gchar        *filename;
+    guint8       *data;
+    gsize        size;
+    gint         channel_type;
+    gint         channel_id;
+    const guint8 *link;
+    gsize        link_size;
+    /* offset of the first record */
+    gsize        records;
+
+    SpiceChannel *channel;
+    int          fd;
+    GThread      *feed_thread;
+    GThread      *drain_thread;
+    guint64      messages;
+    gboolean     closed;
+} Replay;
+
+/* state */
+static SpiceSession  *session;
+static GMainLoop     *mainloop;
+static GPtrArray     *replays;
+static gint64        start_time;
+/* time of the first recorded message */
+static guint64       origin_time = G_MAXUINT64;
+static guint         n_open;
+
+/* ------------------------------------------------------------------ */
+
+static gboolean replay_load(Replay *r, GError **error)
+{
+    SpiceCaptureHeader header;
+    SpiceCaptureRecord record;
+    gsize offset;
+
+    if (!g_file_get_contents(r->filename, (gchar **)&r->data, &r->size, error))
+        return FALSE;
+
+    if (r->size < sizeof(header))
+        goto invalid;
+    memcpy(&header, r->data, sizeof(header));
+    if (memcmp(header.magic, SPICE_CAPTURE_MAGIC, sizeof(header.magic)) != 0 ||
+        GUINT32_FROM_LE(header.version) != SPICE_CAPTURE_VERSION)
+        goto invalid;
+
+    r->channel_type = GUINT32_FROM_LE(header.channel_type);
+    r->channel_id = GUINT32_FROM_LE(header.channel_id);
+    r->link = r->data + sizeof(header);
+    r->link_size = GUINT32_FROM_LE(header.link_size);
+    if (r->link_size < sizeof(SpiceLinkHeader) + sizeof(SpiceLinkReply) ||
+        r->link_size > r->size - sizeof(header))
+        goto invalid;
+    r->records = sizeof(header) + r->link_size;
+
+    /* check the records once, the feeding thread trusts them */
+    for (offset = r->records; offset < r->size; ) {
+        if (r->size - offset < sizeof(record))
+            goto invalid;
+        memcpy(&record, r->data + offset, sizeof(record));
+        offset += sizeof(record);
+        if (GUINT32_FROM_LE(record.size) > r->size - offset)
+            goto invalid;
+        offset += GUINT32_FROM_LE(record.size);
+        origin_time = MIN(origin_time, GUINT64_FROM_LE(record.time));
+        r->messages++;
+    }
+
+    return TRUE;
+
+invalid:
+    g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                "%s is not a valid capture", r->filename);
+    return FALSE;
+}
+
+static void replay_free(Replay *r)
+{
+    g_clear_object(&r->channel);
+    g_free(r->filename);
+    g_free(r->data);
+    g_free(r);
+}
+
+static gboolean load_dir(const gchar *dir, GError **error)
+{
+    GDir *d = g_dir_open(dir, 0, error);
+    const gchar *name;
+
+    if (d == NULL)
+        return FALSE;
+
+    while ((name = g_dir_read_name(d)) != NULL) {
+        Replay *r;
+
+        if (!g_str_has_suffix(name, SPICE_CAPTURE_SUFFIX))
+            continue;
+
+        r = g_new0(Replay, 1);
+        r->fd = -1;
+        r->filename = g_build_filename(dir, name, NULL);
+        if (!replay_load(r, error)) {
+            replay_free(r);
+            g_dir_close(d);
+            return FALSE;
+        }
+        g_ptr_array_add(replays, r);
+    }
+    g_dir_close(d);
+
+    return TRUE;
+}
+
+static Replay *lookup_replay(gint channel_type, gint channel_id)
+{
+    guint i;
+
+    for (i = 0; i < replays->len; i++) {
+        Replay *r = g_ptr_array_index(replays, i);
+
+        if (r->channel_type == channel_type && r->channel_id == channel_id)
+            return r;
+    }
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* replay threads                                                     */
+
+typedef struct Output {
+    int    fd;
+    guint8 buf[64 * 1024];
+    gsize  len;
+    gboolean failed;
+} Output;
+
+static void output_flush(Output *out)
+{
+    gsize pos = 0;
+
+    while (!out->failed && pos < out->len) {
+        ssize_t n = send(out->fd, out->buf + pos, out->len - pos, MSG_NOSIGNAL);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            /* the client went away */
+            out->failed = TRUE;
+            break;
+        }
+        pos += n;
+    }
+    out->len = 0;
+}
+
+static void output_write(Output *out, const void *data, gsize size)
+{
+    const guint8 *p = data;
+
+    while (size > 0 && !out->failed) {
+        gsize n = MIN(size, sizeof(out->buf) - out->len);
+
+        memcpy(out->buf + out->len, p, n);
+        out->len += n;
+        p += n;
+        size -= n;
+        if (out->len == sizeof(out->buf))
+            output_flush(out);
+    }
+}
+
+/* the client can't do SASL without a server, and ignores the ticket */
+static void write_link(Output *out, Replay *r)
+{
+    guint8 *link = g_memdup(r->link, r->link_size);
+    SpiceLinkReply *reply = (SpiceLinkReply *)(link + sizeof(SpiceLinkHeader));
+    guint32 caps_offset = GUINT32_FROM_LE(reply->caps_offset);
+    guint32 link_res = GUINT32_TO_LE(SPICE_LINK_ERR_OK);
+
+    if (GUINT32_FROM_LE(reply->num_common_caps) > 0 &&
+        sizeof(SpiceLinkHeader) + caps_offset + sizeof(guint32) <= r->link_size) {
+        guint8 *p = link + sizeof(SpiceLinkHeader) + caps_offset;
+        guint32 caps;
+
+        memcpy(&caps, p, sizeof(caps));
+        caps = GUINT32_FROM_LE(caps);
+        caps &= ~(1 << SPICE_COMMON_CAP_AUTH_SASL);
+        caps |= 1 << SPICE_COMMON_CAP_AUTH_SPICE;
+        caps = GUINT32_TO_LE(caps);
+        memcpy(p, &caps, sizeof(caps));
+    }
+
+    output_write(out, link, r->link_size);
+    output_write(out, &link_res, sizeof(link_res));
+    g_free(link);
+}
+
+static gpointer feed_thread(gpointer data)
+{
+    Replay *r = data;
+    Output *out = g_new0(Output, 1);
+    gsize offset = r->records;
+
+    out->fd = r->fd;
+    write_link(out, r);
+
+    while (offset < r->size && !out->failed) {
+        SpiceCaptureRecord record;
+        guint32 size;
+
+        memcpy(&record, r->data + offset, sizeof(record));
+        offset += sizeof(record);
+        size = GUINT32_FROM_LE(record.size);
+
+        if (realtime) {
+            gint64 due = start_time + (GUINT64_FROM_LE(record.time) - origin_time);
+            gint64 now = g_get_monotonic_time();
+
+            if (due > now) {
+                output_flush(out);
+                g_usleep(due - now);
+            }
+        }
+
+        output_write(out, r->data + offset, size);
+        offset += size;
+    }
+    output_flush(out);
+
+    /* let the channel see the end of the capture */
+    shutdown(r->fd, SHUT_WR);
+    g_free(out);
+
+    return NULL;
+}
+
+static gpointer drain_thread(gpointer data)
+{
+    Replay *r = data;
+    guint8 buf[16 * 1024];
+
+    for (;;) {
+        ssize_t n = recv(r->fd, buf, sizeof(buf), 0);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+    }
+
+    return NULL;
+}
+
+static GThread *replay_thread_new(const gchar *name, GThreadFunc func, Replay *r)
+{
+#if GLIB_CHECK_VERSION(2,32,0)
+    return g_thread_new(name, func, r);
+#else
+    return g_thread_create(func, r, TRUE, NULL);
+#endif
+}
+
+/* ------------------------------------------------------------------ */
+/* session                                                            */
+
+static void channel_event(SpiceChannel *channel, SpiceChannelEvent event,
+                          gpointer data)
+{
+    Replay *r = data;
+
+    switch (event) {
+    case SPICE_CHANNEL_OPENED:
+        break;
+    default:
+        /* the end of the capture, or an error */
+        if (r->closed)
+            break;
+        SPICE_DEBUG("%s closed with event %d", r->filename, event);
+        r->closed = TRUE;
+        if (--n_open == 0)
+            g_main_loop_quit(mainloop);
+    }
+}
+
+/* returns the client side of the connection, or -1 if @channel wasn't recorded */
+static int replay_start(SpiceChannel *channel)
+{
+    gint channel_type, channel_id;
+    Replay *r;
+    int sv[2];
+
+    g_object_get(channel,
+                 "channel-type", &channel_type,
+                 "channel-id", &channel_id,
+                 NULL);
+    r = lookup_replay(channel_type, channel_id);
+    if (r == NULL || r->channel != NULL)
+        return -1;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        g_warning("socketpair failed: %s", g_strerror(errno));
+        return -1;
+    }
+
+    r->channel = g_object_ref(channel);
+    r->fd = sv[0];
+    g_signal_connect(channel, "channel-event", G_CALLBACK(channel_event), r);
+    n_open++;
+
+    r->feed_thread = replay_thread_new("replay-feed", feed_thread, r);
+    r->drain_thread = replay_thread_new("replay-drain", drain_thread, r);
+
+    return sv[1];
+}
+
+static void channel_open_fd(SpiceChannel *channel, int with_tls, gpointer data)
+{
+    int fd = replay_start(channel);
+
+    if (fd == -1) {
+        /* not recorded, give it a connection that is closed already */
+        int sv[2];
+
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+            g_warning("socketpair failed: %s", g_strerror(errno));
+            return;
+        }
+        close(sv[0]);
+        fd = sv[1];
+    }
+
+    spice_channel_open_fd(channel, fd);
+}
+
+static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer data)
+{
+    gint channel_type, channel_id;
+
+    g_object_get(channel,
+                 "channel-type", &channel_type,
+                 "channel-id", &channel_id,
+                 NULL);
+    if (lookup_replay(channel_type, channel_id) == NULL)
+        return;
+
+    g_signal_connect(channel, "open-fd", G_CALLBACK(channel_open_fd), NULL);
+    /* the main channel is connected by spice_session_open_fd() */
+    if (!SPICE_IS_MAIN_CHANNEL(channel))
+        spice_channel_connect(channel);
+}
+
+static void print_replay_stats(Replay *r)
+{
+    SpiceChannelStats *stats;
+    guint i;
+
+    if (r->channel == NULL) {
+        printf("%s-%d: not replayed\n",
+               spice_channel_type_to_string(r->channel_type), r->channel_id);
+        return;
+    }
+
+    stats = spice_channel_get_stats(r->channel);
+    printf("%s-%d: %" G_GUINT64_FORMAT "/%" G_GUINT64_FORMAT " msgs"
+           " %" G_GUINT64_FORMAT " bytes\n",
+           spice_channel_type_to_string(r->channel_type), r->channel_id,
+           stats->messages_read, r->messages, stats->bytes_read);
+    for (i = 0; i < stats->n_msg_stats; i++) {
+        SpiceChannelMsgStats *msg = &stats->msg_stats[i];
+
+        printf("    type %3u: %" G_GUINT64_FORMAT " msgs %" G_GUINT64_FORMAT " bytes"
+               " handler %" G_GUINT64_FORMAT " ms\n",
+               msg->type, msg->count, msg->bytes, msg->handler_time / 1000);
+    }
+    spice_channel_stats_free(stats);
+}
+
+static GOptionEntry app_entries[] = {
+    {
+        .long_name        = "version",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &version,
+        .description      = "Display version and quit",
+    },
+    {
+        .long_name        = "realtime",
+        .short_name       = 'r',
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &realtime,
+        .description      = "Replay the messages at their recorded pace, instead of as fast as possible",
+    },
+    {
+        .long_name        = G_OPTION_REMAINING,
+        .arg              = G_OPTION_ARG_FILENAME_ARRAY,
+        .arg_data         = &dirs,
+        .arg_description  = "<capture-dir>",
+    },
+    {
+        /* end of list */
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    GError *error = NULL;
+    GOptionContext *context;
+    gint64 elapsed;
+    guint i;
+
+    /* parse opts */
+    context = g_option_context_new(NULL);
+    g_option_context_set_summary(context, "Replays the channels captures of a Spice client, without server.");
+    g_option_context_set_description(context, "Report bugs to " PACKAGE_BUGREPORT ".");
+    g_option_context_add_main_entries(context, app_entries, NULL);
+    if (!g_option_context_parse (context, &argc, &argv, &error)) {
+        g_print("option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+
+    if (version) {
+        g_print("spicy-replay " PACKAGE_VERSION "\n");
+        exit(0);
+    }
+
+    if (dirs == NULL || dirs[0] == NULL || dirs[1] != NULL) {
+        g_printerr("usage: spicy-replay [--realtime] <capture-dir>\n");
+        exit(1);
+    }
+
+#if !GLIB_CHECK_VERSION(2,36,0)
+    g_type_init();
+#endif
+    mainloop = g_main_loop_new(NULL, FALSE);
+
+    replays = g_ptr_array_new_with_free_func((GDestroyNotify)replay_free);
+    if (!load_dir(dirs[0], &error)) {
+        g_printerr("%s\n", error->message);
+        exit(1);
+    }
+
+    if (lookup_replay(SPICE_CHANNEL_MAIN, 0) == NULL) {
+        g_printerr("no main channel capture in %s\n", dirs[0]);
+        exit(1);
+    }
+
+    session = spice_session_new();
+    g_signal_connect(session, "channel-new",
+                     G_CALLBACK(channel_new), NULL);
+
+    /* the channels will ask for their connection with "open-fd" */
+    start_time = g_get_monotonic_time();
+    if (!spice_session_open_fd(session, -1)) {
+        g_printerr("failed to start the main channel replay\n");
+        exit(1);
+    }
+
+    g_main_loop_run(mainloop);
+    elapsed = g_get_monotonic_time() - start_time;
+
+    for (i = 0; i < replays->len; i++)
+        print_replay_stats(g_ptr_array_index(replays, i));
+    printf("replayed in %" G_GINT64_FORMAT " ms\n", elapsed / 1000);
+
+    spice_session_disconnect(session);
+    for (i = 0; i < replays->len; i++) {
+        Replay *r = g_ptr_array_index(replays, i);
+
+        if (r->feed_thread)
+            g_thread_join(r->feed_thread);
+        if (r->drain_thread)
+            g_thread_join(r->drain_thread);
+        if (r->fd != -1)
+            close(r->fd);
+    }
+    g_ptr_array_unref(replays);
+    g_object_unref(session);
+    g_main_loop_unref(mainloop);
+    g_strfreev(dirs);
+
+    return 0;
+}
@@ -23,6 +23,7 @@
 
 /* config */
 static gboolean version = FALSE;
+static gint interval = 0;
 
 /* state */
 static SpiceSession  *session;
@@ -62,6 +63,64 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer *data)
 
 /* ------------------------------------------------------------------ */
 
+static void print_channel_stats(SpiceChannel *channel)
+{
+    SpiceChannelStats *stats = spice_channel_get_stats(channel);
+    gint channel_type, channel_id;
+    guint i;
+
+    g_object_get(channel,
+                 "channel-type", &channel_type,
+                 "channel-id", &channel_id,
+                 NULL);
+    printf("%s-%d: in %" G_GUINT64_FORMAT " bytes/%" G_GUINT64_FORMAT " msgs"
+           " out %" G_GUINT64_FORMAT " bytes/%" G_GUINT64_FORMAT " msgs"
+           " reads %" G_GUINT64_FORMAT " writes %" G_GUINT64_FORMAT
+           " read wait %" G_GUINT64_FORMAT " ms write wait %" G_GUINT64_FORMAT " ms"
+           " xmit queue %u (max %u)\n",
+           spice_channel_type_to_string(channel_type), channel_id,
+           stats->bytes_read, stats->messages_read,
+           stats->bytes_written, stats->messages_written,
+           stats->read_calls, stats->write_calls,
+           stats->read_wait_time / 1000, stats->write_wait_time / 1000,
+           stats->xmit_queue_length, stats->xmit_queue_max_length);
+    for (i = 0; i < stats->n_msg_stats; i++) {
+        SpiceChannelMsgStats *msg = &stats->msg_stats[i];
+
+        printf("    type %3u: %" G_GUINT64_FORMAT " msgs %" G_GUINT64_FORMAT " bytes"
+               " handler %" G_GUINT64_FORMAT " ms\n",
+               msg->type, msg->count, msg->bytes, msg->handler_time / 1000);
+    }
+
+    spice_channel_stats_free(stats);
+}
+
+static gboolean print_stats(gpointer data)
+{
+    GList *iter, *list = spice_session_get_channels(session);
+
+    guint64 cache_bytes, cache_hits, cache_misses, cache_evictions, glz_bytes;
+
+    for (iter = list ; iter ; iter = iter->next)
+        print_channel_stats(iter->data);
+    g_object_get(session,
+                 "images-cache-bytes", &cache_bytes,
+                 "images-cache-hits", &cache_hits,
+                 "images-cache-misses", &cache_misses,
+                 "images-cache-evictions", &cache_evictions,
+                 "glz-window-bytes", &glz_bytes,
+                 NULL);
+    printf("images cache: %" G_GUINT64_FORMAT " bytes hits %" G_GUINT64_FORMAT
+           " misses %" G_GUINT64_FORMAT " evictions %" G_GUINT64_FORMAT "\n",
+           cache_bytes, cache_hits, cache_misses, cache_evictions);
+    printf("glz window: %" G_GUINT64_FORMAT " bytes\n", glz_bytes);
+    printf("\n");
+    fflush(stdout);
+    g_list_free(list);
+
+    return TRUE;
+}
+
 static GOptionEntry app_entries[] = {
     {
         .long_name        = "version",
@@ -69,6 +128,13 @@ static GOptionEntry app_entries[] = {
         .arg_data         = &version,
         .description      = "Display version and quit",
     },
+    {
+        .long_name        = "interval",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &interval,
+        .description      = "Print the channels statistics every <seconds>",
+        .arg_description  = "<seconds>",
+    },
     {
         /* end of list */
     }
@@ -118,7 +184,11 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (interval > 0)
+        g_timeout_add_seconds(interval, print_stats, NULL);
+
     g_main_loop_run(mainloop);
+    print_stats(NULL);
     {
         GList *iter, *list = spice_session_get_channels(session);
         gulong total_read_bytes;
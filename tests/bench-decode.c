@@ -0,0 +1,751 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2016 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Replays compressed image payloads through the client decoders, and
+ * reports their throughput and allocations.
+ *
+ * Without corpus files, a synthetic one is generated: frames of a
+ * scrolling desktop, encoded as GLZ (with references to the previous
+ * frame), zlib-GLZ, JPEG and MJPEG.
+ *
+ * A corpus file is a sequence of records, all integers little endian:
+ *   uint32 kind (1 GLZ, 2 zlib-GLZ, 3 JPEG, 4 MJPEG)
+ *   uint32 size
+ *   uint8  payload[size]
+ * A zlib-GLZ payload starts with the uint32 size of the inflated GLZ
+ * data. GLZ images are replayed in order, with their window ids, and
+ * must not use a palette.
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "gio-coroutine.h"
+#include "decode.h"
+#include "channel-display-priv.h"
+#include "common/lz_common.h"
+
+typedef enum {
+    BENCH_GLZ = 1,
+    BENCH_ZLIB_GLZ,
+    BENCH_JPEG,
+    BENCH_MJPEG,
+    BENCH_N_KINDS,
+} BenchKind;
+
+static const char *kind_names[BENCH_N_KINDS] = {
+    [BENCH_GLZ] = "glz",
+    [BENCH_ZLIB_GLZ] = "zlib-glz",
+    [BENCH_JPEG] = "jpeg",
+    [BENCH_MJPEG] = "mjpeg",
+};
+
+typedef struct BenchPayload {
+    BenchKind kind;
+    guint8 *data;
+    guint32 size;
+} BenchPayload;
+
+typedef struct BenchResult {
+    guint64 frames;
+    guint64 pixels;
+    guint64 in_bytes;
+    gint64 usecs;
+    guint64 allocs;
+} BenchResult;
+
+static gint iterations = 10;
+static gint width = 1024;
+static gint height = 768;
+static gint n_frames = 16;
+static gboolean json = FALSE;
+static gchar *save_corpus = NULL;
+static gchar **corpus_files = NULL;
+
+/* ------------------------------------------------------------------ */
+/* allocation counting */
+
+#ifdef __GLIBC__
+#define HAVE_ALLOC_COUNT 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static volatile gint n_allocs;
+
+void *malloc(size_t size)
+{
+    g_atomic_int_inc(&n_allocs);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    g_atomic_int_inc(&n_allocs);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    g_atomic_int_inc(&n_allocs);
+    return __libc_realloc(ptr, size);
+}
+#else
+static gint n_allocs;
+#endif
+
+/* ------------------------------------------------------------------ */
+/* synthetic corpus */
+
+#define SCROLL_LINES 8
+#define GLYPH_W 6
+#define GLYPH_H 10
+#define VIDEO_W 256
+#define VIDEO_H 192
+
+/* a desktop: gradient background, windows, text and a photo */
+static guint32 *desktop_new(int w, int h)
+{
+    guint32 *pixels = g_new(guint32, w * h);
+    guint8 glyphs[16][GLYPH_H];
+    GRand *rand = g_rand_new_with_seed(42);
+    int x, y, i;
+
+    for (i = 0; i < 16; i++)
+        for (y = 0; y < GLYPH_H; y++)
+            glyphs[i][y] = g_rand_int(rand);
+
+    for (y = 0; y < h; y++) {
+        for (x = 0; x < w; x++) {
+            guint32 *p = &pixels[y * w + x];
+            int wy = y % 256, wx = x % 512;
+
+            if (wx < 16 || wx >= 496 || wy < 8 || wy >= 248) {
+                *p = 0x203040 + (y / 4 % 64);
+            } else if (wy < 32) {
+                *p = 0x3465a4;
+            } else if (wx >= 352 && wy >= 64 && wy < 224) {
+                *p = g_rand_int(rand) & 0xffffff;
+            } else {
+                int glyph = ((y / GLYPH_H) * 7 + (x / GLYPH_W) * 3) % 16;
+                gboolean ink = (glyphs[glyph][y % GLYPH_H] >> (x % GLYPH_W)) & 1;
+                *p = ink ? 0x000000 : 0xffffff;
+            }
+        }
+    }
+
+    g_rand_free(rand);
+    return pixels;
+}
+
+static void put_32(GByteArray *out, guint32 v)
+{
+    guint8 b[4] = { v >> 24, v >> 16, v >> 8, v };
+    g_byte_array_append(out, b, 4);
+}
+
+static void put_8(GByteArray *out, guint8 v)
+{
+    g_byte_array_append(out, &v, 1);
+}
+
+static void glz_put_literal(GByteArray *out, const guint32 *pixels, int n)
+{
+    while (n > 0) {
+        int i, len = MIN(n, 32);
+
+        put_8(out, len - 1);
+        for (i = 0; i < len; i++) {
+            put_8(out, pixels[i]);
+            put_8(out, pixels[i] >> 8);
+            put_8(out, pixels[i] >> 16);
+        }
+        pixels += len;
+        n -= len;
+    }
+}
+
+/* always uses the long pixel offset encoding */
+static void glz_put_match(GByteArray *out, guint32 len, guint32 image_dist,
+                          guint32 pixel_ofs)
+{
+    int i, n_dist = image_dist == 0 ? 0 : image_dist < 0x100 ? 1 :
+                    image_dist < 0x10000 ? 2 : 3;
+
+    if (image_dist == 0)
+        pixel_ofs--;
+
+    put_8(out, (MIN(len, 7) << 5) | 0x10 | (pixel_ofs & 0x0f));
+    if (len >= 7) {
+        for (len -= 7; len >= 255; len -= 255)
+            put_8(out, 255);
+        put_8(out, len);
+    }
+    put_8(out, pixel_ofs >> 4);
+    put_8(out, (n_dist << 6) | 0x20 | ((pixel_ofs >> 12) & 0x1f));
+    for (i = 0; i < n_dist; i++)
+        put_8(out, image_dist >> (8 * i));
+    put_8(out, pixel_ofs >> 17);
+}
+
+static guint32 match_len(const guint32 *a, const guint32 *b, guint32 max)
+{
+    guint32 len = 0;
+
+    while (len < max && a[len] == b[len])
+        len++;
+    return len;
+}
+
+/* A greedy RGB32 GLZ encoder, looking for runs, the line above and
+ * the scrolled previous frame. Not a compressor, just enough to make
+ * the decoder go through its paths. */
+static GByteArray *glz_encode(const guint32 *frame, const guint32 *prev,
+                              int w, int h, guint64 id)
+{
+    GByteArray *out = g_byte_array_new();
+    guint32 n = w * h, i = 0, literal = 0;
+
+    put_32(out, LZ_MAGIC);
+    put_32(out, LZ_VERSION);
+    put_8(out, LZ_IMAGE_TYPE_RGB32 | (1 << LZ_IMAGE_TYPE_LOG));
+    put_32(out, w);
+    put_32(out, h);
+    put_32(out, w * 4);
+    put_32(out, id >> 32);
+    put_32(out, id);
+    put_32(out, prev ? 1 : 0);
+
+    while (i < n) {
+        guint32 len = 0, best = 0, dist = 0, ofs = 0;
+
+        if (i > 0 && (len = match_len(frame + i, frame + i - 1, n - i)) > best) {
+            best = len; dist = 0; ofs = 1;
+        }
+        if (i >= w && (len = match_len(frame + i, frame + i - w, n - i)) > best) {
+            best = len; dist = 0; ofs = w;
+        }
+        if (prev && i + SCROLL_LINES * w < n &&
+            (len = match_len(frame + i, prev + i + SCROLL_LINES * w,
+                             n - i - SCROLL_LINES * w)) > best) {
+            best = len; dist = 1; ofs = i + SCROLL_LINES * w;
+        }
+
+        if (best < 3) {
+            literal++;
+            i++;
+            continue;
+        }
+
+        glz_put_literal(out, frame + i - literal, literal);
+        literal = 0;
+        glz_put_match(out, best, dist, ofs);
+        i += best;
+    }
+    glz_put_literal(out, frame + i - literal, literal);
+
+    return out;
+}
+
+typedef struct jpeg_mem_dest_mgr {
+    struct jpeg_destination_mgr mgr;
+    GByteArray *out;
+    guint8 buf[4096];
+} jpeg_mem_dest_mgr;
+
+static void jpeg_mem_init(j_compress_ptr cinfo)
+{
+    jpeg_mem_dest_mgr *dest = (jpeg_mem_dest_mgr *)cinfo->dest;
+
+    dest->mgr.next_output_byte = dest->buf;
+    dest->mgr.free_in_buffer = sizeof(dest->buf);
+}
+
+static boolean jpeg_mem_empty(j_compress_ptr cinfo)
+{
+    jpeg_mem_dest_mgr *dest = (jpeg_mem_dest_mgr *)cinfo->dest;
+
+    g_byte_array_append(dest->out, dest->buf, sizeof(dest->buf));
+    jpeg_mem_init(cinfo);
+    return TRUE;
+}
+
+static void jpeg_mem_term(j_compress_ptr cinfo)
+{
+    jpeg_mem_dest_mgr *dest = (jpeg_mem_dest_mgr *)cinfo->dest;
+
+    g_byte_array_append(dest->out, dest->buf,
+                        sizeof(dest->buf) - dest->mgr.free_in_buffer);
+}
+
+static GByteArray *jpeg_encode(const guint32 *frame, int w, int h)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    jpeg_mem_dest_mgr dest = {
+        .mgr = {
+            .init_destination = jpeg_mem_init,
+            .empty_output_buffer = jpeg_mem_empty,
+            .term_destination = jpeg_mem_term,
+        },
+        .out = g_byte_array_new(),
+    };
+    guint8 *line = g_malloc(w * 3);
+    int x;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    cinfo.dest = &dest.mgr;
+    cinfo.image_width = w;
+    cinfo.image_height = h;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 85, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    while (cinfo.next_scanline < cinfo.image_height) {
+        const guint32 *p = frame + cinfo.next_scanline * w;
+
+        for (x = 0; x < w; x++) {
+            line[x * 3] = p[x] >> 16;
+            line[x * 3 + 1] = p[x] >> 8;
+            line[x * 3 + 2] = p[x];
+        }
+        jpeg_write_scanlines(&cinfo, &line, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    g_free(line);
+    return dest.out;
+}
+
+static void corpus_add(GArray *corpus, BenchKind kind, GByteArray *data)
+{
+    BenchPayload payload = {
+        .kind = kind,
+        .size = data->len,
+        .data = g_byte_array_free(data, FALSE),
+    };
+
+    g_array_append_val(corpus, payload);
+}
+
+/* the desktop scrolls, while a video plays at a fixed place */
+static guint32 **frames_new(void)
+{
+    guint32 *desktop = desktop_new(width, height + SCROLL_LINES * n_frames);
+    guint32 **frames = g_new(guint32 *, n_frames);
+    GRand *rand = g_rand_new_with_seed(7);
+    int i, x, y;
+
+    for (i = 0; i < n_frames; i++) {
+        frames[i] = g_memdup(desktop + i * SCROLL_LINES * width,
+                             width * height * sizeof(guint32));
+        for (y = MIN(64, height); y < MIN(64 + VIDEO_H, height); y++)
+            for (x = width / 2; x < MIN(width / 2 + VIDEO_W, width); x++)
+                frames[i][y * width + x] = g_rand_int(rand) & 0xffffff;
+    }
+
+    g_rand_free(rand);
+    g_free(desktop);
+    return frames;
+}
+
+static void corpus_generate(GArray *corpus)
+{
+    guint32 **frames = frames_new();
+    BenchKind kind;
+    int i;
+
+    for (kind = BENCH_GLZ; kind < BENCH_N_KINDS; kind++) {
+        for (i = 0; i < n_frames; i++) {
+            guint32 *prev = i > 0 ? frames[i - 1] : NULL;
+            GByteArray *data;
+
+            switch (kind) {
+            case BENCH_GLZ:
+                corpus_add(corpus, kind, glz_encode(frames[i], prev, width, height, i));
+                break;
+            case BENCH_ZLIB_GLZ: {
+                GByteArray *glz = glz_encode(frames[i], prev, width, height, i);
+                uLongf size = compressBound(glz->len);
+                guint32 glz_size = GUINT32_TO_LE(glz->len);
+
+                data = g_byte_array_sized_new(4 + size);
+                g_byte_array_set_size(data, 4 + size);
+                memcpy(data->data, &glz_size, 4);
+                compress2(data->data + 4, &size, glz->data, glz->len, 6);
+                g_byte_array_set_size(data, 4 + size);
+                g_byte_array_free(glz, TRUE);
+                corpus_add(corpus, kind, data);
+                break;
+            }
+            case BENCH_JPEG:
+            case BENCH_MJPEG:
+                corpus_add(corpus, kind, jpeg_encode(frames[i], width, height));
+                break;
+            default:
+                g_return_if_reached();
+            }
+        }
+    }
+
+    for (i = 0; i < n_frames; i++)
+        g_free(frames[i]);
+    g_free(frames);
+}
+
+static gboolean corpus_load(GArray *corpus, const char *filename, GError **error)
+{
+    gchar *contents;
+    gsize length, pos = 0;
+
+    if (!g_file_get_contents(filename, &contents, &length, error))
+        return FALSE;
+
+    while (pos + 8 <= length) {
+        BenchPayload payload;
+        guint32 v;
+
+        memcpy(&v, contents + pos, 4);
+        payload.kind = GUINT32_FROM_LE(v);
+        memcpy(&v, contents + pos + 4, 4);
+        payload.size = GUINT32_FROM_LE(v);
+        pos += 8;
+
+        if (payload.kind < BENCH_GLZ || payload.kind >= BENCH_N_KINDS ||
+            payload.size > length - pos)
+            break;
+
+        payload.data = g_memdup(contents + pos, payload.size);
+        g_array_append_val(corpus, payload);
+        pos += payload.size;
+    }
+
+    g_free(contents);
+    if (pos != length) {
+        g_set_error(error, G_FILE_ERROR, G_FILE_ERROR_INVAL,
+                    "%s: invalid record at offset %" G_GSIZE_FORMAT, filename, pos);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean corpus_save(GArray *corpus, const char *filename, GError **error)
+{
+    GByteArray *out = g_byte_array_new();
+    gboolean ret;
+    guint i;
+
+    for (i = 0; i < corpus->len; i++) {
+        BenchPayload *payload = &g_array_index(corpus, BenchPayload, i);
+        guint32 hdr[2] = { GUINT32_TO_LE(payload->kind), GUINT32_TO_LE(payload->size) };
+
+        g_byte_array_append(out, (guint8 *)hdr, sizeof(hdr));
+        g_byte_array_append(out, payload->data, payload->size);
+    }
+
+    ret = g_file_set_contents(filename, (gchar *)out->data, out->len, error);
+    g_byte_array_free(out, TRUE);
+    return ret;
+}
+
+/* ------------------------------------------------------------------ */
+/* decoding */
+
+typedef struct BenchDecoders {
+    SpiceGlzDecoderWindow *glz_window;
+    SpiceGlzDecoder *glz;
+    SpiceZlibDecoder *zlib;
+    SpiceJpegDecoder *jpeg;
+    mjpeg_decoder mjpeg;
+    GByteArray *buf;
+} BenchDecoders;
+
+static guint64 bench_glz(BenchDecoders *dec, guint8 *data)
+{
+    LzDecodeUsrData usr_data = { NULL, };
+    guint64 pixels;
+
+    dec->glz->ops->decode(dec->glz, data, NULL, &usr_data);
+    g_return_val_if_fail(usr_data.out_surface != NULL, 0);
+
+    pixels = pixman_image_get_width(usr_data.out_surface) *
+        pixman_image_get_height(usr_data.out_surface);
+    pixman_image_unref(usr_data.out_surface);
+    return pixels;
+}
+
+static guint64 bench_decode(BenchDecoders *dec, BenchPayload *payload)
+{
+    int w, h;
+
+    switch (payload->kind) {
+    case BENCH_GLZ:
+        return bench_glz(dec, payload->data);
+    case BENCH_ZLIB_GLZ: {
+        guint32 glz_size;
+
+        memcpy(&glz_size, payload->data, 4);
+        glz_size = GUINT32_FROM_LE(glz_size);
+        g_byte_array_set_size(dec->buf, glz_size);
+        dec->zlib->ops->decode(dec->zlib, payload->data + 4, payload->size - 4,
+                               dec->buf->data, glz_size);
+        return bench_glz(dec, dec->buf->data);
+    }
+    case BENCH_JPEG:
+        dec->jpeg->ops->begin_decode(dec->jpeg, payload->data, payload->size, &w, &h);
+        g_byte_array_set_size(dec->buf, w * h * 4);
+        dec->jpeg->ops->decode(dec->jpeg, dec->buf->data, w * 4, SPICE_BITMAP_FMT_32BIT);
+        return (guint64)w * h;
+    case BENCH_MJPEG: {
+        display_frame frame = {
+            .data = payload->data,
+            .data_size = payload->size,
+        };
+
+        /* the frame size comes from the stream, peek at the header */
+        dec->mjpeg.data = payload->data;
+        dec->mjpeg.data_size = payload->size;
+        jpeg_read_header(&dec->mjpeg.cinfo, TRUE);
+        frame.width = dec->mjpeg.cinfo.image_width;
+        frame.height = dec->mjpeg.cinfo.image_height;
+        jpeg_abort_decompress(&dec->mjpeg.cinfo);
+
+        g_byte_array_set_size(dec->buf, frame.width * frame.height * 4);
+        frame.out_frame = dec->buf->data;
+        mjpeg_decode(&dec->mjpeg, &frame, FALSE);
+        return (guint64)frame.width * frame.height;
+    }
+    default:
+        g_return_val_if_reached(0);
+    }
+}
+
+static gpointer bench_run(gpointer data)
+{
+    GArray *corpus = data;
+    BenchResult *results = g_new0(BenchResult, BENCH_N_KINDS);
+    BenchDecoders dec = { NULL, };
+    gint i;
+    guint j;
+
+    dec.glz_window = glz_decoder_window_new();
+    glz_decoder_window_set_size(dec.glz_window, (gsize)width * height * 4 * 4);
+    dec.glz = glz_decoder_new(dec.glz_window);
+    dec.zlib = zlib_decoder_new();
+    /* as the display channel does */
+    glz_decoder_set_zlib(dec.glz, dec.zlib);
+    dec.jpeg = jpeg_decoder_new();
+    mjpeg_decoder_init(&dec.mjpeg);
+    dec.buf = g_byte_array_new();
+
+    for (i = 0; i < iterations; i++) {
+        /* the GLZ images ids start over */
+        glz_decoder_window_clear(dec.glz_window);
+
+        for (j = 0; j < corpus->len; j++) {
+            BenchPayload *payload = &g_array_index(corpus, BenchPayload, j);
+            BenchResult *r = &results[payload->kind];
+            gint allocs = g_atomic_int_get(&n_allocs);
+            gint64 start = g_get_monotonic_time();
+            guint64 pixels = bench_decode(&dec, payload);
+
+            r->usecs += g_get_monotonic_time() - start;
+            r->allocs += g_atomic_int_get(&n_allocs) - allocs;
+            r->pixels += pixels;
+            r->in_bytes += payload->size;
+            r->frames++;
+        }
+    }
+
+    g_byte_array_free(dec.buf, TRUE);
+    mjpeg_decoder_cleanup(&dec.mjpeg);
+    jpeg_decoder_destroy(dec.jpeg);
+    zlib_decoder_destroy(dec.zlib);
+    glz_decoder_destroy(dec.glz);
+    glz_decoder_window_destroy(dec.glz_window);
+
+    return results;
+}
+
+/* ------------------------------------------------------------------ */
+
+static void print_results(BenchResult *results)
+{
+    BenchKind kind;
+    const char *sep = "";
+
+    if (json)
+        printf("[\n");
+    else
+        printf("# decoder\tframes\tpixels\tin_bytes\tseconds\tmb_per_s\tns_per_pixel\tallocs_per_frame\n");
+
+    for (kind = BENCH_GLZ; kind < BENCH_N_KINDS; kind++) {
+        BenchResult *r = &results[kind];
+        gdouble secs = r->usecs / 1e6;
+        gdouble mb_per_s, ns_per_pixel, allocs;
+
+        if (r->frames == 0)
+            continue;
+
+        /* the throughput of the decoded 32 bits pixels */
+        mb_per_s = secs > 0 ? r->pixels * 4 / secs / 1e6 : 0;
+        ns_per_pixel = r->pixels > 0 ? r->usecs * 1e3 / r->pixels : 0;
+#ifdef HAVE_ALLOC_COUNT
+        allocs = (gdouble)r->allocs / r->frames;
+#else
+        allocs = -1;
+#endif
+
+        if (json) {
+            printf("%s  { \"decoder\": \"%s\", \"frames\": %" G_GUINT64_FORMAT
+                   ", \"pixels\": %" G_GUINT64_FORMAT ", \"in_bytes\": %" G_GUINT64_FORMAT
+                   ", \"seconds\": %.6f, \"mb_per_s\": %.2f, \"ns_per_pixel\": %.3f"
+                   ", \"allocs_per_frame\": %.2f }",
+                   sep, kind_names[kind], r->frames, r->pixels, r->in_bytes,
+                   secs, mb_per_s, ns_per_pixel, allocs);
+            sep = ",\n";
+        } else {
+            printf("%s\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT
+                   "\t%.6f\t%.2f\t%.3f\t%.2f\n",
+                   kind_names[kind], r->frames, r->pixels, r->in_bytes,
+                   secs, mb_per_s, ns_per_pixel, allocs);
+        }
+    }
+
+    if (json)
+        printf("\n]\n");
+}
+
+static GOptionEntry entries[] = {
+    {
+        .long_name        = "iterations",
+        .short_name       = 'n',
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &iterations,
+        .description      = "Number of times the corpus is decoded (default 10)",
+        .arg_description  = "<count>",
+    },
+    {
+        .long_name        = "width",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &width,
+        .description      = "Width of the synthetic frames",
+        .arg_description  = "<pixels>",
+    },
+    {
+        .long_name        = "height",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &height,
+        .description      = "Height of the synthetic frames",
+        .arg_description  = "<pixels>",
+    },
+    {
+        .long_name        = "frames",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &n_frames,
+        .description      = "Number of synthetic frames per decoder",
+        .arg_description  = "<count>",
+    },
+    {
+        .long_name        = "json",
+        .arg              = G_OPTION_ARG_NONE,
+        .arg_data         = &json,
+        .description      = "Print the results as JSON",
+    },
+    {
+        .long_name        = "save-corpus",
+        .arg              = G_OPTION_ARG_FILENAME,
+        .arg_data         = &save_corpus,
+        .description      = "Save the corpus to a file",
+        .arg_description  = "<file>",
+    },
+    {
+        .long_name        = G_OPTION_REMAINING,
+        .arg              = G_OPTION_ARG_FILENAME_ARRAY,
+        .arg_data         = &corpus_files,
+    },
+    {
+        NULL
+    }
+};
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    GArray *corpus;
+    BenchResult *results;
+    GCoroutine co = {
+        .coroutine = {
+            .stack_size = 16 << 20,
+            .entry = bench_run,
+        },
+    };
+    guint i;
+
+    context = g_option_context_new("[CORPUS...] - benchmark the image decoders");
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("option parsing failed: %s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    /* measure the decoders themselves, in the calling thread */
+    g_setenv("SPICE_DISABLE_GLZ_DECODE_THREADS", "1", TRUE);
+
+    corpus = g_array_new(FALSE, FALSE, sizeof(BenchPayload));
+    if (corpus_files == NULL) {
+        corpus_generate(corpus);
+    } else {
+        for (i = 0; corpus_files[i] != NULL; i++) {
+            if (!corpus_load(corpus, corpus_files[i], &error)) {
+                g_printerr("%s\n", error->message);
+                return 1;
+            }
+        }
+    }
+
+    if (save_corpus != NULL && !corpus_save(corpus, save_corpus, &error)) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+
+    /* the GLZ decoder waits for the referenced images in a coroutine */
+    coroutine_init(&co.coroutine);
+    results = coroutine_yieldto(&co.coroutine, corpus);
+    print_results(results);
+
+    for (i = 0; i < corpus->len; i++)
+        g_free(g_array_index(corpus, BenchPayload, i).data);
+    g_array_free(corpus, TRUE);
+    g_free(results);
+    g_strfreev(corpus_files);
+    g_free(save_corpus);
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+#include <glib.h>
+
+#include "spice-channel-cache.h"
+
+static guint n_values;
+
+static gpointer value_new(void)
+{
+    n_values++;
+    return g_new0(guint8, 1);
+}
+
+static void value_free(gpointer value)
+{
+    n_values--;
+    g_free(value);
+}
+
+static gsize value_size(gpointer value, gsize *bytes)
+{
+    *bytes = 40;
+    return 10;
+}
+
+static void test_cache_add_remove(void)
+{
+    display_cache *cache = cache_new(value_free);
+    gboolean lossy;
+    guint64 i;
+
+    /* enough to grow the table a few times */
+    for (i = 0; i < 1000; i++)
+        cache_add_lossy(cache, i << 32, value_new(), i % 2);
+    g_assert_cmpuint(n_values, ==, 1000);
+
+    for (i = 0; i < 1000; i++) {
+        g_assert(cache_find_lossy(cache, i << 32, &lossy) != NULL);
+        g_assert_cmpint(lossy, ==, i % 2);
+    }
+    g_assert(cache_find(cache, 1) == NULL);
+
+    /* removing items must keep the others reachable */
+    for (i = 0; i < 1000; i += 3)
+        g_assert(cache_remove(cache, i << 32));
+    g_assert(!cache_remove(cache, 0));
+    for (i = 0; i < 1000; i++)
+        g_assert((cache_find(cache, i << 32) != NULL) == (i % 3 != 0));
+
+    /* replacing a value destroys the previous one */
+    cache_add(cache, 1 << 0, value_new());
+    cache_add(cache, 1 << 0, value_new());
+    g_assert_cmpuint(n_values, ==, 667);
+
+    cache_clear(cache);
+    g_assert_cmpuint(n_values, ==, 0);
+    g_assert(cache_find(cache, 1 << 0) == NULL);
+
+    cache_unref(cache);
+}
+
+static void test_cache_ref_counted(void)
+{
+    display_cache *cache = cache_image_new(value_free, value_size);
+
+    cache_add(cache, 42, value_new());
+    cache_add(cache, 42, value_new());
+    g_assert_cmpuint(cache->size, ==, 10);
+    g_assert_cmpuint(cache->bytes, ==, 40);
+
+    g_assert(cache_remove(cache, 42));
+    g_assert(cache_find(cache, 42) != NULL);
+    g_assert(cache_remove(cache, 42));
+    g_assert(cache_find(cache, 42) == NULL);
+    g_assert_cmpuint(cache->size, ==, 0);
+    g_assert_cmpuint(cache->bytes, ==, 0);
+    g_assert_cmpuint(n_values, ==, 0);
+
+    cache_unref(cache);
+}
+
+static void test_cache_evict(void)
+{
+    display_cache *cache = cache_image_new(value_free, value_size);
+    guint64 i;
+
+    cache_set_max_size(cache, 100);
+    for (i = 0; i < 10; i++)
+        cache_add(cache, i, value_new());
+    g_assert_cmpuint(cache->evictions, ==, 0);
+
+    /* the least recently used item goes first */
+    g_assert(cache_find(cache, 0) != NULL);
+    cache_add(cache, 10, value_new());
+    g_assert_cmpuint(cache->evictions, ==, 1);
+    g_assert_cmpuint(cache->size, ==, 100);
+    g_assert_cmpuint(cache->bytes, ==, 400);
+    g_assert(cache_find(cache, 0) != NULL);
+    g_assert(cache_find(cache, 1) == NULL);
+    g_assert(cache_is_evicted(cache, 1));
+    g_assert(!cache_is_evicted(cache, 2));
+
+    /* until the server invalidates it */
+    g_assert(cache_remove(cache, 1));
+    g_assert(!cache_is_evicted(cache, 1));
+
+    cache_unref(cache);
+    g_assert_cmpuint(n_values, ==, 0);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/cache/add-remove", test_cache_add_remove);
+    g_test_add_func("/cache/ref-counted", test_cache_ref_counted);
+    g_test_add_func("/cache/evict", test_cache_evict);
+
+    return g_test_run();
+}
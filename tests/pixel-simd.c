@@ -0,0 +1,165 @@
+#include <glib.h>
+
+#include "pixel-simd.h"
+
+/* odd sizes and offsets to go through the vector loops and their tails */
+#define N_PIXELS 1027
+#define PERF_PIXELS (1024 * 1024)
+#define PERF_ROUNDS 100
+
+static const char *levels[] = { "scalar", "sse2", "ssse3", "avx2" };
+
+static void random_bytes(guint8 *buf, gsize len)
+{
+    gsize i;
+
+    for (i = 0; i < len; i++)
+        buf[i] = g_test_rand_int_range(0, 256);
+}
+
+static void test_pixel_simd_convert(void)
+{
+    guint8 *src = g_malloc(N_PIXELS * 3);
+    guint16 *src16 = g_new(guint16, N_PIXELS + 1);
+    guint32 *expected = g_new(guint32, N_PIXELS);
+    guint32 *out = g_new(guint32, N_PIXELS);
+    PixelSimdLevel level;
+    gsize n, i;
+
+    random_bytes(src, N_PIXELS * 3);
+    random_bytes((guint8 *)src16, (N_PIXELS + 1) * 2);
+    for (level = PIXEL_SIMD_SSE2; level <= pixel_simd_detect(); level++) {
+        for (n = 0; n < N_PIXELS; n += 1 + n / 4) {
+            g_assert(pixel_simd_init(PIXEL_SIMD_NONE));
+            pixel_rgb24_to_rgb32(expected, src + 1, n);
+            g_assert(pixel_simd_init(level));
+            pixel_rgb24_to_rgb32(out, src + 1, n);
+            g_assert(memcmp(out, expected, n * 4) == 0);
+
+            g_assert(pixel_simd_init(PIXEL_SIMD_NONE));
+            pixel_rgb555_be_to_rgb32(expected, src + 1, n);
+            g_assert(pixel_simd_init(level));
+            pixel_rgb555_be_to_rgb32(out, src + 1, n);
+            g_assert(memcmp(out, expected, n * 4) == 0);
+
+            g_assert(pixel_simd_init(PIXEL_SIMD_NONE));
+            pixel_rgb555_to_rgb32(expected, src16 + 1, n);
+            g_assert(pixel_simd_init(level));
+            pixel_rgb555_to_rgb32(out, src16 + 1, n);
+            g_assert(memcmp(out, expected, n * 4) == 0);
+
+            g_assert(pixel_simd_init(PIXEL_SIMD_NONE));
+            pixel_rgb565_to_rgb32(expected, src16 + 1, n);
+            g_assert(pixel_simd_init(level));
+            pixel_rgb565_to_rgb32(out, src16 + 1, n);
+            g_assert(memcmp(out, expected, n * 4) == 0);
+
+            memset(out, 0, n * 4);
+            pixel_fill32(out + 1, 0x00abcdef, n - MIN(n, 1));
+            for (i = 1; i < n; i++)
+                g_assert_cmphex(out[i], ==, 0x00abcdef);
+        }
+    }
+
+    /* 555 and 565 to 888 keep the extremes, the top bit of 555 is ignored */
+    src[0] = 0x7f; src[1] = 0xff; src[2] = 0x80; src[3] = 0;
+    g_assert(pixel_simd_init(pixel_simd_detect()));
+    pixel_rgb555_be_to_rgb32(out, src, 2);
+    g_assert_cmphex(out[0], ==, 0x00ffffff);
+    g_assert_cmphex(out[1], ==, 0);
+    src16[0] = 0x7fff; src16[1] = 0x8000; src16[2] = 0xffff; src16[3] = 0;
+    pixel_rgb555_to_rgb32(out, src16, 2);
+    g_assert_cmphex(out[0], ==, 0x00ffffff);
+    g_assert_cmphex(out[1], ==, 0);
+    pixel_rgb565_to_rgb32(out, src16 + 2, 2);
+    g_assert_cmphex(out[0], ==, 0x00ffffff);
+    g_assert_cmphex(out[1], ==, 0);
+
+    g_free(src);
+    g_free(src16);
+    g_free(expected);
+    g_free(out);
+}
+
+static void test_pixel_simd_copy(void)
+{
+    guint32 buf[64], expected[64];
+    gsize dist, n, i;
+
+    for (dist = 1; dist < 8; dist++) {
+        for (n = 1; n < 40; n++) {
+            for (i = 0; i < G_N_ELEMENTS(buf); i++)
+                buf[i] = expected[i] = g_test_rand_int();
+            for (i = 0; i < n; i++)
+                expected[8 + i] = expected[8 + i - dist];
+            pixel_copy32(buf + 8, buf + 8 - dist, n);
+            g_assert(memcmp(buf, expected, sizeof(buf)) == 0);
+        }
+    }
+}
+
+static void test_pixel_simd_perf(void)
+{
+    guint8 *src = g_malloc(PERF_PIXELS * 3);
+    guint32 *out = g_new(guint32, PERF_PIXELS);
+    PixelSimdLevel level;
+
+    random_bytes(src, PERF_PIXELS * 3);
+    for (level = PIXEL_SIMD_NONE; level <= pixel_simd_detect(); level++) {
+        gdouble rgb24, rgb555_be, rgb555, rgb565, fill;
+        int i;
+
+        g_assert(pixel_simd_init(level));
+
+        g_test_timer_start();
+        for (i = 0; i < PERF_ROUNDS; i++)
+            pixel_rgb24_to_rgb32(out, src, PERF_PIXELS);
+        rgb24 = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (i = 0; i < PERF_ROUNDS; i++)
+            pixel_rgb555_be_to_rgb32(out, src, PERF_PIXELS);
+        rgb555_be = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (i = 0; i < PERF_ROUNDS; i++)
+            pixel_rgb555_to_rgb32(out, (const guint16 *)src, PERF_PIXELS);
+        rgb555 = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (i = 0; i < PERF_ROUNDS; i++)
+            pixel_rgb565_to_rgb32(out, (const guint16 *)src, PERF_PIXELS);
+        rgb565 = g_test_timer_elapsed();
+
+        g_test_timer_start();
+        for (i = 0; i < PERF_ROUNDS; i++)
+            pixel_fill32(out, i, PERF_PIXELS);
+        fill = g_test_timer_elapsed();
+
+        g_test_minimized_result(rgb24, "%s rgb24 to rgb32: %.1f Mpixels/s", levels[level],
+                                PERF_ROUNDS * PERF_PIXELS / rgb24 / 1e6);
+        g_test_minimized_result(rgb555_be, "%s rgb555 be to rgb32: %.1f Mpixels/s", levels[level],
+                                PERF_ROUNDS * PERF_PIXELS / rgb555_be / 1e6);
+        g_test_minimized_result(rgb555, "%s rgb555 to rgb32: %.1f Mpixels/s", levels[level],
+                                PERF_ROUNDS * PERF_PIXELS / rgb555 / 1e6);
+        g_test_minimized_result(rgb565, "%s rgb565 to rgb32: %.1f Mpixels/s", levels[level],
+                                PERF_ROUNDS * PERF_PIXELS / rgb565 / 1e6);
+        g_test_minimized_result(fill, "%s fill: %.1f Mpixels/s", levels[level],
+                                PERF_ROUNDS * PERF_PIXELS / fill / 1e6);
+    }
+
+    g_free(src);
+    g_free(out);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/pixel-simd/convert", test_pixel_simd_convert);
+    g_test_add_func("/pixel-simd/copy", test_pixel_simd_copy);
+    if (g_test_perf())
+        g_test_add_func("/pixel-simd/perf", test_pixel_simd_perf);
+
+    return g_test_run();
+}